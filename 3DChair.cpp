@@ -8,6 +8,35 @@
 
 /* Header Inclusions */
 #include <iostream>
+#include <vector>
+#include <map>
+#include <queue>
+#include <tuple>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <immintrin.h>
+#include <cstdio>
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <new>
+#include <array>
+#include <algorithm>
+#include <condition_variable>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 #include <GL/glew.h>
 #include <GL/freeglut.h>
 
@@ -15,6 +44,7 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/packing.hpp>
 
 // SOIL Image Loader Inclusion
 #include "SOIL2/SOIL2.h"
@@ -42,13 +72,10 @@ GLint chairShaderProgram;
 GLint keyLightShaderProgram;
 GLint fillLightShaderProgram;
 
-// Vertex Array & Buffer Objects
-GLuint chairVBO;
-GLuint lightVBO;
+// Vertex Array Objects, their vertex buffers are owned by the residency manager
 GLuint chairVAO;
 GLuint keyLightVAO;
 GLuint fillLightVAO;
-GLuint texture;
 GLfloat degrees = glm::radians(-45.0f);
 
 //Subject position and scale
@@ -95,6 +122,832 @@ glm::vec3 lightScale(0.3f);
 //Camera rotation
 float cameraRotation = glm::radians(-25.0f);
 
+// Field of view passed to glm::perspective
+GLfloat fieldOfView = 45.0f;
+
+
+/* LEVEL OF DETAIL
+ * Every LOD is a contiguous range of vertices in the chair VBO.
+ * LOD 0 is the full mesh and every following LOD is simplified from the one
+ * before it with quadric error edge collapse. geometricError is the largest
+ * object space distance the LOD may deviate from the full mesh.
+ */
+struct MeshLOD {
+	GLint firstVertex;
+	GLsizei vertexCount;
+	GLfloat geometricError;
+};
+
+// A chair placed in the scene, its finish, the LOD it was last drawn with and whether it was hidden
+struct SceneObject {
+	glm::vec3 position;
+	glm::vec3 scale;
+	GLint lod;
+	GLint material;
+	bool occluded;
+};
+
+// LOD chain for the chair mesh
+vector<MeshLOD> chairLODs;
+GLint maxChairLODs = 5;
+
+// LOD selection settings
+bool lodEnabled = true;
+GLfloat lodPixelError = 1.0f;		// Largest screen space error allowed, in pixels
+GLfloat lodHysteresis = 0.75f;		// A coarser LOD must stay below this fraction of the threshold
+
+// Chairs in the scene, the first one is the original chair
+vector<SceneObject> sceneObjects;
+// Number of chairs per row of the showroom grid (0 draws a single chair)
+GLint showroomSize = 0;
+GLfloat showroomSpacing = 6.0f;
+
+
+/* MATERIALS
+ * Finishes are packed into GL_TEXTURE_2D_ARRAY layers, one array per texture
+ * size. Every chair carries its layer as a per-instance attribute, so chairs
+ * that share an array and an LOD are drawn with one instanced call and the
+ * array is bound once for all of them.
+ */
+struct Material {
+	const char* name;
+	const char* file;
+	glm::vec3 fallbackColor;	// Used when the file can't be loaded
+	GLint array;				// Index into materialArrays
+	GLint layer;
+};
+
+// Texture array holding every material of one size
+struct MaterialArray {
+	GLint width, height;
+	GLint layers;
+	GLint resource;			// Residency manager entry of the GL texture
+	GLint levels;			// Full mip chain length
+	GLint tailLevel;		// First level of the coarse tail uploaded before any finer one
+	GLint residentLevel;	// Finest level uploaded, the texture's base level
+	GLint wantedLevel;		// Finest level the chairs on screen need
+	GLfloat minLod;			// Fades a newly uploaded level in from the one below it
+};
+
+// Per-instance attributes of a chair, locations 3-6 hold the model matrix, 7 the material layer and 8 the lightmap layer
+struct ChairInstance {
+	glm::mat4 model;
+	GLfloat layer;
+	GLfloat lightmapLayer;
+};
+
+vector<Material> materials = {
+	{ "wood", "wood_texture.jpg", glm::vec3(0.55f, 0.4f, 0.25f), 0, 0 },
+	{ "fabric", "fabric_texture.jpg", glm::vec3(0.2f, 0.25f, 0.45f), 0, 0 },
+	{ "metal", "metal_texture.jpg", glm::vec3(0.7f, 0.7f, 0.72f), 0, 0 },
+};
+vector<MaterialArray> materialArrays;
+const GLint fallbackTextureSize = 64;
+
+// Instance data of the chairs, rebuilt every frame
+GLuint chairInstanceVBO;
+GLint chairInstanceResource;
+vector<ChairInstance> chairInstances;
+
+// Where each texture array and LOD batch starts in chairInstances, reused every frame
+vector<GLuint> batchOffsets;
+vector<GLuint> batchCursors;
+
+// Batches chairs by texture array and LOD, off draws and binds per chair
+bool materialBatching = true;
+
+
+/* MULTI-VIEW
+ * Top, perspective, front and side views in the four quarters of the window.
+ * The single pass path issues every draw once, instanced once per view, and
+ * a geometry shader routes each instance to its viewport through
+ * GL_ARB_viewport_array. The per-view matrices live in one uniform buffer.
+ */
+const GLint maxViews = 4;
+GLint viewCount = maxViews;
+bool multiViewEnabled = false;
+bool multiViewSinglePass = true;
+bool multiViewSupported = false;
+
+// Viewport rectangle of a view, in window pixels
+struct ViewRect {
+	GLint x, y, width, height;
+};
+
+glm::mat4 viewMatrices[maxViews];
+glm::mat4 projectionMatrices[maxViews];
+ViewRect viewRects[maxViews];
+
+// Uniform buffer holding viewMatrices followed by projectionMatrices (std140)
+GLuint viewUBO;
+const GLuint viewBlockBinding = 0;
+
+// Multi-view shader program IDs
+GLint chairMultiViewShaderProgram;
+GLint keyLightMultiViewShaderProgram;
+GLint fillLightMultiViewShaderProgram;
+
+
+/* RAY PICKING
+ * Bounding volume hierarchies built with the surface area heuristic.
+ * Mesh leaves hold up to four triangles packed for 4-wide SSE intersection,
+ * the scene hierarchy's leaves hold up to four object indices. Coherent rays
+ * can also be traced four at a time, one per SSE lane.
+ */
+struct AABB {
+	glm::vec3 min;
+	glm::vec3 max;
+};
+
+struct alignas(16) BVHNode {
+	glm::vec3 boundsMin;
+	GLuint leftOrFirst;		// Left child (right child follows it), or first primitive of a leaf
+	glm::vec3 boundsMax;
+	GLuint count;			// Primitives in a leaf, 0 for inner nodes
+};
+
+// Four triangles in structure of arrays layout, unused lanes have zero edges
+struct alignas(16) TrianglePacket {
+	GLfloat v0[3][4];
+	GLfloat edge1[3][4];
+	GLfloat edge2[3][4];
+	GLuint triangle[4];
+};
+
+// Mesh BVH, leaf leftOrFirst indexes packets
+struct MeshBVH {
+	vector<BVHNode> nodes;
+	vector<TrianglePacket> packets;
+	GLuint depth;			// Levels below the root, sizes the traversal stack
+};
+
+// Closest hit along a ray
+struct RayHit {
+	GLfloat t;
+	GLuint triangle;
+	GLint object;
+};
+
+// Four rays in structure of arrays layout, lane i of every component is ray i
+struct RayPacket {
+	__m128 origin[3];
+	__m128 direction[3];
+	__m128 inverseDirection[3];
+};
+
+const GLuint bvhMaxLeafSize = 4;
+
+// Chair mesh and scene hierarchies
+MeshBVH chairBVH;
+vector<BVHNode> sceneBVH;
+vector<GLuint> sceneBVHObjects;
+GLuint sceneBVHDepth = 0;
+
+// Chair parts, by first triangle of the full detail mesh
+const char* chairPartNames[] = { "seat", "back", "right front leg", "left front leg", "right back leg", "left back leg" };
+const GLuint chairPartFirstTriangle[] = { 0, 12, 22, 30, 38, 46 };
+
+// Camera of the last frame, used to unproject mouse clicks
+glm::mat4 lastView(1.0f);
+glm::mat4 lastProjection(1.0f);
+
+// Selected chair and part, -1 when nothing is selected
+GLint selectedObject = -1;
+GLint selectedPart = -1;
+
+// Headless benchmark of the picking BVH
+bool benchmarkPicking = false;
+
+
+/* INPUT RECORD AND REPLAY
+ * A recording is an InputRecordHeader followed by one InputRecord per event.
+ * Each record carries the camera state the event produced, so a replay sets
+ * the camera directly instead of re-running the mouse handlers.
+ */
+enum InputEventType {
+	InputMouseMove = 0,		// UMouseMove
+	InputMotion = 1,		// onMotion
+	InputClick = 2,			// OnMouseClicks
+	InputKey = 3			// UKeyboard
+};
+
+struct InputRecordHeader {
+	char magic[4];			// "CHRI"
+	GLuint version;
+	GLint windowWidth;
+	GLint windowHeight;
+};
+
+struct InputRecord {
+	GLfloat time;			// Seconds since the recording started
+	GLubyte type;			// InputEventType
+	GLubyte button;			// Mouse button, or the key of a key event
+	GLubyte state;
+	GLubyte modifiers;
+	GLshort x, y;
+
+	// Camera state after the event
+	GLfloat yaw, pitch;
+	GLfloat front[3];
+	GLfloat scale[3];
+};
+
+static_assert(sizeof(InputRecord) == 44, "InputRecord is written to disk as is");
+
+const GLuint inputRecordVersion = 1;
+
+// Recording
+FILE* recordFile = NULL;
+chrono::steady_clock::time_point recordStart;
+
+// Replay
+bool replayActive = false;
+bool replayDispatching = false;		// Set while replayed key events run through UKeyboard
+bool replayHeadless = false;
+GLfloat replayTimestep = 1.0f / 60.0f;
+GLfloat replayPerfBudget = 0.0f;	// Largest 95th percentile frame time in ms, 0 to disable
+vector<InputRecord> replayRecords;
+size_t replayNextRecord = 0;
+GLint replayFrame = 0;
+vector<GLfloat> replayCpuTimes;		// Per frame, milliseconds
+vector<GLfloat> replayFrameTimes;
+string replayTimingsPath = "replay_timings.csv";
+int replayExitStatus = EXIT_SUCCESS;	// Returned from main once the replay leaves the main loop
+
+
+/* RENDER GRAPH
+ * Every frame the passes are declared with the textures they read and write,
+ * then compiled: passes that don't contribute to the back buffer are culled,
+ * the rest are ordered by their dependencies, and transient textures whose
+ * lifetimes don't overlap share one physical texture.
+ */
+struct RenderTextureDesc {
+	GLint width;
+	GLint height;
+	GLenum internalFormat;
+};
+
+struct RenderResource {
+	string name;
+	RenderTextureDesc desc;
+	bool imported;			// Owned outside the graph, like the back buffer
+	GLint firstUse;			// Execution order index of the first and last pass using it
+	GLint lastUse;
+	GLint physical;			// Index into physicalTextures, -1 when not allocated
+};
+
+struct RenderPass {
+	string name;
+	vector<GLint> reads;
+	vector<GLint> writes;
+	function<void()> execute;
+	vector<GLint> dependencies;		// Passes that must run first
+	vector<GLint> producers;		// Passes writing what this pass reads
+	bool alive;
+};
+
+// Pooled GL texture that transient resources are assigned to
+struct PhysicalTexture {
+	RenderTextureDesc desc;
+	GLuint texture;
+	GLint busyUntil;		// Last pass of the current frame using it, -1 when free
+	GLint lastUsedFrame;
+};
+
+vector<RenderResource> graphResources;
+vector<RenderPass> graphPasses;
+vector<GLint> graphOrder;
+vector<PhysicalTexture> physicalTextures;
+GLuint renderGraphFBO;
+GLint renderGraphFrame = 0;
+bool renderGraphAliasing = true;
+bool renderGraphDumpRequested = false;
+
+// Transient texture memory of the last compiled graph
+size_t transientBytesAliased = 0;
+size_t transientBytesUnaliased = 0;
+
+// Scene resolution relative to the window, anything but 1 renders offscreen
+GLfloat renderScale = 1.0f;
+GLint renderTargetWidth = 800;
+GLint renderTargetHeight = 600;
+
+// Debug view of the linearized scene depth
+bool showDepthBuffer = false;
+GLint depthViewShaderProgram;
+GLuint fullscreenVAO;
+
+
+/* PATH TRACER
+ * Offline renderer for photoreal stills, runs without a window.
+ * Camera rays are traced through the scene BVH as packets of four, one 2x2
+ * pixel quad per packet with a ray in each SSE lane. Bounces and shadow rays
+ * diverge, so they are traced one at a time with the picking tests. It
+ * lights the chairs with the key and fill lights as spherical area lights,
+ * and refines one sample per pixel per pass until the sample budget or the
+ * time limit is reached. Tiles are spread over per-thread queues, threads
+ * that run out of tiles steal from the others. The threads live for the
+ * whole render and are woken once per pass.
+ */
+struct PathTraceTile {
+	GLint x0, y0, x1, y1;
+};
+
+// Tiles owned by one thread, the owner pops from the back, thieves take from the front
+struct TileQueue {
+	mutex lock;
+	deque<PathTraceTile> tiles;
+};
+
+// Helper threads of a render and their tile queues, the calling thread is thread 0
+struct PathTracePool {
+	vector<thread> helpers;
+	vector<TileQueue> queues;			// One per thread, refilled every pass
+	mutex lock;
+	condition_variable wake, finished;
+	unsigned long generation;			// Bumped once per pass
+	GLint running;						// Helpers still working on the current pass
+	bool stopping;
+	function<void(GLint)> pass;			// Run by every thread with its id
+};
+
+bool pathTraceMode = false;
+bool pathTraceScaling = false;
+string pathTraceOutput = "chair.ppm";
+GLint pathTraceSamples = 64;			// Samples per pixel
+GLfloat pathTraceTimeLimit = 0.0f;		// Seconds, 0 for no limit
+GLint pathTraceThreads = 0;				// 0 uses every core
+GLint pathTraceMaxDepth = 5;
+GLint pathTraceTileSize = 32;
+GLfloat lightRadiance = 100.0f;			// Emitted radiance of the light spheres
+GLfloat floorHeight = -3.0f;			// Bottom of the chair legs
+glm::vec3 floorAlbedo(0.6f);
+GLfloat environmentRadiance = 0.1f;		// Same strength as the shader's ambient term
+
+// CPU copy of wood_texture.jpg
+vector<GLubyte> woodTexels;
+GLint woodWidth = 0, woodHeight = 0;
+
+
+/* RESIDENCY
+ * Every GL buffer and texture is registered with its size in bytes. Ones
+ * built from an asset also get a loader that can build them again. When
+ * usage goes over residencyBudget the least recently drawn of those are
+ * deleted, and the next draw that needs one reloads it, which is counted as a
+ * reload stall. Resources drawn in the current or previous frame are never
+ * evicted, a working set larger than the budget stays over budget instead of
+ * reloading every frame. The render graph's pooled targets count towards the
+ * usage but the graph frees them itself.
+ */
+enum ResourceKind {
+	ResourceBuffer,
+	ResourceTexture
+};
+
+struct ManagedResource {
+	string name;
+	ResourceKind kind;
+	GLuint handle;						// 0 while evicted
+	size_t bytes;
+	unsigned long lastUsedFrame;
+	function<size_t(GLuint&)> load;		// Creates the GL object from its asset and returns its size, empty if not evictable
+};
+
+vector<ManagedResource> managedResources;
+size_t residencyBudget = 0;				// Bytes, 0 for no limit
+size_t residentBytes = 0;				// Registered resources only, render targets are added when reported
+size_t residencyHighWater = 0;
+unsigned long residencyEvictions = 0;
+unsigned long residencyReloads = 0;
+double residencyStallSeconds = 0.0;
+unsigned long residencyFrame = 0;
+
+// Vertex buffers of the chair LOD chain and the lamp cube
+GLint chairMeshResource;
+GLint lightMeshResource;
+
+// CPU copy of the chair LOD chain, the source the chair buffer is reloaded from
+vector<GLfloat> chairLODVertices;
+
+/* MIP STREAMING
+ * Material arrays start with a one texel placeholder of each finish's flat
+ * color, so the first frame doesn't wait for any image. A worker thread
+ * decodes the images and builds their mip chains, then the coarse tail is
+ * uploaded, and finer levels follow one per frame while the chairs on screen
+ * have more pixels than the finest resident level has texels. The base level
+ * keeps sampling on resident levels and the minimum LOD fades each new one in.
+ * Only the coarse tail stays in memory, finer levels are freed once uploaded.
+ * A reloaded array that needs them again sends its materials back to the
+ * loader thread and waits for them like the first time.
+ */
+struct MipChain {
+	vector<vector<GLubyte>> levels;		// RGB, level 0 first, empty once uploaded
+};
+
+bool mipStreaming = true;
+GLint mipTailSize = 64;				// Levels this size and smaller make up the coarse tail
+GLfloat mipFadeStep = 0.25f;		// Minimum LOD change per frame while a new level fades in
+
+// Decoded mip chains, written by the loader thread
+vector<MipChain> materialMips;
+vector<bool> materialMipsReady;
+mutex materialMipsLock;
+thread mipLoaderThread;
+atomic<bool> mipLoaderStop(false);
+
+// Materials waiting for the loader thread and the finest level each decode keeps
+deque<GLint> mipDecodeQueue;
+vector<GLint> mipKeepLevels;
+condition_variable mipLoaderWake;
+
+
+/* COMMAND LISTS
+ * With commandWorkers set, the chairs are split into that many ranges and
+ * each range is recorded by its own thread into a linear arena of plain draw
+ * commands. The arenas are reset, not freed, every frame, so recording stops
+ * allocating once they have grown to the scene. The GL thread records the
+ * first range itself, then replays every list in order and skips state
+ * that hasn't changed. Batched chairs are grouped per range, so a frame
+ * issues up to one draw per texture array, LOD and range.
+ */
+enum CommandType : GLuint {
+	CommandDrawInstanced,
+	CommandDrawConstant
+};
+
+// Type and state every command starts with, replay reads it before knowing the command
+struct DrawCommandHeader {
+	GLuint type;
+	GLuint program, vao;
+	GLint textureResource;
+	GLint firstVertex;
+	GLsizei vertexCount;
+	GLsizei instanceCount;
+};
+
+// Draws a range of the chair instance buffer
+struct DrawInstancedCommand {
+	DrawCommandHeader header;
+	GLuint firstInstance, divisor;
+};
+
+// Draws one chair with its model matrix and layers as constant attributes
+struct DrawConstantCommand {
+	DrawCommandHeader header;
+	GLfloat layer;
+	GLfloat lightmapLayer;
+	GLfloat model[16];
+};
+
+// Linear allocator for one thread's commands
+struct CommandArena {
+	vector<unsigned char> memory;
+	size_t used;
+};
+
+struct CommandRecorder {
+	CommandArena arena;
+	vector<GLuint> bucketOffsets;	// Scratch for grouping a range by texture array and LOD
+	vector<GLuint> bucketCursors;
+};
+
+GLint commandWorkers = 0;			// Recording threads including the GL thread, 0 records inline
+vector<CommandRecorder> commandRecorders;
+
+// What the ranges of the current frame are recorded with
+GLuint commandProgram;
+GLint commandInstancesPerObject;
+GLint commandRanges;
+
+// Worker threads wait for a new generation, the GL thread waits for pending to reach zero
+vector<thread> commandThreads;
+mutex commandLock;
+condition_variable commandWake, commandDone;
+unsigned long commandGeneration = 0;
+GLint commandPending = 0;
+bool commandStop = false;
+
+// Time spent recording and replaying, for the benchmark
+double commandRecordSeconds = 0.0;
+double commandReplaySeconds = 0.0;
+
+/* OCCLUSION CULLING
+ * Before any draw the seats and backs of the nearest large chairs are
+ * rasterized on the CPU into a small buffer of 1/w, four pixels at a time
+ * with SSE, each job filling its own band of rows. Tiles of 8x8 pixels
+ * keep their farthest depth, so a chair's screen rectangle is usually
+ * rejected or accepted per tile and only straddling tiles are tested per
+ * pixel. Chairs whose nearest corner is behind everything in their rectangle
+ * are skipped. Only the single perspective view is culled.
+ */
+const GLint occlusionWidth = 256;
+const GLint occlusionHeight = 192;
+const GLint occlusionTileSize = 8;
+
+bool occlusionEnabled = true;
+GLint occlusionThreads = 0;				// 0 uses up to four cores
+GLint maxOccluders = 64;
+GLfloat occluderMinPixels = 32.0f;		// Chairs smaller than this on screen don't occlude
+
+// 1/w of the nearest occluder per pixel (0 where there is none), and the farthest per tile
+vector<GLfloat> occlusionDepth(occlusionWidth * occlusionHeight);
+vector<GLfloat> occlusionTiles((occlusionWidth / occlusionTileSize) * (occlusionHeight / occlusionTileSize));
+
+// Screen space occluder triangles of the current frame, x, y and 1/w per corner
+vector<glm::vec3> occluderTriangles;
+
+// Occlusion statistics of the last frame
+GLint objectsOccluded = 0;
+GLint occludersRasterized = 0;
+double occlusionSeconds = 0.0;
+
+/* LIGHTMAP
+ * Static lighting baked per chair. Every triangle of every LOD gets its own
+ * chart in a shared atlas, laid flat on its longest edge and shelf packed
+ * with gaps wide enough that bilinear filtering never mixes two charts. The
+ * baker fills one atlas layer per scene object with the diffuse term of the
+ * key and fill lights, shadowed by rays through the scene BVH, plus the
+ * ambient term or, with indirect light, one diffuse bounce. Alpha keeps the
+ * key light's visibility so the runtime shader can shadow its highlight.
+ * Threads take object and triangle pairs from a shared counter. Texels are
+ * kept as half floats, and once the chairs outnumber the GPU's array layers
+ * several chairs' atlases are tiled side by side in each layer.
+ */
+struct LightmapChart {
+	GLint x, y;				// Atlas texel of the chart's corner
+	GLint width, height;	// Size in texels
+	GLuint firstTriangle;
+	GLuint triangleCount;	// One triangle, or two sharing an edge in the same plane
+};
+
+bool lightmapEnabled = false;		// Chairs shade with the baked lightmap
+bool lightmapBaked = false;
+bool lightmapIndirect = false;		// Bakes one diffuse bounce instead of the flat ambient term
+bool lightmapScaling = false;
+GLint lightmapSize = 128;			// Texels per side of one chair's layer
+GLint lightmapPadding = 3;			// Texels between charts, more than twice the dilation
+GLint lightmapSamples = 32;			// Bounce rays per texel with indirect light
+GLfloat lightmapDilation = 1.45f;	// Texels outside a triangle that are baked, bilinear filtering reads up to sqrt(2)
+
+vector<LightmapChart> lightmapCharts;
+vector<glm::vec2> lightmapCorners;			// Corners of every triangle of chairLODVertices in texels from its chart's corner
+vector<GLfloat> chairLightmapCoordinates;	// Two per vertex of chairLODVertices
+vector<GLushort> lightmapTexels;			// Irradiance and key light visibility as RGBA half floats, one atlas per scene object
+GLint lightmapTiles = 1;					// Atlases per side of one texture layer
+GLint lightmapResource = -1;
+GLint chairLightmapShaderProgram;
+double lightmapBakeSeconds = 0.0;
+
+/* ENVIRONMENT LIGHTING
+ * Ambient light from an equirectangular HDR environment map, reduced to 9
+ * spherical harmonic coefficients per color channel. The projection runs on
+ * every core with SSE. The coefficients are cached on disk under the hash
+ * of the map's bytes, so a map is only projected the first time it's used.
+ * The chair shader evaluates irradiance for its normal from the coefficients
+ * convolved with the cosine lobe. The map's average is scaled to the flat
+ * ambient term's brightness, so the environment changes only the direction
+ * and color of the ambient light.
+ */
+struct SHCacheHeader {
+	char magic[4];				// "SH9"
+	GLuint version;
+	unsigned long long hash;	// FNV-1a of the map file, 27 floats follow
+};
+
+const GLuint shCacheVersion = 1;
+
+bool environmentLighting = false;
+bool environmentLoaded = false;
+string environmentPath;					// Radiance .hdr map, empty uses a built-in studio environment
+glm::vec3 environmentSH[9];				// Radiance coefficients of the map
+glm::vec3 environmentIrradianceSH[9];	// Cosine convolved and scaled, what the shader evaluates
+GLfloat environmentScale = 1.0f;		// Brings the map's radiance to the level of the flat ambient term
+
+/* SCENE FILES
+ * A scene file is a SceneFileHeader, a table of SceneSection entries and the
+ * sections themselves. Each section is a tightly packed array that starts on
+ * a sceneAlignment boundary, per object data is split into one section per
+ * field, so a mapped file is read in place without parsing. Meshes and
+ * materials are referenced by index into tables of names, which keeps files
+ * valid when materials are added or reordered. Loaders skip section types
+ * they don't know, so later versions can add sections. Values are stored in
+ * the machine's byte order.
+ */
+enum SceneSectionType {
+	SectionPositions = 0,		// glm::vec3 per object
+	SectionScales = 1,			// glm::vec3 per object
+	SectionMeshes = 2,			// GLuint per object, index into SectionMeshNames
+	SectionMaterials = 3,		// GLuint per object, index into SectionMaterialNames
+	SectionLights = 4,			// SceneLight, the key light then the fill light
+	SectionCamera = 5,			// One SceneCamera
+	SectionMeshNames = 6,		// NUL terminated names
+	SectionMaterialNames = 7,
+	SceneSectionCount = 8
+};
+
+struct SceneFileHeader {
+	char magic[8];				// "3DCHAIR"
+	GLuint version;
+	GLuint sectionCount;
+	unsigned long long objectCount;
+	unsigned long long fileSize;
+};
+
+struct SceneSection {
+	GLuint type;				// SceneSectionType
+	GLuint elementSize;			// Bytes per element
+	unsigned long long offset;	// From the start of the file
+	unsigned long long count;
+};
+
+struct SceneLight {
+	GLfloat position[3];
+	GLfloat color[3];
+};
+
+struct SceneCamera {
+	GLfloat yaw, pitch;
+	GLfloat front[3];
+	GLfloat position[3];
+	GLfloat scale[3];
+	GLfloat fieldOfView;
+};
+
+static_assert(sizeof(SceneFileHeader) == 32 && sizeof(SceneSection) == 24, "Scene file structures are written to disk as is");
+
+const GLuint sceneFileVersion = 1;
+const size_t sceneAlignment = 64;
+const size_t sceneWriterChunk = 16384;		// Objects the streaming writer buffers per section
+
+// Writes a scene one object at a time, holding at most one chunk of each section in memory
+struct SceneWriter {
+	FILE* file;
+	unsigned long long objectCount;
+	unsigned long long written;
+	bool failed;				// Set by the first write that fails
+	SceneSection sections[SceneSectionCount];
+	vector<glm::vec3> positions, scales;
+	vector<GLuint> meshes, materials;
+};
+
+string sceneLoadPath;						// Replaces the generated showroom when set
+string sceneSavePath = "showroom.scene";	// Written by the 'w' key
+GLint sceneBenchmarkObjects = 0;			// Objects in the scene file benchmark, 0 doesn't run it
+
+/* JOB SYSTEM
+ * Worker threads for CPU side engine work, one per core besides the GL
+ * thread. Every worker owns a queue of ready jobs, it takes the newest of
+ * its own and steals the oldest of the others when its queue is empty. Jobs
+ * submitted from other threads go into one more queue that the workers
+ * steal from. A job becomes ready once every job it depends on has finished,
+ * finishing a job releases the jobs that depend on it. Threads waiting for
+ * a job run other jobs meanwhile. Without workers jobs run as soon as they
+ * are ready on the thread that made them ready.
+ */
+struct Job {
+	const char* name;
+	function<void()> work;
+	atomic<GLint> pending;					// Unfinished dependencies, plus one until the job is submitted
+	atomic<bool> done;
+	mutex lock;								// Orders adding continuations against the job finishing
+	vector<shared_ptr<Job>> continuations;	// Jobs that depend on this one
+	GLint criticalDependency;				// Trace entry of the dependency with the longest chain of work, -1 for none
+	GLint traceIndex;						// Trace entry of the job, -1 until it has run while tracing
+};
+
+typedef shared_ptr<Job> JobHandle;
+
+// Ready jobs of one thread, the owner takes from the back, thieves from the front
+struct JobQueue {
+	mutex lock;
+	deque<JobHandle> jobs;
+};
+
+// A job or a step of the GL thread, for the startup report and trace
+struct JobTraceEntry {
+	string name;
+	GLint thread;			// Worker index, the number of workers for the GL thread
+	double start, end;		// Seconds since programStart
+	GLint after;			// Entry with the longest chain of work this one had to wait for, -1 if none
+	bool wait;				// Time the GL thread spent waiting for a job
+	double pathWork;		// Seconds of work in the longest chain ending with this entry
+};
+
+bool jobSystemEnabled = true;
+GLint jobThreads = 0;					// Workers, 0 uses every core but the GL thread's
+vector<thread> jobWorkers;
+vector<JobQueue> jobQueues;				// One per worker, then the one of the other threads
+atomic<GLint> jobsQueued(0);
+atomic<bool> jobStopping(false);
+mutex jobWakeLock;
+condition_variable jobWake;
+thread_local GLint jobWorkerIndex = -1;	// -1 on threads outside the pool
+thread_local bool jobRunning = false;	// Set while the thread runs a job
+
+// Trace of the startup
+atomic<bool> jobTracing(false);
+string jobTracePath;					// Chrome trace of the startup, empty doesn't write one
+mutex jobTraceLock;
+vector<JobTraceEntry> jobTrace;
+GLint jobTraceLastStep = -1;			// Last step of the GL thread
+
+// Work the GL thread waits for during startup
+struct StartupImage {
+	unsigned char* pixels;		// NULL when mips are streamed, only the size is read
+	GLint width, height;
+};
+
+vector<StartupImage> startupImages;
+JobHandle materialsJob, geometryJob, sceneJob, lightingJob;
+
+/* LATENCY
+ * Every input event is timestamped. A frame takes the timestamps of the
+ * events its camera reflects when it latches the camera, and after the swap
+ * writes a GL_TIMESTAMP query and a fence. Once the fence signals, the time
+ * from each input to the GPU reaching the swap, converted to the CPU clock,
+ * becomes a latency sample. Before a new frame starts, the CPU waits until
+ * no more than maxQueuedFrames frames are still on the GPU, so input isn't
+ * sampled far ahead of what is shown.
+ * With late latching, pending input is processed again once the frame has
+ * waited for the GPU and streamed its textures, just before the single view
+ * picks LODs, culls and draws, and the newest camera is written into a
+ * uniform buffer the chair and lamp shaders read. The buffer
+ * is persistently mapped where ARB_buffer_storage is available, with one
+ * slot per frame in flight. Only the mouse moves the camera there, keys and
+ * window resizes that arrive meanwhile are handled after the swap.
+ */
+struct LatencyFrame {
+	vector<chrono::steady_clock::time_point> inputs;	// Input events the frame's camera reflects
+	chrono::steady_clock::time_point swapTime;		// When glutSwapBuffers returned
+	GLuint query;									// GL_TIMESTAMP written after the swap
+	GLsync fence;									// Signals once the GPU has finished the frame
+};
+
+const GLint latencySlots = 8;						// Frames tracked at once, the most that can be queued
+const GLuint cameraBlockBinding = 1;
+
+bool lateLatchEnabled = false;
+GLint maxQueuedFrames = 2;							// 0 doesn't limit queued frames
+LatencyFrame latencyFrames[latencySlots];
+unsigned long latencyFramesSubmitted = 0;
+unsigned long latencyFramesRetired = 0;
+vector<chrono::steady_clock::time_point> pendingInputs;	// Events no frame has latched yet
+GLint64 gpuClockOffset = 0;						// GPU timestamp minus the CPU clock, in nanoseconds
+
+// Camera uniform buffer, one slot per tracked frame
+GLuint cameraUBO;
+GLint cameraSlotBytes;
+unsigned char* cameraMapping = NULL;				// NULL when updated with glBufferSubData
+bool lateLatchThisFrame = false;					// The current frame's slot holds its camera
+bool latencyFrameOpen = false;						// Between ULatencyBeginFrame and ULatencyEndFrame
+bool lateLatchPumping = false;						// Input handlers are running inside the frame
+
+// Keys and a resize that arrived while the late latch pumped events, handled once the frame is swapped
+struct DeferredKey {
+	unsigned char key;
+	GLint x, y;
+};
+vector<DeferredKey> deferredKeys;
+bool deferredResize = false;
+GLint deferredWidth, deferredHeight;
+
+// Samples since the last report, in milliseconds
+vector<double> inputToSubmit, inputToGPU, inputToFence;
+double queuedFrameWait = 0.0;						// Seconds spent limiting queued frames
+
+/* POSTER
+ * Poster mode renders an image larger than the GL limits as a grid of tiles.
+ * Each tile is drawn with the window camera's perspective projection
+ * cropped to the tile's part of the image. Worker processes, each with a
+ * hidden window of its own, claim tiles from a shared counter and write the
+ * tile's rows into their place in a PPM the main process sized up front, so
+ * no process ever holds more than one tile.
+ */
+struct PosterProgress {
+	atomic<GLint> nextTile;		// Next tile to claim, shared by every worker process
+	atomic<GLint> tilesDone;
+};
+
+string posterPath;						// Empty unless a poster is rendered
+GLint posterWidth = 16384;
+GLint posterHeight = 0;					// 0 keeps the window's aspect ratio
+GLint posterTileSize = 2048;
+GLint posterWorkers = 0;				// Worker processes, 0 for every core
+GLint posterWorkerIndex = -1;			// -1 in the process that started the workers
+PosterProgress* posterProgress = NULL;
+
+// Time to first frame
+chrono::steady_clock::time_point programStart;
+bool firstFrameDrawn = false;
+
+// Frame statistics
+unsigned long drawCallsSubmitted = 0;
+unsigned long textureBindsSubmitted = 0;
+unsigned long trianglesSubmitted = 0;
+unsigned long trianglesFullDetail = 0;
+GLint statsFrameCount = 0;
+GLint statsReportInterval = 300;
+
 /* USER-DEFINED FUNCTION DECLARATIONS */
 void CheckStatus(GLuint, bool);
 void AttachShader(GLuint, GLenum, const char*);
@@ -107,6 +960,129 @@ void UGenerateTexture(void);
 void UMouseMove(int x, int y);
 void onMotion(int curr_x, int curr_y);
 void OnMouseClicks(int button, int state, int x, int y);
+void UParseArguments(int argc, char* argv[]);
+void UCreateScene(void);
+void UBuildLODChain(const GLfloat* vertices, GLsizei vertexCount, vector<GLfloat>& lodVertices);
+GLfloat UProjectedError(GLfloat geometricError, const SceneObject& object, const glm::vec3& eye);
+GLint USelectLOD(const SceneObject& object, const glm::vec3& eye);
+void UReportFrameStats(void);
+void UDrawFrame(void);
+void UDrawScene(const glm::mat4& view, const glm::mat4& projection);
+void UComputeViews(const glm::mat4& view, const glm::mat4& projection);
+void UDrawSceneMultiView(void);
+void UBenchmarkMultiView(void);
+GLuint UBuildBVH(const vector<AABB>& bounds, vector<BVHNode>& nodes, vector<GLuint>& order);
+void UBuildMeshBVH(const GLfloat* vertices, GLsizei vertexCount, GLint stride, MeshBVH& bvh);
+void UBuildSceneBVH(void);
+bool UIntersectMeshBVH(const MeshBVH& bvh, const glm::vec3& origin, const glm::vec3& direction, RayHit& hit);
+bool UIntersectScene(const glm::vec3& origin, const glm::vec3& direction, RayHit& hit);
+void UIntersectScenePacket(const RayPacket& rays, GLint active, RayHit hits[4]);
+void UPickAt(int x, int y);
+int UBenchmarkPicking(void);
+void UStartRecording(const char* path);
+void UStopRecording(void);
+void URecordInput(InputEventType type, int x, int y, int button, int state);
+bool ULoadReplay(const char* path);
+void UAdvanceReplay(void);
+void UFinishReplayFrame(chrono::steady_clock::time_point frameStart, chrono::steady_clock::time_point submitEnd);
+void UFinishReplay(void);
+void URenderGraphReset(void);
+GLint URenderGraphImport(const char* name);
+GLint URenderGraphCreateTexture(const char* name, RenderTextureDesc desc);
+GLint URenderGraphAddPass(const char* name, vector<GLint> reads, vector<GLint> writes, function<void()> execute);
+void URenderGraphCompile(void);
+void URenderGraphExecute(void);
+void URenderGraphDump(void);
+GLuint URenderGraphTexture(GLint resource);
+void UBuildFrameGraph(void);
+void UBindInstanceAttributes(size_t firstInstance, GLuint divisor);
+void UDrawChairs(GLuint program, GLint instancesPerObject);
+void URecordCommandLists(GLuint program, GLint instancesPerObject);
+void URecordChairRange(GLint range);
+void UExecuteCommandLists(void);
+void UCommandWorker(GLint range, unsigned long generation);
+void UStopCommandWorkers(void);
+void UBenchmarkCommandLists(void);
+void UCullOccluded(const glm::mat4& viewProjection, bool singleView);
+void URasterizeOccluders(GLint firstRow, GLint endRow);
+bool UTestOcclusion(const SceneObject& object, const glm::mat4& viewProjection);
+GLint URegisterResource(const char* name, ResourceKind kind, function<size_t(GLuint&)> load, GLuint handle = 0, size_t bytes = 0);
+GLuint UUseResource(GLint resource);
+void UResizeResource(GLint resource, size_t bytes);
+void UEnforceBudget(void);
+void UReleaseResources(void);
+void UReportResidency(void);
+size_t ULoadChairMesh(GLuint& buffer);
+size_t ULoadLightMesh(GLuint& buffer);
+size_t ULoadMaterialArray(GLint array, GLuint& texture, const vector<unsigned char*>* decoded);
+unsigned char* ULoadMaterialImage(const Material& material, GLint& width, GLint& height);
+bool UReadImageSize(const char* path, GLint& width, GLint& height);
+void UMipLoader(void);
+void UStopMipStreaming(void);
+bool UMipsReady(GLint array);
+bool URequestMipLevel(GLint array, GLint level);
+void UUploadMipLevel(GLint array, GLint level);
+void UUploadMipPlaceholder(GLint array);
+size_t UMipBytes(const MaterialArray& array, GLint firstLevel);
+void UStreamMips(void);
+void UReportFirstFrame(void);
+void UBenchmarkMaterials(void);
+int UPathTrace(void);
+int UPathTraceScaling(void);
+void UPathTraceSetup(void);
+double UPathTracePass(vector<glm::vec3>& accumulation, vector<GLuint>& sampleCounts, GLint width, GLint height,
+					  GLint sampleIndex, PathTracePool& pool, chrono::steady_clock::time_point deadline,
+					  const glm::mat4& inverseViewProjection, const glm::vec3& eye);
+glm::vec3 UTracePath(glm::vec3 origin, glm::vec3 direction, RayHit hit, GLuint& rng);
+void UBuildLightmapCharts(void);
+double UBakeLightmaps(GLint threads);
+size_t ULoadLightmap(GLuint& texture);
+void UBakeLighting(void);
+int ULightmapScaling(void);
+void UBenchmarkLightmap(void);
+bool ULoadHDR(const char* path, GLint& width, GLint& height, vector<GLfloat>& planes);
+double UProjectSH(const vector<GLfloat>& planes, GLint width, GLint height, GLint threads, glm::vec3 sh[9]);
+bool UReadSHCache(unsigned long long hash, glm::vec3 sh[9]);
+void UWriteSHCache(unsigned long long hash, const glm::vec3 sh[9]);
+void ULoadEnvironment(void);
+glm::vec3 UEnvironmentAmbient(const glm::vec3& normal);
+glm::vec3 UEnvironmentRadiance(const glm::vec3& direction);
+void USetEnvironmentUniforms(GLuint program);
+bool UWriteImage(const char* path, const vector<glm::vec3>& accumulation, const vector<GLuint>& sampleCounts, GLint width, GLint height);
+bool USceneWriterBegin(SceneWriter& writer, const char* path, unsigned long long objectCount);
+void USceneWriterAdd(SceneWriter& writer, const glm::vec3& position, const glm::vec3& scale, GLuint mesh, GLuint material);
+bool USceneWriterEnd(SceneWriter& writer);
+bool USaveScene(const char* path);
+bool ULoadScene(const char* path);
+bool USaveSceneJSON(const char* path);
+bool ULoadSceneJSON(const char* path);
+int UBenchmarkSceneFiles(void);
+bool UIsJSONScene(const string& path);
+void UStartJobSystem(GLint workers);
+void UStopJobSystem(void);
+JobHandle UCreateJob(const char* name, function<void()> work);
+void UAddDependency(const JobHandle& job, const JobHandle& dependency);
+void USubmitJob(const JobHandle& job);
+JobHandle URunJob(const char* name, function<void()> work, const vector<JobHandle>& dependencies = {});
+void UWaitJob(const JobHandle& job);
+void UParallelFor(GLint count, const function<void(GLint, GLint)>& body, GLint grain = 0);
+void UTraceStep(const char* name, chrono::steady_clock::time_point start);
+void UStartupJobs(void);
+void UReportStartup(void);
+bool UWriteJobTrace(const char* path);
+void UUploadLightmap(void);
+void UComputeCamera(glm::mat4& view, glm::mat4& projection);
+void UTimestampInput(void);
+void ULatchInput(void);
+void UCreateLatencyObjects(void);
+void ULatencyBeginFrame(void);
+void ULatencyEndFrame(void);
+void ULateLatchCamera(glm::mat4& view, glm::mat4& projection);
+void URunDeferredInput(void);
+void UReportLatency(void);
+int UStartPosterWorkers(void);
+int URenderPosterTiles(void);
+glm::mat4 UPosterTileProjection(const glm::mat4& projection, GLint x, GLint y, GLint width, GLint height);
 
 
 /* CHAIR VERTEX SHADER SOURCE CODE
@@ -121,37 +1097,47 @@ const char * chairVertexShaderSource =
 		 "layout(location=0) in vec3 position;\n"
 		 "layout(location=1) in vec3 normal; \n"
 		 "layout(location=2) in vec2 textureCoordinate;\n"
+		 "layout(location=3) in mat4 model;\n"
+		 "layout(location=7) in float layer;\n"
 
 		 "out vec3 Normal;\n"
 		 "out vec3 FragmentPos;\n"
 	     "out vec2 mobileTextureCoordinate;\n"
+		 "flat out float materialLayer;\n"
 
-		 "uniform mat4 model;\n"
 		 "uniform mat4 view;\n"
 		 "uniform mat4 projection;\n"
+		 "layout(std140) uniform CameraBlock {\n"
+		 "mat4 latchedView;\n"
+		 "mat4 latchedProjection;\n"
+		 "};\n"
+		 "uniform bool lateLatch;\n"
 
 		 "void main() \n"
 		 "{ \n"
-				   "gl_Position = projection * view * model * vec4(position, 1.0f);\n"
+				   "gl_Position = (lateLatch ? latchedProjection * latchedView : projection * view) * model * vec4(position, 1.0f);\n"
 				   "FragmentPos = vec3(model * vec4(position, 1.0f));\n"
 			       "Normal = mat3(transpose(inverse(model))) * normal;\n"
 				   "mobileTextureCoordinate = vec2(textureCoordinate.x, 1.0f - textureCoordinate.y);\n"
+				   "materialLayer = layer;\n"
 	"} \n";
 
 
 /* CHAIR FRAGMENT SHADER SOURCE CODE
- * Takes the Normal matrix, Fragment Position & mobile texture coordinates from the Vertex Shader
+ * Takes the Normal matrix, Fragment Position, mobile texture coordinates & material layer from the Vertex Shader
  * Sends the pyramid Color to the GPU
  * Creates the uniform global values for determining lighting and texture
  * Uses the Phong method to determine lighting by calculating:
  * Ambient Lighting, Diffuse Lighting & Specular Component
  * which is then multiplied with the texture on the pyramid
+ * The ambient light is flat, or evaluated from the environment's SH coefficients
  */
 const char* chairFragmentShaderSource =
 		 "#version 330 \n"
 		 "in vec3 Normal;\n"
 		 "in vec3 FragmentPos;\n"
 		 "in vec2 mobileTextureCoordinate;\n"
+		 "flat in float materialLayer;\n"
 
 		 "out vec4 chairColor;\n"
 
@@ -160,16 +1146,32 @@ const char* chairFragmentShaderSource =
 		 "uniform vec3 keyLightPos;\n"
 		 "uniform vec3 fillLightPos;\n"
 		 "uniform vec3 viewPosition;\n"
-		 "uniform sampler2D uTexture;\n"
+		 "uniform sampler2DArray uTexture;\n"
+		 "uniform bool environmentLighting;\n"
+		 "uniform vec3 environmentSH[9];\n"
+
+		 "vec3 EnvironmentAmbient(vec3 n) \n"
+		 "{ \n"
+				  "return max(environmentSH[0] * 0.282095f\n"
+				  "		+ (environmentSH[1] * n.y + environmentSH[2] * n.z + environmentSH[3] * n.x) * 0.488603f\n"
+				  "		+ (environmentSH[4] * n.x * n.y + environmentSH[5] * n.y * n.z + environmentSH[7] * n.x * n.z) * 1.092548f\n"
+				  "		+ environmentSH[6] * (0.315392f * (3.0f * n.z * n.z - 1.0f))\n"
+				  "		+ environmentSH[8] * (0.546274f * (n.x * n.x - n.y * n.y)), 0.0f);\n"
+		 "} \n"
 
 		 "void main() \n"
 		 "{ \n"
 
+		 		  "vec3 norm = normalize(Normal);\n"
+
 		 		  "float ambientStrength = 0.1f;\n"
 				  "vec3 keyAmbient = ambientStrength * keyLightColor;\n"
 		 		  "vec3 fillAmbient = ambientStrength * fillLightColor;\n"
+				  "if (environmentLighting) {\n"
+						  "keyAmbient = EnvironmentAmbient(norm);\n"
+						  "fillAmbient = vec3(0.0f);\n"
+				  "}\n"
 
-		 		  "vec3 norm = normalize(Normal);\n"
 		 		  "vec3 keyLightDirection = normalize(keyLightPos - FragmentPos);\n"
 		 		  "vec3 fillLightDirection = normalize(fillLightPos - FragmentPos);\n"
 		 		  "float keyImpact = max(dot(norm, keyLightDirection), 0.0);\n"
@@ -188,7 +1190,7 @@ const char* chairFragmentShaderSource =
 				  "vec3 keySpecular = keySpecularIntensity * keySpecularComponent * keyLightColor;\n"
 				  "vec3 fillSpecular = fillSpecularIntensity * fillSpecularComponent * fillLightColor;\n"
 
-		 		  "vec3 objectColor = texture(uTexture, mobileTextureCoordinate).xyz;\n"
+		 		  "vec3 objectColor = texture(uTexture, vec3(mobileTextureCoordinate, materialLayer)).xyz;\n"
 		 		  "vec3 keyPhong = (keyAmbient + keyDiffuse + keySpecular) * objectColor;\n"
 		 		  "vec3 fillPhong = (fillAmbient + fillDiffuse + fillSpecular) * objectColor;\n"
 		 		  "vec3 phong = keyPhong + fillPhong;\n"
@@ -196,6 +1198,95 @@ const char* chairFragmentShaderSource =
 
 		"} \n";
 
+/* CHAIR LIGHTMAP VERTEX SHADER SOURCE CODE
+ * Same as the chair vertex shader, plus the lightmap coordinate
+ * and the layer of the chair's baked lighting, moved to the chair's
+ * tile when several chairs share a layer
+ */
+const char * chairLightmapVertexShaderSource =
+
+		 "#version 330\n"
+		 "layout(location=0) in vec3 position;\n"
+		 "layout(location=1) in vec3 normal; \n"
+		 "layout(location=2) in vec2 textureCoordinate;\n"
+		 "layout(location=3) in mat4 model;\n"
+		 "layout(location=7) in float layer;\n"
+		 "layout(location=8) in float lightmapLayer;\n"
+		 "layout(location=9) in vec2 lightmapCoordinate;\n"
+
+		 "out vec3 Normal;\n"
+		 "out vec3 FragmentPos;\n"
+	     "out vec2 mobileTextureCoordinate;\n"
+		 "out vec2 bakedCoordinate;\n"
+		 "flat out float materialLayer;\n"
+		 "flat out float bakedLayer;\n"
+
+		 "uniform mat4 view;\n"
+		 "uniform mat4 projection;\n"
+		 "layout(std140) uniform CameraBlock {\n"
+		 "mat4 latchedView;\n"
+		 "mat4 latchedProjection;\n"
+		 "};\n"
+		 "uniform bool lateLatch;\n"
+		 "uniform int lightmapTiles;\n"
+
+		 "void main() \n"
+		 "{ \n"
+				   "gl_Position = (lateLatch ? latchedProjection * latchedView : projection * view) * model * vec4(position, 1.0f);\n"
+				   "FragmentPos = vec3(model * vec4(position, 1.0f));\n"
+			       "Normal = mat3(transpose(inverse(model))) * normal;\n"
+				   "mobileTextureCoordinate = vec2(textureCoordinate.x, 1.0f - textureCoordinate.y);\n"
+				   "int tile = int(lightmapLayer) % (lightmapTiles * lightmapTiles);\n"
+				   "bakedCoordinate = (lightmapCoordinate + vec2(tile % lightmapTiles, tile / lightmapTiles)) / float(lightmapTiles);\n"
+				   "materialLayer = layer;\n"
+				   "bakedLayer = float(int(lightmapLayer) / (lightmapTiles * lightmapTiles));\n"
+	"} \n";
+
+
+/* CHAIR LIGHTMAP FRAGMENT SHADER SOURCE CODE
+ * Ambient and diffuse lighting of both lights come from one lightmap fetch,
+ * only the view dependent specular is computed per pixel.
+ * The key light's highlight is dropped where the lightmap has it in shadow.
+ */
+const char* chairLightmapFragmentShaderSource =
+		 "#version 330 \n"
+		 "in vec3 Normal;\n"
+		 "in vec3 FragmentPos;\n"
+		 "in vec2 mobileTextureCoordinate;\n"
+		 "in vec2 bakedCoordinate;\n"
+		 "flat in float materialLayer;\n"
+		 "flat in float bakedLayer;\n"
+
+		 "out vec4 chairColor;\n"
+
+		 "uniform vec3 keyLightColor;\n"
+		 "uniform vec3 fillLightColor;\n"
+		 "uniform vec3 keyLightPos;\n"
+		 "uniform vec3 fillLightPos;\n"
+		 "uniform vec3 viewPosition;\n"
+		 "uniform sampler2DArray uTexture;\n"
+		 "uniform sampler2DArray uLightmap;\n"
+
+		 "void main() \n"
+		 "{ \n"
+
+				  "vec4 baked = texture(uLightmap, vec3(bakedCoordinate, bakedLayer));\n"
+
+		 		  "vec3 norm = normalize(Normal);\n"
+		 		  "float highlightSize = 16.0f;\n"
+		 		  "vec3 viewDir = normalize(viewPosition - FragmentPos);\n"
+		 		  "vec3 keyReflectDir = reflect(-normalize(keyLightPos - FragmentPos), norm);\n"
+		 		  "vec3 fillReflectDir = reflect(-normalize(fillLightPos - FragmentPos), norm);\n"
+		 		  "float keySpecularComponent = pow(max(dot(viewDir, keyReflectDir), 0.0), highlightSize);\n"
+		 		  "float fillSpecularComponent = pow(max(dot(viewDir, fillReflectDir), 0.0), highlightSize);\n"
+				  "vec3 keySpecular = baked.a * keySpecularComponent * keyLightColor;\n"
+				  "vec3 fillSpecular = 0.1f * fillSpecularComponent * fillLightColor;\n"
+
+		 		  "vec3 objectColor = texture(uTexture, vec3(mobileTextureCoordinate, materialLayer)).xyz;\n"
+		 		  "chairColor = vec4((baked.rgb + keySpecular + fillSpecular) * objectColor, 1.0f);\n"
+
+		"} \n";
+
 /* KEY LIGHT VERTEX SHADER SOURCE CODE
  * Takes the position vertices from the buffer
  * Creates the uniform global variables
@@ -207,11 +1298,16 @@ const char * keyLightVertexShaderSource =
 		 "uniform mat4 model;\n"
 		 "uniform mat4 view;\n"
 		 "uniform mat4 projection;\n"
+		 "layout(std140) uniform CameraBlock {\n"
+		 "mat4 latchedView;\n"
+		 "mat4 latchedProjection;\n"
+		 "};\n"
+		 "uniform bool lateLatch;\n"
 
 		 "void main() \n"
 		 "{ \n"
 
-                  "gl_Position = projection * view * model * vec4(position, 1.0f);\n"
+                  "gl_Position = (lateLatch ? latchedProjection * latchedView : projection * view) * model * vec4(position, 1.0f);\n"
 
 		"} \n";
 
@@ -238,10 +1334,15 @@ const char * fillLightVertexShaderSource =
 		   "uniform mat4 model;\n"
 		   "uniform mat4 view;\n"
 		   "uniform mat4 projection;\n"
+		   "layout(std140) uniform CameraBlock {\n"
+		   "mat4 latchedView;\n"
+		   "mat4 latchedProjection;\n"
+		   "};\n"
+		   "uniform bool lateLatch;\n"
 
 		   "void main() \n"
 		   "{ \n"
-					 "gl_Position = projection * view * model * vec4(position, 1.0f);\n"
+					 "gl_Position = (lateLatch ? latchedProjection * latchedView : projection * view) * model * vec4(position, 1.0f);\n"
 
 		"} \n";
 
@@ -258,11 +1359,194 @@ const char* fillLightFragmentShaderSource =
 				   "color = vec4(1.0f);\n"
 		"} \n";
 
+/* DEPTH VIEW VERTEX SHADER SOURCE CODE
+ * Generates a triangle covering the screen from the vertex ID
+ */
+const char * depthViewVertexShaderSource =
+		 "#version 330 \n"
+		 "out vec2 screenCoordinate;\n"
+
+		 "void main() \n"
+		 "{ \n"
+				   "screenCoordinate = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+				   "gl_Position = vec4(screenCoordinate * 2.0f - 1.0f, 0.0f, 1.0f);\n"
+		"} \n";
+
+/* DEPTH VIEW FRAGMENT SHADER SOURCE CODE
+ * Shows the scene depth as distance from the camera, near is bright
+ */
+const char* depthViewFragmentShaderSource =
+		 "#version 330 \n"
+		 "in vec2 screenCoordinate;\n"
+
+		 "out vec4 color;\n"
+
+		 "uniform sampler2D uDepth;\n"
+		 "uniform float nearPlane;\n"
+		 "uniform float farPlane;\n"
+
+		 "void main() \n"
+		 "{ \n"
+				   "float depth = texture(uDepth, screenCoordinate).r * 2.0f - 1.0f;\n"
+				   "float distance = 2.0f * nearPlane * farPlane / (farPlane + nearPlane - depth * (farPlane - nearPlane));\n"
+				   "color = vec4(vec3(1.0f - clamp(distance / 30.0f, 0.0f, 1.0f)), 1.0f);\n"
+		"} \n";
+
+/* CHAIR MULTI-VIEW VERTEX SHADER SOURCE CODE
+ * Transforms the chair into world space only
+ * Every chair is viewCount consecutive instances, one per view,
+ * the geometry shader applies that view's camera
+ */
+const char * chairMultiViewVertexShaderSource =
+		 "#version 330\n"
+		 "layout(location=0) in vec3 position;\n"
+		 "layout(location=1) in vec3 normal; \n"
+		 "layout(location=2) in vec2 textureCoordinate;\n"
+		 "layout(location=3) in mat4 model;\n"
+		 "layout(location=7) in float layer;\n"
+
+		 "out vec3 vertexNormal;\n"
+		 "out vec2 vertexTextureCoordinate;\n"
+		 "flat out int vertexViewIndex;\n"
+		 "flat out float vertexLayer;\n"
+
+		 "uniform int viewCount;\n"
+
+		 "void main() \n"
+		 "{ \n"
+				   "gl_Position = model * vec4(position, 1.0f);\n"
+				   "vertexNormal = mat3(transpose(inverse(model))) * normal;\n"
+				   "vertexTextureCoordinate = vec2(textureCoordinate.x, 1.0f - textureCoordinate.y);\n"
+				   "vertexViewIndex = gl_InstanceID % viewCount;\n"
+				   "vertexLayer = layer;\n"
+	"} \n";
+
+/* CHAIR MULTI-VIEW GEOMETRY SHADER SOURCE CODE
+ * Projects each triangle with the camera of its view
+ * and sends it to that view's viewport
+ * Outputs match the inputs of the chair fragment shader
+ */
+const char * chairMultiViewGeometryShaderSource =
+		 "#version 330\n"
+		 "#extension GL_ARB_viewport_array : require\n"
+		 "layout(triangles) in;\n"
+		 "layout(triangle_strip, max_vertices = 3) out;\n"
+
+		 "in vec3 vertexNormal[];\n"
+		 "in vec2 vertexTextureCoordinate[];\n"
+		 "flat in int vertexViewIndex[];\n"
+		 "flat in float vertexLayer[];\n"
+
+		 "out vec3 Normal;\n"
+		 "out vec3 FragmentPos;\n"
+		 "out vec2 mobileTextureCoordinate;\n"
+		 "flat out float materialLayer;\n"
+
+		 "layout(std140) uniform ViewBlock {\n"
+				   "mat4 viewMatrices[4];\n"
+				   "mat4 projectionMatrices[4];\n"
+		 "};\n"
+
+		 "void main() \n"
+		 "{ \n"
+				   "int view = vertexViewIndex[0];\n"
+				   "for (int i = 0; i < 3; i++) {\n"
+						  "gl_ViewportIndex = view;\n"
+						  "gl_Position = projectionMatrices[view] * viewMatrices[view] * gl_in[i].gl_Position;\n"
+						  "FragmentPos = gl_in[i].gl_Position.xyz;\n"
+						  "Normal = vertexNormal[i];\n"
+						  "mobileTextureCoordinate = vertexTextureCoordinate[i];\n"
+						  "materialLayer = vertexLayer[i];\n"
+						  "EmitVertex();\n"
+				   "}\n"
+				   "EndPrimitive();\n"
+	"} \n";
+
+/* LIGHT MULTI-VIEW VERTEX SHADER SOURCE CODE
+ * Shared by the key and fill lamps
+ */
+const char * lightMultiViewVertexShaderSource =
+		 "#version 330 \n"
+		 "layout(location=0) in vec3 position;\n"
+
+		 "flat out int vertexViewIndex;\n"
+
+		 "uniform mat4 model;\n"
+		 "uniform int viewCount;\n"
+
+		 "void main() \n"
+		 "{ \n"
+				   "gl_Position = model * vec4(position, 1.0f);\n"
+				   "vertexViewIndex = gl_InstanceID % viewCount;\n"
+	"} \n";
+
+/* LIGHT MULTI-VIEW GEOMETRY SHADER SOURCE CODE
+ * Shared by the key and fill lamps
+ */
+const char * lightMultiViewGeometryShaderSource =
+		 "#version 330\n"
+		 "#extension GL_ARB_viewport_array : require\n"
+		 "layout(triangles) in;\n"
+		 "layout(triangle_strip, max_vertices = 3) out;\n"
+
+		 "flat in int vertexViewIndex[];\n"
+
+		 "layout(std140) uniform ViewBlock {\n"
+				   "mat4 viewMatrices[4];\n"
+				   "mat4 projectionMatrices[4];\n"
+		 "};\n"
+
+		 "void main() \n"
+		 "{ \n"
+				   "int view = vertexViewIndex[0];\n"
+				   "for (int i = 0; i < 3; i++) {\n"
+						  "gl_ViewportIndex = view;\n"
+						  "gl_Position = projectionMatrices[view] * viewMatrices[view] * gl_in[i].gl_Position;\n"
+						  "EmitVertex();\n"
+				   "}\n"
+				   "EndPrimitive();\n"
+	"} \n";
+
 
 
 // MAIN PROGRAM
 int main(int argc, char* argv[])
 {
+	// Time to first frame is measured from here
+	programStart = chrono::steady_clock::now();
+
+	// Reads the program options, GLUT reads its own ones below
+	UParseArguments(argc, argv);
+
+	// Benchmarks and renders that run without a window
+	if (benchmarkPicking)
+		return UBenchmarkPicking();
+	if (pathTraceScaling)
+		return UPathTraceScaling();
+	if (pathTraceMode)
+		return UPathTrace();
+	if (lightmapScaling)
+		return ULightmapScaling();
+	if (sceneBenchmarkObjects > 0)
+		return UBenchmarkSceneFiles();
+
+	// Poster tiles are shared between worker processes, each opens a window of its own below
+	if (!posterPath.empty()) {
+		int status = UStartPosterWorkers();
+		if (status >= 0)
+			return status;
+	}
+
+	// ULoadReplay already sized the window like the recorded one
+	if (replayActive)
+		cout<<"Replaying "<<replayRecords.size()<<" input events at "<<windowWidth<<"x"<<windowHeight<<endl;
+
+	// CPU side startup work runs on the job system while the window and GL context are created
+	if (jobSystemEnabled)
+		UStartJobSystem(jobThreads > 0 ? jobThreads : max(1, (GLint)thread::hardware_concurrency() - 1));
+	UStartupJobs();
+	chrono::steady_clock::time_point step = chrono::steady_clock::now();
+
 	//Initializes the OpenGL program
 	glutInit(&argc, argv);
 	glutInitContextVersion(3,3);
@@ -273,6 +1557,9 @@ int main(int argc, char* argv[])
 	glutInitWindowSize(windowWidth, windowHeight);
 	// Creates window and provides title (from macro above)
 	glutCreateWindow(WINDOW_TITLE);
+	// Headless replays and poster workers draw into a hidden window
+	if (replayHeadless || !posterPath.empty())
+		glutHideWindow();
 	// Reshape function if user changes window size
 	glutReshapeFunc(UResizeWindow);
 
@@ -284,20 +1571,56 @@ int main(int argc, char* argv[])
 				return -1;
 			}
 
+	// Single pass multi-view needs gl_ViewportIndex
+	multiViewSupported = GLEW_ARB_viewport_array;
+	if (!multiViewSupported) {
+		cout<<"GL_ARB_viewport_array is not supported, multi-view falls back to one pass per view"<<endl;
+		multiViewSinglePass = false;
+	}
+	UTraceStep("create window", step);
+
 	// Calls function to Create Shaders
+	step = chrono::steady_clock::now();
 	UCreateShader();
+	UTraceStep("compile shaders", step);
 
-	// Calls function to Create Buffers
+	// Calls function to Create Buffers once the chair's geometry is built
+	UWaitJob(geometryJob);
+	step = chrono::steady_clock::now();
 	UCreateBuffers();
+	UTraceStep("create buffers", step);
 
-	// Calls function to Generate Textures
+	// Calls function to Generate Textures once the images are decoded
+	UWaitJob(materialsJob);
+	step = chrono::steady_clock::now();
 	UGenerateTexture();
+	UTraceStep("upload textures", step);
+
+	// The chairs are placed and the environment is projected
+	UWaitJob(sceneJob);
+
+	// Static lighting is baked once the chairs are placed
+	if (lightmapEnabled) {
+		UWaitJob(lightingJob);
+		step = chrono::steady_clock::now();
+		UUploadLightmap();
+		UTraceStep("upload lightmaps", step);
+	}
+
+	UReportStartup();
+
+	// Poster workers render their share of the tiles instead of showing the window
+	if (!posterPath.empty())
+		return URenderPosterTiles();
 
 	// Set background color
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
 	// Display Graphics
 	glutDisplayFunc(URenderGraphics);
+	// Hidden windows get no display callbacks, headless replays draw from the idle loop
+	if (replayHeadless)
+		glutIdleFunc(URenderGraphics);
 
 	// Detects key press
 	glutKeyboardFunc(UKeyboard);
@@ -311,6 +1634,9 @@ int main(int argc, char* argv[])
 
 	int glutGetModifiers(void);
 
+	// The loop returns here when a replay finishes or the window is closed
+	glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);
+
 	// Start OpenGL Loop
 	glutMainLoop();
 
@@ -318,10 +1644,14 @@ int main(int argc, char* argv[])
 	glDeleteVertexArrays(1, &chairVAO);
 	glDeleteVertexArrays(1, &keyLightVAO);
 	glDeleteVertexArrays(1, &fillLightVAO);
-	glDeleteBuffers(1, &chairVBO);
-	glDeleteBuffers(1, &lightVBO);
+	UReleaseResources();
+	glDeleteFramebuffers(1, &renderGraphFBO);
+	glDeleteVertexArrays(1, &fullscreenVAO);
+	for (PhysicalTexture& physical : physicalTextures)
+		glDeleteTextures(1, &physical.texture);
+	UStopRecording();
 
-	return 0;
+	return replayExitStatus;
 
 }
 
@@ -358,6 +1688,14 @@ void AttachShader(GLuint program, GLenum type, const char*src) {
 /* Resizes the window */
 void UResizeWindow(int w, int h)
 {
+	// A resize in the middle of a frame waits for the swap
+	if (lateLatchPumping) {
+		deferredResize = true;
+		deferredWidth = w;
+		deferredHeight = h;
+		return;
+	}
+
 	windowWidth = w;
 	windowHeight = h;
 	// Sets the new window with the new size
@@ -369,12 +1707,123 @@ void UResizeWindow(int w, int h)
 void URenderGraphics(void)
 {
 
+	// Input handlers run by the late latch don't draw or advance a frame of their own
+	if (lateLatchPumping)
+		return;
+
+	// A replay moves the camera by a fixed timestep every frame
+	if (replayActive)
+		UAdvanceReplay();
+
+	// Waits here while too many frames are queued on the GPU
+	ULatencyBeginFrame();
+
+	chrono::steady_clock::time_point frameStart = chrono::steady_clock::now();
+
+	// Evicts what hasn't been drawn lately if the last frame went over budget
+	residencyFrame++;
+	UEnforceBudget();
+
+	// Uploads decoded mip levels the chairs on screen need
+	UStreamMips();
+
+	// Draws the chairs and lamps through the render graph
+	UBuildFrameGraph();
+
+	if (replayActive)
+		UFinishReplayFrame(frameStart, chrono::steady_clock::now());
+
+	// marks current window to be redisplayed
+	glutPostRedisplay();
+	// Flips the back buffer with the front buffer every frame. Similar to GL Flush
+	glutSwapBuffers();
+
+	// Timestamps the frame for the input latency
+	ULatencyEndFrame();
+
+	// Handles the keys and resize the late latch held back
+	URunDeferredInput();
+
+	// Reports the startup cost once the first frame is done
+	if (!firstFrameDrawn)
+		UReportFirstFrame();
+
+	// Prints the triangle counts every few hundred frames
+	UReportFrameStats();
+
+}
+
+/* Draws one frame with the current camera, in one or four views */
+void UDrawFrame(void)
+{
+
+	// Covers the whole render target
+	glViewport(0, 0, renderTargetWidth, renderTargetHeight);
+
 	// Enable z-depth
 	glEnable(GL_DEPTH_TEST);
 
 	// Clears the screen
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+	glm::mat4 view(1.0f);
+	glm::mat4 projection;
+
+	// The late latch runs before LOD selection and culling, so they see the camera the chairs are drawn with
+	if (!multiViewEnabled && lateLatchEnabled && latencyFrameOpen) {
+		ULateLatchCamera(view, projection);
+	} else {
+		/* Create Movement Logic */
+		UComputeCamera(view, projection);
+
+		// Remembered for mouse picking
+		lastView = view;
+		lastProjection = projection;
+
+		// The input so far is what this camera reflects
+		ULatchInput();
+	}
+
+	// Picks every chair's LOD once from the perspective camera, all views share it
+	for (size_t i = 0; i < sceneObjects.size(); i++)
+		sceneObjects[i].lod = lodEnabled ? USelectLOD(sceneObjects[i], CameraForwardZ) : 0;
+
+	// Hides chairs behind other chairs, the other views see around the perspective camera's occluders
+	UCullOccluded(projection * view, !multiViewEnabled);
+
+	drawCallsSubmitted = 0;
+	textureBindsSubmitted = 0;
+	trianglesSubmitted = 0;
+	trianglesFullDetail = 0;
+
+	if (!multiViewEnabled) {
+		UDrawScene(view, projection);
+		return;
+	}
+
+	// Front, top, side and perspective views
+	UComputeViews(view, projection);
+
+	if (multiViewSinglePass) {
+		UDrawSceneMultiView();
+	} else {
+		// Naive path, the whole scene is submitted again for every view
+		GLfloat targetScale = (GLfloat)renderTargetWidth / windowWidth;
+		for (GLint i = 0; i < viewCount; i++) {
+			glViewport(viewRects[i].x * targetScale, viewRects[i].y * targetScale,
+					   viewRects[i].width * targetScale, viewRects[i].height * targetScale);
+			UDrawScene(viewMatrices[i], projectionMatrices[i]);
+		}
+	}
+
+	// Restores the full render target viewport
+	glViewport(0, 0, renderTargetWidth, renderTargetHeight);
+}
+
+/* Draws the chairs and lamps with one camera */
+void UDrawScene(const glm::mat4& view, const glm::mat4& projection)
+{
+
 	// Location Variables
 	GLint modelLoc;
 	GLint viewLoc;
@@ -387,50 +1836,39 @@ void URenderGraphics(void)
 	GLint viewPositionLoc;
 
 	glm::mat4 model(1.0f);
-	glm::mat4 view(1.0f);
-	glm::mat4 projection;
+
+	// Static lighting comes from the lightmap when it's enabled
+	GLuint chairProgram = lightmapEnabled ? chairLightmapShaderProgram : chairShaderProgram;
 
 	/****** USE THE CHAIR SHADER AND ACTIVATE CHAIR VAO FOR RENDERING AND TRANSFORMING ******/
-	glUseProgram(chairShaderProgram);
+	glUseProgram(chairProgram);
+	// Reloads the chair vertex buffer if it was evicted
+	UUseResource(chairMeshResource);
 	glBindVertexArray(chairVAO);
 
 	// Transforms the chair
 	model = glm::translate(model, chairPosition);
 	model = glm::scale(model, chairScale);
 
-	/* Create Movement Logic */
-	//Replaces camera forward vector with Radians normalized as a unit vector
-	CameraForwardZ = front;
-
-	// Transforms the camera
-	view = glm::translate(view, cameraPosition);
-	view = glm::rotate(view, cameraRotation, glm::vec3(0.0f, 1.0f, 0.0f));
-	view = glm::lookAt(CameraForwardZ, cameraPosition, CameraUpY);
-
-	// Creates a perspective projection
-	projection = glm::perspective(45.0f, (GLfloat)windowWidth / (GLfloat)windowHeight, 0.1f, 100.0f);
-
-	// Creates an Orthographic projection
-	//projection = glm::ortho(-5.0f, 5.0f, -5.0f, 5.0f, 0.1f, 100.0f);
-
-	// Reference matrix uniforms from the chair Shader Program
-	modelLoc = glGetUniformLocation(chairShaderProgram, "model");
-	viewLoc = glGetUniformLocation(chairShaderProgram, "view");
-	projLoc = glGetUniformLocation(chairShaderProgram, "projection");
+	// Reference matrix uniforms from the chair Shader Program, the model matrix is a per-instance attribute
+	viewLoc = glGetUniformLocation(chairProgram, "view");
+	projLoc = glGetUniformLocation(chairProgram, "projection");
 
 	// Pass matrix data to the chair Shader Program's matrix uniforms
-	glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
 	glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
 	glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
 
+	// The late-latched camera replaces both when this frame wrote one
+	glUniform1i(glGetUniformLocation(chairProgram, "lateLatch"), lateLatchThisFrame);
+
 	// Reference matrix uniforms from the Chair Shader program for:
 	// chair color, light color, light position, and camera position
-	uTextureLoc = glGetUniformLocation(chairShaderProgram, "uTexture");
-	keyLightColorLoc = glGetUniformLocation(chairShaderProgram, "keyLightColor");
-	fillLightColorLoc = glGetUniformLocation(chairShaderProgram, "fillLightColor");
-	keyLightPositionLoc = glGetUniformLocation(chairShaderProgram, "keyLightPos");
-	fillLightPositionLoc = glGetUniformLocation(chairShaderProgram, "fillLightPos");
-	viewPositionLoc = glGetUniformLocation(chairShaderProgram, "viewPosition");
+	uTextureLoc = glGetUniformLocation(chairProgram, "uTexture");
+	keyLightColorLoc = glGetUniformLocation(chairProgram, "keyLightColor");
+	fillLightColorLoc = glGetUniformLocation(chairProgram, "fillLightColor");
+	keyLightPositionLoc = glGetUniformLocation(chairProgram, "keyLightPos");
+	fillLightPositionLoc = glGetUniformLocation(chairProgram, "fillLightPos");
+	viewPositionLoc = glGetUniformLocation(chairProgram, "viewPosition");
 
 	//Pass color, light, and camera data to the Pyramid Shader program's corresponding uniforms
 	glUniform1i(uTextureLoc, 0);
@@ -439,18 +1877,27 @@ void URenderGraphics(void)
 	glUniform3f(keyLightPositionLoc, keyLightPosition.x, keyLightPosition.y, keyLightPosition.z);
 	glUniform3f(fillLightPositionLoc, fillLightPosition.x, fillLightPosition.y, fillLightPosition.z);
 	glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+	USetEnvironmentUniforms(chairProgram);
+
+	// The lightmap sits on texture unit 1, the material arrays on unit 0
+	if (lightmapEnabled) {
+		glUniform1i(glGetUniformLocation(chairProgram, "uLightmap"), 1);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, UUseResource(lightmapResource));
+		glActiveTexture(GL_TEXTURE0);
+		glUniform1i(glGetUniformLocation(chairProgram, "lightmapTiles"), lightmapTiles);
+	}
 
-	//Provide texture to the chair
-	glBindTexture(GL_TEXTURE_2D, texture);
-
-	// Draw the chair
-	glDrawArrays(GL_TRIANGLES, 0, 162);
+	// Draw every chair with the LOD picked for its distance to the camera and its material's texture
+	UDrawChairs(chairProgram, 1);
 
 	// Deactivate the chair Vertex Array Object
 	glBindVertexArray(0);
 
 /****** USE THE KEY LIGHT SHADER AND ACTIVATE LAMP VERTEX ARRAY OBJECT FOR RENDERING AND TRANSFORMING ******/
 	glUseProgram(keyLightShaderProgram);
+	// Both lamps share the cube's vertex buffer
+	UUseResource(lightMeshResource);
 	glBindVertexArray(keyLightVAO);
 
 	// Transform the smaller chair used as a visual que for the light source
@@ -466,6 +1913,7 @@ void URenderGraphics(void)
 	glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
 	glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
 	glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+	glUniform1i(glGetUniformLocation(keyLightShaderProgram, "lateLatch"), lateLatchThisFrame);
 
 	// Draw the smaller LAMP cube
 	glDrawArrays(GL_TRIANGLES, 0, 36);
@@ -490,6 +1938,7 @@ void URenderGraphics(void)
 	glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
 	glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
 	glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+	glUniform1i(glGetUniformLocation(fillLightShaderProgram, "lateLatch"), lateLatchThisFrame);
 
 	// Draw the smaller LAMP cube
 	glDrawArrays(GL_TRIANGLES, 0, 36);
@@ -497,10 +1946,10 @@ void URenderGraphics(void)
 	// Deactivate the lamp Vertex Array Object
 	glBindVertexArray(0);
 
-	// marks current window to be redisplayed
-	glutPostRedisplay();
-	// Flips the back buffer with the front buffer every frame. Similar to GL Flush
-	glutSwapBuffers();
+	// Both lamp cubes are always drawn at full detail
+	drawCallsSubmitted += 2;
+	trianglesSubmitted += 2 * 12;
+	trianglesFullDetail += 2 * 12;
 
 }
 
@@ -519,6 +1968,14 @@ void UCreateShader(void)
 	glLinkProgram(chairShaderProgram);
 	CheckStatus(chairShaderProgram, false);
 
+	// CHAIR LIGHTMAP SHADERS
+	// Reads ambient and diffuse light from the baked lightmap and adds the specular
+	chairLightmapShaderProgram = glCreateProgram();
+	AttachShader(chairLightmapShaderProgram, GL_VERTEX_SHADER, chairLightmapVertexShaderSource);
+	AttachShader(chairLightmapShaderProgram, GL_FRAGMENT_SHADER, chairLightmapFragmentShaderSource);
+	glLinkProgram(chairLightmapShaderProgram);
+	CheckStatus(chairLightmapShaderProgram, false);
+
 	// KEY LAMP SHADERS
 	// Creates the shader program and returns an ID for the lamp
 	keyLightShaderProgram = glCreateProgram();
@@ -541,12 +1998,67 @@ void UCreateShader(void)
 	glLinkProgram(fillLightShaderProgram);
 	CheckStatus(fillLightShaderProgram, false);
 
+	// MULTI-VIEW SHADERS
+	if (multiViewSupported) {
+
+		// Chair, shares the fragment shader of the single view chair
+		chairMultiViewShaderProgram = glCreateProgram();
+		AttachShader(chairMultiViewShaderProgram, GL_VERTEX_SHADER, chairMultiViewVertexShaderSource);
+		AttachShader(chairMultiViewShaderProgram, GL_GEOMETRY_SHADER, chairMultiViewGeometryShaderSource);
+		AttachShader(chairMultiViewShaderProgram, GL_FRAGMENT_SHADER, chairFragmentShaderSource);
+		glLinkProgram(chairMultiViewShaderProgram);
+		CheckStatus(chairMultiViewShaderProgram, false);
+
+		// Key lamp
+		keyLightMultiViewShaderProgram = glCreateProgram();
+		AttachShader(keyLightMultiViewShaderProgram, GL_VERTEX_SHADER, lightMultiViewVertexShaderSource);
+		AttachShader(keyLightMultiViewShaderProgram, GL_GEOMETRY_SHADER, lightMultiViewGeometryShaderSource);
+		AttachShader(keyLightMultiViewShaderProgram, GL_FRAGMENT_SHADER, keyLightFragmentShaderSource);
+		glLinkProgram(keyLightMultiViewShaderProgram);
+		CheckStatus(keyLightMultiViewShaderProgram, false);
+
+		// Fill lamp
+		fillLightMultiViewShaderProgram = glCreateProgram();
+		AttachShader(fillLightMultiViewShaderProgram, GL_VERTEX_SHADER, lightMultiViewVertexShaderSource);
+		AttachShader(fillLightMultiViewShaderProgram, GL_GEOMETRY_SHADER, lightMultiViewGeometryShaderSource);
+		AttachShader(fillLightMultiViewShaderProgram, GL_FRAGMENT_SHADER, fillLightFragmentShaderSource);
+		glLinkProgram(fillLightMultiViewShaderProgram);
+		CheckStatus(fillLightMultiViewShaderProgram, false);
+
+		// All three read their cameras from the view uniform buffer
+		GLint programs[] = { chairMultiViewShaderProgram, keyLightMultiViewShaderProgram, fillLightMultiViewShaderProgram };
+		for (GLint program : programs)
+			glUniformBlockBinding(program, glGetUniformBlockIndex(program, "ViewBlock"), viewBlockBinding);
+	}
+
+	// The single view shaders read the late-latched camera from the camera buffer
+	GLint cameraPrograms[] = { chairShaderProgram, chairLightmapShaderProgram, keyLightShaderProgram, fillLightShaderProgram };
+	for (GLint program : cameraPrograms)
+		glUniformBlockBinding(program, glGetUniformBlockIndex(program, "CameraBlock"), cameraBlockBinding);
+
+	// DEPTH VIEW SHADERS
+	depthViewShaderProgram = glCreateProgram();
+	AttachShader(depthViewShaderProgram, GL_VERTEX_SHADER, depthViewVertexShaderSource);
+	AttachShader(depthViewShaderProgram, GL_FRAGMENT_SHADER, depthViewFragmentShaderSource);
+	glLinkProgram(depthViewShaderProgram);
+	CheckStatus(depthViewShaderProgram, false);
+
 }
 
 
 /* Implements the UKeyboard function */
 void UKeyboard(unsigned char key, GLint x, GLint y)
 {
+	// Only camera input is latched mid-frame, keys run their benchmarks and toggles after the swap
+	if (lateLatchPumping) {
+		deferredKeys.push_back({ key, x, y });
+		return;
+	}
+
+	// Live input is ignored while a recording is replayed
+	if (replayActive && !replayDispatching)
+		return;
+
 	switch(key){
 
 		case GLUT_ACTIVE_ALT:
@@ -554,40 +2066,137 @@ void UKeyboard(unsigned char key, GLint x, GLint y)
 			cout<<"You pressed ALT!"<<endl;
 			break;
 
-		default:
-			cout<<"Press a key!"<<endl;
-	}
-}
+		// Toggles level of detail selection
+		case 'l':
+			lodEnabled = !lodEnabled;
+			cout<<"Level of detail "<<(lodEnabled ? "enabled" : "disabled")<<endl;
+			break;
 
-/* CREATES THE BUFFER AND ARRAY OBJECTS */
-void UCreateBuffers()
-{
-	GLfloat chairVertices[] = {
-							//Positions			   // Normals			// Texture Coordinates
+		// Toggles the four view layout
+		case 'v':
+			multiViewEnabled = !multiViewEnabled;
+			cout<<"Multi-view "<<(multiViewEnabled ? "enabled" : "disabled")<<endl;
+			break;
 
-							// CHAIR SEAT
-							// Front
-						   -2.0f, -0.2f,  2.0f,	   0.0f, 0.0f, 1.0f, 	0.0f, 0.0f,
-							2.0f, -0.2f,  2.0f,    0.0f, 0.0f, 1.0f,	1.0f, 0.0f,
-							2.0f,  0.2f,  2.0f,    0.0f, 0.0f, 1.0f,	1.0f, 1.0f,
-						    2.0f,  0.2f,  2.0f,    0.0f, 0.0f, 1.0f,	1.0f, 1.0f,
-						   -2.0f,  0.2f,  2.0f,    0.0f, 0.0f, 1.0f,	0.0f, 1.0f,
-						   -2.0f, -0.2f,  2.0f,    0.0f, 0.0f, 1.0f,	0.0f, 0.0f,
+		// Compares single pass multi-view against one pass per view
+		case 'b':
+			UBenchmarkMultiView();
+			break;
 
-						   // Right
-						    2.0f, -0.2f, -2.0f,	   1.0f, 0.0f, 0.0f,	0.0f, 0.0f,
-						    2.0f,  0.2f, -2.0f,    1.0f, 0.0f, 0.0f,  	1.0f, 0.0f,
-							2.0f,  0.2f,  2.0f,    1.0f, 0.0f, 0.0f,  	1.0f, 1.0f,
-						    2.0f,  0.2f,  2.0f,    1.0f, 0.0f, 0.0f,  	1.0f, 1.0f,
-						    2.0f, -0.2f,  2.0f,    1.0f, 0.0f, 0.0f,  	0.0f, 1.0f,
-						    2.0f, -0.2f, -2.0f,    1.0f, 0.0f, 0.0f,  	0.0f, 0.0f,
+		// Shows the scene depth instead of the scene
+		case 'z':
+			showDepthBuffer = !showDepthBuffer;
+			break;
 
-						   // Back
-						   -2.0f, -0.2f, -2.0f,	   0.0f, 0.0f,-1.0f, 	0.0f, 0.0f,
-						   -2.0f,  0.2f, -2.0f,    0.0f, 0.0f,-1.0f,    1.0f, 0.0f,
-							2.0f,  0.2f, -2.0f,    0.0f, 0.0f,-1.0f,    1.0f, 1.0f,
-						    2.0f,  0.2f, -2.0f,    0.0f, 0.0f,-1.0f,    1.0f, 1.0f,
-						    2.0f, -0.2f, -2.0f,    0.0f, 0.0f,-1.0f,    0.0f, 1.0f,
+		// Toggles transient texture aliasing in the render graph
+		case 'a':
+			renderGraphAliasing = !renderGraphAliasing;
+			cout<<"Render graph aliasing "<<(renderGraphAliasing ? "enabled" : "disabled")<<endl;
+			break;
+
+		// Prints the next compiled render graph
+		case 'g':
+			renderGraphDumpRequested = true;
+			break;
+
+		// Toggles batching chairs by material texture array
+		case 'm':
+			materialBatching = !materialBatching;
+			cout<<"Material batching "<<(materialBatching ? "enabled" : "disabled")<<endl;
+			break;
+
+		// Compares batched materials against a draw and bind per chair
+		case 'n':
+			UBenchmarkMaterials();
+			break;
+
+		// Compares submission time with different numbers of recording threads
+		case 'c':
+			UBenchmarkCommandLists();
+			break;
+
+		// Toggles software occlusion culling
+		case 'o':
+			occlusionEnabled = !occlusionEnabled;
+			cout<<"Occlusion culling "<<(occlusionEnabled ? "enabled" : "disabled")<<endl;
+			break;
+
+		// Toggles shading from the baked lightmap, baking it the first time
+		case 'k':
+			if (!lightmapBaked) {
+				UBakeLighting();
+				UUploadLightmap();
+			}
+			lightmapEnabled = !lightmapEnabled;
+			cout<<"Baked lighting "<<(lightmapEnabled ? "enabled" : "disabled")<<endl;
+			break;
+
+		// Compares the fragment cost of baked lighting against full Phong
+		case 'f':
+			UBenchmarkLightmap();
+			break;
+
+		// Toggles ambient light from the environment map, projecting it the first time
+		case 'e':
+			if (!environmentLoaded)
+				ULoadEnvironment();
+			environmentLighting = !environmentLighting;
+			cout<<"Environment lighting "<<(environmentLighting ? "enabled" : "disabled")<<endl;
+			break;
+
+		// Saves the chairs, lights and camera
+		case 'w':
+			if (UIsJSONScene(sceneSavePath) ? USaveSceneJSON(sceneSavePath.c_str()) : USaveScene(sceneSavePath.c_str()))
+				cout<<"Saved "<<sceneObjects.size()<<" chairs to "<<sceneSavePath<<endl;
+			break;
+
+		// Toggles reading the camera again just before the chairs are drawn
+		case 'i':
+			lateLatchEnabled = !lateLatchEnabled;
+			cout<<"Late-latched camera "<<(lateLatchEnabled ? "enabled" : "disabled")<<endl;
+			break;
+
+		// Prints GPU memory usage and every resource
+		case 'r':
+			UReportResidency();
+			break;
+
+		default:
+			cout<<"Press a key!"<<endl;
+	}
+
+	URecordInput(InputKey, x, y, key, 0);
+}
+
+/* CHAIR VERTEX DATA
+ * Kept at file scope so the CPU side picking can build its BVH from it
+ */
+GLfloat chairVertices[] = {
+							//Positions			   // Normals			// Texture Coordinates
+
+							// CHAIR SEAT
+							// Front
+						   -2.0f, -0.2f,  2.0f,	   0.0f, 0.0f, 1.0f, 	0.0f, 0.0f,
+							2.0f, -0.2f,  2.0f,    0.0f, 0.0f, 1.0f,	1.0f, 0.0f,
+							2.0f,  0.2f,  2.0f,    0.0f, 0.0f, 1.0f,	1.0f, 1.0f,
+						    2.0f,  0.2f,  2.0f,    0.0f, 0.0f, 1.0f,	1.0f, 1.0f,
+						   -2.0f,  0.2f,  2.0f,    0.0f, 0.0f, 1.0f,	0.0f, 1.0f,
+						   -2.0f, -0.2f,  2.0f,    0.0f, 0.0f, 1.0f,	0.0f, 0.0f,
+
+						   // Right
+						    2.0f, -0.2f, -2.0f,	   1.0f, 0.0f, 0.0f,	0.0f, 0.0f,
+						    2.0f,  0.2f, -2.0f,    1.0f, 0.0f, 0.0f,  	1.0f, 0.0f,
+							2.0f,  0.2f,  2.0f,    1.0f, 0.0f, 0.0f,  	1.0f, 1.0f,
+						    2.0f,  0.2f,  2.0f,    1.0f, 0.0f, 0.0f,  	1.0f, 1.0f,
+						    2.0f, -0.2f,  2.0f,    1.0f, 0.0f, 0.0f,  	0.0f, 1.0f,
+						    2.0f, -0.2f, -2.0f,    1.0f, 0.0f, 0.0f,  	0.0f, 0.0f,
+
+						   // Back
+						   -2.0f, -0.2f, -2.0f,	   0.0f, 0.0f,-1.0f, 	0.0f, 0.0f,
+						   -2.0f,  0.2f, -2.0f,    0.0f, 0.0f,-1.0f,    1.0f, 0.0f,
+							2.0f,  0.2f, -2.0f,    0.0f, 0.0f,-1.0f,    1.0f, 1.0f,
+						    2.0f,  0.2f, -2.0f,    0.0f, 0.0f,-1.0f,    1.0f, 1.0f,
+						    2.0f, -0.2f, -2.0f,    0.0f, 0.0f,-1.0f,    0.0f, 1.0f,
 						   -2.0f, -0.2f, -2.0f,    0.0f, 0.0f,-1.0f,    0.0f, 0.0f,
 
 						   // Left
@@ -786,11 +2395,13 @@ void UCreateBuffers()
 						    -1.4f, -3.0f, -1.6f, 	-1.0f, 0.0f, 0.0f,   0.0f, 1.0f,
 						    -1.4f, -0.2f, -1.6f, 	-1.0f, 0.0f, 0.0f,   0.0f, 0.0f,
 
+};
 
-		};
+// Number of vertices in the full detail chair
+const GLsizei chairVertexCount = sizeof(chairVertices) / (8 * sizeof(GLfloat));
 
-	// Position and Normal coordinate data
-	GLfloat lightVertices[] {
+// Position data of the lamp cube
+const GLfloat lightVertices[] {
 
 				// Position
 				// Back Face
@@ -841,17 +2452,79 @@ void UCreateBuffers()
 			   -0.5f,   0.5f,  -0.5f,
 	};
 
+// Number of vertices in the lamp cube
+const GLsizei lightVertexCount = sizeof(lightVertices) / (3 * sizeof(GLfloat));
+
+/* CREATES THE BUFFER AND ARRAY OBJECTS */
+void UCreateBuffers()
+{
+	// The startup jobs built the picking hierarchy, the LOD chain stored after
+	// the full mesh in the same VBO and the lightmap coordinates stored with it
+
 	// Chair
-	// Generate buffer IDs for chair
+	// Generate the chair VAO, the residency manager creates its VBO
 	glGenVertexArrays(1, &chairVAO);
-	glGenBuffers(1, &chairVBO);
+	chairMeshResource = URegisterResource("chair mesh", ResourceBuffer, ULoadChairMesh);
+
+	// Set attribute pointers 3 to 8 to hold the per-instance model matrix, material layer and lightmap layer
+	glBindVertexArray(chairVAO);
+	glGenBuffers(1, &chairInstanceVBO);
+	for (GLuint i = 3; i <= 8; i++)
+		glEnableVertexAttribArray(i);
+	UBindInstanceAttributes(0, 1);
+	glBindVertexArray(0);
+
+	// Rewritten every frame, so it's tracked but never evicted
+	chairInstanceResource = URegisterResource("chair instances", ResourceBuffer, nullptr, chairInstanceVBO, 0);
+
+	// KEY LIGHT & FILL LIGHT
+	// Generate buffer IDs for light source, both lamps share one VBO
+	glGenVertexArrays(1, &keyLightVAO);
+	glGenVertexArrays(1, &fillLightVAO);
+	lightMeshResource = URegisterResource("lamp mesh", ResourceBuffer, ULoadLightMesh);
+
+	// MULTI-VIEW CAMERAS
+	// One uniform buffer for the view and projection matrices of every view
+	glGenBuffers(1, &viewUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, viewUBO);
+	glBufferData(GL_UNIFORM_BUFFER, 2 * maxViews * sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, viewBlockBinding, viewUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	URegisterResource("view matrices", ResourceBuffer, nullptr, viewUBO, 2 * maxViews * sizeof(glm::mat4));
+
+	// LATENCY
+	// Timestamp queries and the late-latched camera's uniform buffer
+	UCreateLatencyObjects();
+
+	// RENDER GRAPH
+	// Offscreen passes attach their targets to this framebuffer
+	glGenFramebuffers(1, &renderGraphFBO);
+	// Core profile needs a VAO bound even for draws without attributes
+	glGenVertexArrays(1, &fullscreenVAO);
+
+}
+
+
+
+/* Creates the chair VBO from chairLODVertices and points the chair VAO at it
+ * The lightmap coordinates follow the vertices in the same buffer.
+ * Called at startup and whenever the buffer is reloaded after an eviction
+ */
+size_t ULoadChairMesh(GLuint& buffer)
+{
+	size_t vertexBytes = chairLODVertices.size() * sizeof(GLfloat);
+	size_t bytes = vertexBytes + chairLightmapCoordinates.size() * sizeof(GLfloat);
+
+	glGenBuffers(1, &buffer);
 
 	// Activate the VAO before binding and setting any VBOs or Attribute Pointers
 	glBindVertexArray(chairVAO);
 
 	// Activate the VBO
-	glBindBuffer(GL_ARRAY_BUFFER, chairVBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(chairVertices), chairVertices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glBufferData(GL_ARRAY_BUFFER, bytes, NULL, GL_STATIC_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, vertexBytes, chairLODVertices.data());
+	glBufferSubData(GL_ARRAY_BUFFER, vertexBytes, bytes - vertexBytes, chairLightmapCoordinates.data());
 
 	// Set attribute pointer 0 to hold Position data
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)0);
@@ -865,89 +2538,215 @@ void UCreateBuffers()
 	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)(6 * sizeof(GLfloat)));
 	glEnableVertexAttribArray(2);
 
+	//Set attribute pointer 9 to hold the lightmap coordinates
+	glVertexAttribPointer(9, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), (GLvoid*)vertexBytes);
+	glEnableVertexAttribArray(9);
+
 	// Deactivates the VAO which is good practice
 	glBindVertexArray(0);
 
-	// KEY LIGHT
-	// Generate buffer IDs for light source
-	glGenVertexArrays(1, &keyLightVAO);
+	return bytes;
+}
 
-	// Activate the VAO before binding and setting any VBOs or Attribute Pointers
-	glBindVertexArray(keyLightVAO);
+/* Creates the lamp cube VBO and points both lamp VAOs at it */
+size_t ULoadLightMesh(GLuint& buffer)
+{
+	glGenBuffers(1, &buffer);
 
 	// Activate the light VBO
-	glBindBuffer(GL_ARRAY_BUFFER, lightVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
 	glBufferData(GL_ARRAY_BUFFER, sizeof(lightVertices), lightVertices, GL_STATIC_DRAW);
 
-	// Set attribute pointer 0 to hold Position data
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (GLvoid*)0);
-	glEnableVertexAttribArray(0);
+	GLuint lampVAOs[] = { keyLightVAO, fillLightVAO };
+	for (GLuint vao : lampVAOs) {
+
+		// Activate the VAO before setting any Attribute Pointers
+		glBindVertexArray(vao);
+
+		// Set attribute pointer 0 to hold Position data
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (GLvoid*)0);
+		glEnableVertexAttribArray(0);
+	}
 
 	// Deactivates the VAO which is good practice
 	glBindVertexArray(0);
 
-	// FILL LIGHT
-	// Generate buffer IDs for light source
-	glGenVertexArrays(1, &fillLightVAO);
+	return sizeof(lightVertices);
+}
 
-	// Activate the VAO before binding and setting any VBOs or Attribute Pointers
-	glBindVertexArray(fillLightVAO);
+/* Loads a material's image, or a small texture of its flat color if the file is missing */
+unsigned char* ULoadMaterialImage(const Material& material, GLint& width, GLint& height)
+{
+	// Loads texture file
+	unsigned char* image = SOIL_load_image(material.file, &width, &height, 0, SOIL_LOAD_RGB);
+	if (image)
+		return image;
+
+	cout<<material.file<<" not found, using a flat "<<material.name<<" color"<<endl;
+	width = height = fallbackTextureSize;
+	image = (unsigned char*)malloc(fallbackTextureSize * fallbackTextureSize * 3);
+	for (GLint t = 0; t < fallbackTextureSize * fallbackTextureSize; t++)
+		for (int c = 0; c < 3; c++)
+			image[t * 3 + c] = (unsigned char)(material.fallbackColor[c] * 255.0f);
+	return image;
+}
+
+/* Creates the texture of one material array
+ * decoded holds every material's image at startup, reloads pass NULL and read the files again.
+ */
+size_t ULoadMaterialArray(GLint arrayIndex, GLuint& texture, const vector<unsigned char*>* decoded)
+{
+	MaterialArray& array = materialArrays[arrayIndex];
 
-	// Activate the same light VBO
-	glBindBuffer(GL_ARRAY_BUFFER, lightVBO);
+	// Create texture
+	glGenTextures(1, &texture);
+	// Bind to type of texture
+	glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
 
-	// Set attribute pointer 0 to hold Position data
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (GLvoid*)0);
-	glEnableVertexAttribArray(0);
+	// Streamed arrays start from the coarse tail, or the placeholder while the images are decoded
+	if (mipStreaming) {
 
-	// Deactivates the VAO which is good practice
-	glBindVertexArray(0);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, array.levels - 1);
 
-}
+		if (UMipsReady(arrayIndex)) {
+			for (GLint level = array.levels - 1; level >= array.tailLevel; level--)
+				UUploadMipLevel(arrayIndex, level);
+			array.residentLevel = array.tailLevel;
+		} else {
+			UUploadMipPlaceholder(arrayIndex);
+			array.residentLevel = array.levels - 1;
+		}
+
+		array.minLod = 0.0f;
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, array.residentLevel);
+		glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_LOD, 0.0f);
+
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		return UMipBytes(array, array.residentLevel);
+	}
+
+	// Allocates every layer, then loads each material's image into its layer
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB, array.width, array.height, array.layers, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+	for (size_t m = 0; m < materials.size(); m++) {
+
+		if (materials[m].array != arrayIndex)
+			continue;
+
+		GLint width, height;
+		unsigned char* image = decoded ? (*decoded)[m] : ULoadMaterialImage(materials[m], width, height);
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, materials[m].layer, array.width, array.height, 1,
+						GL_RGB, GL_UNSIGNED_BYTE, image);
+		if (!decoded)
+			SOIL_free_image_data(image);
+	}
+
+	// Filter texture with mipmap to provide higher quality and performance
+	glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 
+	// Deactivate texture after using it
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
 
+	return UMipBytes(array, 0);
+}
 
-/* Generate and load the texture */
+/* Generate and load the material textures
+ * Materials of the same size share a texture array, one layer each
+ */
 void UGenerateTexture(void) {
 
-		// Local variable declarations
-		int width;
-		int height;
-
-		// Loads texture file
-		unsigned char* image = SOIL_load_image("wood_texture.jpg", &width, &height, 0, SOIL_LOAD_RGB);
-
-		// Create texture
-		glGenTextures(1, &texture);
-		// Bind to type of texture
-		glBindTexture(GL_TEXTURE_2D, texture);
-
-		// Load the texture image
-		// Parameters: (1) Texture Target, (2) Level of Detail, (3) Internal Pixel Format
-		// (4) Width, (5) Height, (6) "0", (7 & 8) Format of Pixels, (9) Image Array
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-		// Filter texture with mipmap to provide higher quality and performance
-		glGenerateMipmap(GL_TEXTURE_2D);
-		// Load configured image texture
-		SOIL_free_image_data(image);
-		// Deactivate texture after using it
-		glBindTexture(GL_TEXTURE_2D, 0);
+		// RGB rows of the small mips aren't four byte aligned
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+		vector<unsigned char*> images(materials.size(), NULL);
+
+		for (size_t m = 0; m < materials.size(); m++) {
+
+			// Streaming only needs the size now, the loader thread decodes the image
+			GLint width, height;
+			if (!startupImages.empty()) {
+				// Decoded, or only sized, by the startup jobs
+				images[m] = startupImages[m].pixels;
+				width = startupImages[m].width;
+				height = startupImages[m].height;
+			} else if (!mipStreaming)
+				images[m] = ULoadMaterialImage(materials[m], width, height);
+			else if (!UReadImageSize(materials[m].file, width, height))
+				width = height = fallbackTextureSize;
+
+			// Finds the array of this size or starts a new one
+			GLint array = 0;
+			while (array < (GLint)materialArrays.size() &&
+				   (materialArrays[array].width != width || materialArrays[array].height != height))
+				array++;
+			if (array == (GLint)materialArrays.size()) {
+
+				// The tail starts at the first level no larger than mipTailSize
+				GLint levels = 1, tailLevel = 0;
+				while (max(width, height) >> levels)
+					levels++;
+				while ((max(width, height) >> tailLevel) > mipTailSize)
+					tailLevel++;
+
+				materialArrays.push_back({ width, height, 0, -1, levels, tailLevel, levels - 1, levels - 1, 0.0f });
+			}
+
+			materials[m].array = array;
+			materials[m].layer = materialArrays[array].layers++;
+		}
+
+		// Decodes the images in the background
+		if (mipStreaming) {
+			materialMips.resize(materials.size());
+			materialMipsReady.assign(materials.size(), false);
+			mipKeepLevels.assign(materials.size(), 0);
+			for (size_t m = 0; m < materials.size(); m++)
+				mipDecodeQueue.push_back(m);
+			mipLoaderThread = thread(UMipLoader);
+			atexit(UStopMipStreaming);
+		}
+
+		// Uploads the images already decoded, reloads after an eviction read the files again
+		for (GLint a = 0; a < (GLint)materialArrays.size(); a++) {
+			GLuint texture;
+			size_t bytes = ULoadMaterialArray(a, texture, mipStreaming ? NULL : &images);
+			string name = "material array " + to_string(materialArrays[a].width) + "x" + to_string(materialArrays[a].height);
+			materialArrays[a].resource = URegisterResource(name.c_str(), ResourceTexture,
+				[a](GLuint& reloaded) { return ULoadMaterialArray(a, reloaded, NULL); }, texture, bytes);
+		}
+
+		// Frees the images, fallbacks were allocated with malloc like SOIL's
+		for (unsigned char* image : images)
+			if (image)
+				SOIL_free_image_data(image);
+		startupImages.clear();
+
+		cout<<materials.size()<<" materials in "<<materialArrays.size()<<" texture arrays"<<endl;
 
 }
 
 /* Implements the UMouseMove function */
 void UMouseMove(int x, int y)
 {
-
+		// Live input is ignored while a recording is replayed
+		if (replayActive)
+			return;
 
 		// Orbits around the center
 		front.x = 10.0f * cos(yaw);
 		front.y = 10.0f * sin(pitch);
 		front.z = sin(yaw) * cos(pitch) * 10.0f;
+
+		URecordInput(InputMouseMove, x, y, 0, 0);
 }
 
 void onMotion(int curr_x, int curr_y) {
 
+		// Live input is ignored while a recording is replayed
+		if (replayActive)
+			return;
+
 		// if left alt and mouse down are set
 		if(checkMotion) {
 
@@ -1022,10 +2821,16 @@ if(checkZoom) {
 		lastMouseY = curr_y;
 		lastMouseX = curr_x;
 }
+
+URecordInput(InputMotion, curr_x, curr_y, 0, 0);
 }
 
 void OnMouseClicks(int button, int state, int x, int y) {
 
+	// Live input is ignored while a recording is replayed
+	if (replayActive)
+		return;
+
 	// checks for modifier keys like alt, shift, and ctrl
 	keymod = glutGetModifiers();
 
@@ -1046,7 +2851,5995 @@ void OnMouseClicks(int button, int state, int x, int y) {
 			// zoom to be true and motion to be false
 			checkMotion = false;
 			checkZoom = true;
+
+	}else if(button == GLUT_LEFT_BUTTON && keymod != GLUT_ACTIVE_ALT && state == GLUT_DOWN) {
+
+			// plain left click selects the chair part under the cursor
+			UPickAt(x, y);
+	}
+
+	URecordInput(InputClick, x, y, button, state);
+}
+
+
+/* Reads the program options, options without a leading "--" belong to GLUT
+ * --showroom N		fills the scene with an N x N grid of chairs
+ * --no-lod			starts with level of detail selection disabled
+ * --multiview		starts in the four view layout
+ * --no-batching		starts with one draw call and texture bind per chair
+ * --memory-budget MB	GPU memory budget for buffers and textures (default unlimited)
+ * --no-mip-streaming	loads every texture with all its mip levels before the first frame
+ * --command-workers N	records the chair draws on N threads (default 0, drawn inline)
+ * --no-occlusion		starts with software occlusion culling disabled
+ * --occlusion-threads N	rasterizes occluders on N threads (default up to four)
+ * --bench-pick		measures BVH ray picking on a million triangle mesh and exits
+ * --record FILE		records input events and camera state to FILE
+ * --replay FILE		drives the camera from a recording at a fixed timestep, then exits
+ * --headless		replays into a hidden window
+ * --timestep SEC	replay timestep (default 1/60)
+ * --timings FILE	per frame replay timings (default replay_timings.csv)
+ * --perf-budget MS	replay exits with status 1 if the 95th percentile frame time exceeds MS
+ * --render-scale S	renders the scene offscreen at S times the window resolution
+ * --no-aliasing		gives every transient render graph texture its own memory
+ * --dump-graph		prints the first compiled render graph
+ * --pathtrace FILE	path traces the scene into a PPM image and exits
+ * --spp N			path tracer samples per pixel (default 64)
+ * --time-limit SEC	stops refining the path traced image after SEC seconds
+ * --threads N		path tracer, lightmap baker and SH projection threads (default every core)
+ * --pathtrace-scaling	measures path tracer scaling from 1 to N threads and exits
+ * --lightmap		bakes the scene's lighting on load and shades the chairs with it
+ * --bake-indirect	bakes one bounce of indirect light instead of the flat ambient term
+ * --lightmap-size N	texels per side of every chair's lightmap (default 128)
+ * --lightmap-scaling	measures lightmap baking scaling from 1 to N threads and exits
+ * --environment FILE	ambient light from a Radiance .hdr environment map
+ * --no-jobs		runs the startup work on the GL thread, one step after the other
+ * --job-threads N	job system worker threads (default every core but one)
+ * --job-trace FILE	writes a Chrome trace of the startup jobs to FILE
+ * --load-scene FILE	places the chairs, lights and camera from a scene file, .json files are read as JSON
+ * --save-scene FILE	where the 'w' key saves the scene (default showroom.scene)
+ * --scene-benchmark N	compares loading N objects from a binary scene and from JSON and exits (default 100000)
+ * --late-latch		starts with the camera read again just before the chairs are culled and drawn
+ * --max-queued-frames N	frames the CPU may submit ahead of the GPU (default 2, 0 for no limit)
+ * --poster FILE		renders a tiled poster into a PPM image with worker processes and exits
+ * --poster-width N	poster width in pixels (default 16384)
+ * --poster-height N	poster height in pixels (default the window's aspect ratio)
+ * --poster-tile N	poster tile size in pixels (default 2048)
+ * --poster-workers N	poster worker processes (default every core)
+ */
+void UParseArguments(int argc, char* argv[])
+{
+	for (int i = 1; i < argc; i++) {
+
+		if (strcmp(argv[i], "--showroom") == 0 && i + 1 < argc) {
+			showroomSize = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--no-lod") == 0) {
+			lodEnabled = false;
+		} else if (strcmp(argv[i], "--multiview") == 0) {
+			multiViewEnabled = true;
+		} else if (strcmp(argv[i], "--no-batching") == 0) {
+			materialBatching = false;
+		} else if (strcmp(argv[i], "--command-workers") == 0 && i + 1 < argc) {
+			commandWorkers = max(0, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--no-occlusion") == 0) {
+			occlusionEnabled = false;
+		} else if (strcmp(argv[i], "--occlusion-threads") == 0 && i + 1 < argc) {
+			occlusionThreads = max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--no-mip-streaming") == 0) {
+			mipStreaming = false;
+		} else if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc) {
+			residencyBudget = (size_t)(atof(argv[++i]) * 1024.0 * 1024.0);
+		} else if (strcmp(argv[i], "--bench-pick") == 0) {
+			benchmarkPicking = true;
+		} else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			UStartRecording(argv[++i]);
+		} else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			if (!ULoadReplay(argv[++i]))
+				exit(EXIT_FAILURE);
+		} else if (strcmp(argv[i], "--headless") == 0) {
+			replayHeadless = true;
+		} else if (strcmp(argv[i], "--timestep") == 0 && i + 1 < argc) {
+			replayTimestep = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--timings") == 0 && i + 1 < argc) {
+			replayTimingsPath = argv[++i];
+		} else if (strcmp(argv[i], "--perf-budget") == 0 && i + 1 < argc) {
+			replayPerfBudget = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--render-scale") == 0 && i + 1 < argc) {
+			renderScale = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--no-aliasing") == 0) {
+			renderGraphAliasing = false;
+		} else if (strcmp(argv[i], "--dump-graph") == 0) {
+			renderGraphDumpRequested = true;
+		} else if (strcmp(argv[i], "--pathtrace") == 0 && i + 1 < argc) {
+			pathTraceMode = true;
+			pathTraceOutput = argv[++i];
+		} else if (strcmp(argv[i], "--spp") == 0 && i + 1 < argc) {
+			pathTraceSamples = max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--time-limit") == 0 && i + 1 < argc) {
+			pathTraceTimeLimit = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			pathTraceThreads = max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--pathtrace-scaling") == 0) {
+			pathTraceScaling = true;
+		} else if (strcmp(argv[i], "--lightmap") == 0) {
+			lightmapEnabled = true;
+		} else if (strcmp(argv[i], "--bake-indirect") == 0) {
+			lightmapIndirect = true;
+		} else if (strcmp(argv[i], "--lightmap-size") == 0 && i + 1 < argc) {
+			lightmapSize = max(16, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--lightmap-scaling") == 0) {
+			lightmapScaling = true;
+		} else if (strcmp(argv[i], "--environment") == 0 && i + 1 < argc) {
+			environmentLighting = true;
+			environmentPath = argv[++i];
+		} else if (strcmp(argv[i], "--no-jobs") == 0) {
+			jobSystemEnabled = false;
+		} else if (strcmp(argv[i], "--job-threads") == 0 && i + 1 < argc) {
+			jobThreads = max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--job-trace") == 0 && i + 1 < argc) {
+			jobTracePath = argv[++i];
+		} else if (strcmp(argv[i], "--load-scene") == 0 && i + 1 < argc) {
+			sceneLoadPath = argv[++i];
+		} else if (strcmp(argv[i], "--save-scene") == 0 && i + 1 < argc) {
+			sceneSavePath = argv[++i];
+		} else if (strcmp(argv[i], "--scene-benchmark") == 0) {
+			sceneBenchmarkObjects = 100000;
+			if (i + 1 < argc && isdigit(argv[i + 1][0]))
+				sceneBenchmarkObjects = max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--late-latch") == 0) {
+			lateLatchEnabled = true;
+		} else if (strcmp(argv[i], "--max-queued-frames") == 0 && i + 1 < argc) {
+			maxQueuedFrames = max(0, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--poster") == 0 && i + 1 < argc) {
+			posterPath = argv[++i];
+			// Tiles are read back once, every texture needs its finest mip from the start
+			mipStreaming = false;
+		} else if (strcmp(argv[i], "--poster-width") == 0 && i + 1 < argc) {
+			posterWidth = max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--poster-height") == 0 && i + 1 < argc) {
+			posterHeight = max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--poster-tile") == 0 && i + 1 < argc) {
+			posterTileSize = max(16, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--poster-workers") == 0 && i + 1 < argc) {
+			posterWorkers = max(1, atoi(argv[++i]));
+		} else if (strncmp(argv[i], "--", 2) == 0) {
+			cout<<"Unknown option "<<argv[i]<<endl;
+		}
+	}
+}
+
+/* Places the chairs in the scene */
+void UCreateScene(void)
+{
+	// A saved layout replaces the generated showroom
+	if (!sceneLoadPath.empty()) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		const char* path = sceneLoadPath.c_str();
+
+		if (UIsJSONScene(sceneLoadPath) ? ULoadSceneJSON(path) : ULoadScene(path))
+			cout<<"Loaded "<<sceneLoadPath<<" in "<<chrono::duration<double>(chrono::steady_clock::now() - start).count() * 1000.0<<" ms"<<endl;
+		else
+			cout<<"Placing the showroom instead"<<endl;
+	}
+
+	if (sceneObjects.empty()) {
+
+		// The original chair
+		sceneObjects.push_back({chairPosition, chairScale, 0, 0, false});
+
+		// Showroom rows extend to the right of and behind the original chair
+		for (GLint row = 0; row < showroomSize; row++) {
+			for (GLint column = 0; column < showroomSize; column++) {
+
+				if (row == 0 && column == 0)
+					continue;
+
+				// Finishes alternate along the rows
+				glm::vec3 offset(column * showroomSpacing, 0.0f, -row * showroomSpacing);
+				GLint material = (row + column) % materials.size();
+				sceneObjects.push_back({chairPosition + offset, chairScale, 0, material, false});
+			}
+		}
+	}
+
+	cout<<"Scene has "<<sceneObjects.size()<<" chairs"<<endl;
+
+	// Objects don't move, their hierarchy is built once
+	UBuildSceneBVH();
+}
+
+
+/* QUADRIC ERROR METRIC
+ * Symmetric 4x4 matrix stored as its upper triangle:
+ * aa ab ac ad bb bc bd cc cd dd
+ */
+struct Quadric {
+	double q[10];
+};
+
+// Builds the quadric of the plane ax + by + cz + d = 0
+static Quadric QuadricFromPlane(double a, double b, double c, double d, double weight)
+{
+	Quadric Q = {{ a * a, a * b, a * c, a * d, b * b, b * c, b * d, c * c, c * d, d * d }};
+	for (int i = 0; i < 10; i++)
+		Q.q[i] *= weight;
+	return Q;
+}
+
+static void AddQuadric(Quadric& target, const Quadric& source)
+{
+	for (int i = 0; i < 10; i++)
+		target.q[i] += source.q[i];
+}
+
+// Squared distance of a point to all planes in the quadric
+static double QuadricError(const Quadric& Q, const glm::vec3& v)
+{
+	const double* q = Q.q;
+	double x = v.x, y = v.y, z = v.z;
+	return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+		 + q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+		 + q[7] * z * z + 2 * q[8] * z
+		 + q[9];
+}
+
+// Finds the position that minimizes the quadric, returns false if the system is singular
+static bool QuadricOptimum(const Quadric& Q, glm::vec3& result)
+{
+	const double* q = Q.q;
+	double det = q[0] * (q[4] * q[7] - q[5] * q[5])
+			   - q[1] * (q[1] * q[7] - q[5] * q[2])
+			   + q[2] * (q[1] * q[5] - q[4] * q[2]);
+
+	if (fabs(det) < 1e-9)
+		return false;
+
+	// Cramer's rule on A v = -b
+	double bx = -q[3], by = -q[6], bz = -q[8];
+	double x = (bx * (q[4] * q[7] - q[5] * q[5]) - q[1] * (by * q[7] - q[5] * bz) + q[2] * (by * q[5] - q[4] * bz)) / det;
+	double y = (q[0] * (by * q[7] - q[5] * bz) - bx * (q[1] * q[7] - q[5] * q[2]) + q[2] * (q[1] * bz - by * q[2])) / det;
+	double z = (q[0] * (q[4] * bz - by * q[5]) - q[1] * (q[1] * bz - by * q[2]) + bx * (q[1] * q[5] - q[4] * q[2])) / det;
+	result = glm::vec3((GLfloat)x, (GLfloat)y, (GLfloat)z);
+	return true;
+}
+
+// Candidate edge collapse, versions detect entries made stale by later collapses
+struct EdgeCollapse {
+	double cost;
+	GLuint keep, remove;
+	GLuint keepVersion, removeVersion;
+	glm::vec3 position;
+
+	bool operator<(const EdgeCollapse& other) const { return cost > other.cost; }
+};
+
+/* Builds the LOD chain of an interleaved position / normal / texture coordinate mesh
+ * Writes LOD 0 (the input) followed by every simplified LOD into lodVertices
+ * and records their ranges in chairLODs.
+ */
+void UBuildLODChain(const GLfloat* vertices, GLsizei vertexCount, vector<GLfloat>& lodVertices)
+{
+	const int stride = 8;
+
+	// LOD 0 is the unmodified mesh
+	lodVertices.assign(vertices, vertices + vertexCount * stride);
+	chairLODs.clear();
+	chairLODs.push_back({0, vertexCount, 0.0f});
+
+	// Weld corners that share a position and texture coordinate so edges connect across faces
+	// Texture seams stay apart, their edges become borders and keep their place below
+	map<tuple<GLfloat, GLfloat, GLfloat, GLfloat, GLfloat>, GLuint> weldMap;
+	vector<glm::vec3> positions;
+	vector<glm::vec2> textureCoordinates;
+	vector<GLuint> triangles;
+
+	for (GLsizei i = 0; i < vertexCount; i++) {
+
+		const GLfloat* v = vertices + i * stride;
+		auto key = make_tuple(v[0], v[1], v[2], v[6], v[7]);
+		auto found = weldMap.find(key);
+
+		if (found == weldMap.end()) {
+			found = weldMap.insert(make_pair(key, (GLuint)positions.size())).first;
+			positions.push_back(glm::vec3(v[0], v[1], v[2]));
+			textureCoordinates.push_back(glm::vec2(v[6], v[7]));
+		}
+		triangles.push_back(found->second);
+	}
+
+	GLuint positionCount = positions.size();
+	GLuint triangleCount = triangles.size() / 3;
+
+	// Drop degenerate input triangles, they carry no surface
+	vector<bool> triangleAlive(triangleCount, true);
+	GLuint liveTriangles = 0;
+	for (GLuint t = 0; t < triangleCount; t++) {
+		GLuint* tri = &triangles[t * 3];
+		glm::vec3 n = glm::cross(positions[tri[1]] - positions[tri[0]], positions[tri[2]] - positions[tri[0]]);
+		if (tri[0] == tri[1] || tri[1] == tri[2] || tri[0] == tri[2] || glm::length(n) < 1e-8f)
+			triangleAlive[t] = false;
+		else
+			liveTriangles++;
+	}
+
+	// Accumulate the plane quadric of every face on its corners
+	vector<Quadric> quadrics(positionCount, Quadric{{0}});
+	vector<vector<GLuint> > vertexTriangles(positionCount);
+	map<pair<GLuint, GLuint>, int> edgeUse;
+
+	for (GLuint t = 0; t < triangleCount; t++) {
+
+		if (!triangleAlive[t])
+			continue;
+
+		GLuint* tri = &triangles[t * 3];
+		glm::vec3 n = glm::normalize(glm::cross(positions[tri[1]] - positions[tri[0]], positions[tri[2]] - positions[tri[0]]));
+		Quadric Q = QuadricFromPlane(n.x, n.y, n.z, -glm::dot(n, positions[tri[0]]), 1.0);
+
+		for (int c = 0; c < 3; c++) {
+			AddQuadric(quadrics[tri[c]], Q);
+			vertexTriangles[tri[c]].push_back(t);
+			GLuint a = tri[c], b = tri[(c + 1) % 3];
+			edgeUse[make_pair(min(a, b), max(a, b))]++;
+		}
+	}
+
+	// Edges used by a single face are borders, penalize moving them off their perpendicular plane
+	const double borderWeight = 10.0;
+	for (GLuint t = 0; t < triangleCount; t++) {
+
+		if (!triangleAlive[t])
+			continue;
+
+		GLuint* tri = &triangles[t * 3];
+		glm::vec3 n = glm::cross(positions[tri[1]] - positions[tri[0]], positions[tri[2]] - positions[tri[0]]);
+
+		for (int c = 0; c < 3; c++) {
+			GLuint a = tri[c], b = tri[(c + 1) % 3];
+			if (edgeUse[make_pair(min(a, b), max(a, b))] != 1)
+				continue;
+
+			glm::vec3 edge = positions[b] - positions[a];
+			glm::vec3 borderNormal = glm::cross(edge, n);
+			if (glm::length(borderNormal) < 1e-8f)
+				continue;
+			borderNormal = glm::normalize(borderNormal);
+
+			Quadric Q = QuadricFromPlane(borderNormal.x, borderNormal.y, borderNormal.z,
+										 -glm::dot(borderNormal, positions[a]), borderWeight);
+			AddQuadric(quadrics[a], Q);
+			AddQuadric(quadrics[b], Q);
+		}
+	}
+
+	vector<bool> vertexAlive(positionCount, true);
+	vector<GLuint> versions(positionCount, 0);
+	priority_queue<EdgeCollapse> heap;
+
+	// Evaluates the collapse of edge (a, b) into its cheapest position
+	auto pushEdge = [&](GLuint a, GLuint b) {
+		Quadric Q = quadrics[a];
+		AddQuadric(Q, quadrics[b]);
+
+		glm::vec3 candidates[4] = { positions[a], positions[b], (positions[a] + positions[b]) * 0.5f, glm::vec3(0.0f) };
+		int candidateCount = QuadricOptimum(Q, candidates[3]) ? 4 : 3;
+
+		EdgeCollapse collapse = { 0.0, a, b, versions[a], versions[b], candidates[0] };
+		collapse.cost = QuadricError(Q, candidates[0]);
+		for (int c = 1; c < candidateCount; c++) {
+			double cost = QuadricError(Q, candidates[c]);
+			if (cost < collapse.cost) {
+				collapse.cost = cost;
+				collapse.position = candidates[c];
+			}
+		}
+		collapse.cost = max(collapse.cost, 0.0);
+		heap.push(collapse);
+	};
+
+	for (auto& edge : edgeUse)
+		pushEdge(edge.first.first, edge.first.second);
+
+	// Rejects collapses that flip or squash a surrounding face
+	auto collapseFlips = [&](GLuint moved, GLuint other, const glm::vec3& position) {
+		for (GLuint t : vertexTriangles[moved]) {
+
+			if (!triangleAlive[t])
+				continue;
+
+			GLuint* tri = &triangles[t * 3];
+			if (tri[0] == other || tri[1] == other || tri[2] == other)
+				continue;
+
+			glm::vec3 corners[3] = { positions[tri[0]], positions[tri[1]], positions[tri[2]] };
+			glm::vec3 before = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+			for (int c = 0; c < 3; c++)
+				if (tri[c] == moved)
+					corners[c] = position;
+			glm::vec3 after = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+
+			if (glm::length(after) < 1e-8f || glm::dot(before, after) <= 0.0f)
+				return true;
+		}
+		return false;
+	};
+
+	double maxCost = 0.0;
+	GLuint targetTriangles = liveTriangles;
+
+	for (GLint level = 1; level < maxChairLODs; level++) {
+
+		GLuint startTriangles = liveTriangles;
+		targetTriangles = max(targetTriangles / 2, (GLuint)4);
+
+		while (liveTriangles > targetTriangles && !heap.empty()) {
+
+			EdgeCollapse collapse = heap.top();
+			heap.pop();
+
+			GLuint keep = collapse.keep, remove = collapse.remove;
+			if (!vertexAlive[keep] || !vertexAlive[remove] ||
+				versions[keep] != collapse.keepVersion || versions[remove] != collapse.removeVersion)
+				continue;
+
+			if (collapseFlips(keep, remove, collapse.position) || collapseFlips(remove, keep, collapse.position))
+				continue;
+
+			// Collapse remove into keep
+			maxCost = max(maxCost, collapse.cost);
+			positions[keep] = collapse.position;
+			AddQuadric(quadrics[keep], quadrics[remove]);
+			vertexAlive[remove] = false;
+			versions[keep]++;
+
+			for (GLuint t : vertexTriangles[remove]) {
+
+				if (!triangleAlive[t])
+					continue;
+
+				GLuint* tri = &triangles[t * 3];
+				if (tri[0] == keep || tri[1] == keep || tri[2] == keep) {
+					triangleAlive[t] = false;
+					liveTriangles--;
+				} else {
+					for (int c = 0; c < 3; c++)
+						if (tri[c] == remove)
+							tri[c] = keep;
+					vertexTriangles[keep].push_back(t);
+				}
+			}
+
+			// Re-evaluate every edge around the moved vertex
+			for (GLuint t : vertexTriangles[keep]) {
+				if (!triangleAlive[t])
+					continue;
+				for (int c = 0; c < 3; c++)
+					if (triangles[t * 3 + c] != keep)
+						pushEdge(keep, triangles[t * 3 + c]);
+			}
+		}
+
+		// Stop once simplification no longer pays for another LOD
+		if (liveTriangles * 10 > startTriangles * 9)
+			break;
+
+		// Emit the LOD with flat normals
+		MeshLOD lod = { (GLint)(lodVertices.size() / stride), 0, (GLfloat)sqrt(maxCost) };
+		for (GLuint t = 0; t < triangleCount; t++) {
+
+			if (!triangleAlive[t])
+				continue;
+
+			GLuint* tri = &triangles[t * 3];
+			glm::vec3 n = glm::normalize(glm::cross(positions[tri[1]] - positions[tri[0]], positions[tri[2]] - positions[tri[0]]));
+
+			for (int c = 0; c < 3; c++) {
+				const glm::vec3& p = positions[tri[c]];
+				const glm::vec2& uv = textureCoordinates[tri[c]];
+				GLfloat vertex[stride] = { p.x, p.y, p.z, n.x, n.y, n.z, uv.x, uv.y };
+				lodVertices.insert(lodVertices.end(), vertex, vertex + stride);
+			}
+			lod.vertexCount += 3;
+		}
+		chairLODs.push_back(lod);
+	}
+
+	for (size_t i = 0; i < chairLODs.size(); i++)
+		cout<<"Chair LOD "<<i<<": "<<chairLODs[i].vertexCount / 3<<" triangles, error "<<chairLODs[i].geometricError<<endl;
+}
+
+/* Projects an object space error onto the screen, in pixels */
+GLfloat UProjectedError(GLfloat geometricError, const SceneObject& object, const glm::vec3& eye)
+{
+	GLfloat distance = max(glm::length(object.position - eye), 0.1f);
+	GLfloat objectScale = max(object.scale.x, max(object.scale.y, object.scale.z));
+
+	// Pixels covered by one world unit at distance one
+	GLfloat pixelsPerUnit = windowHeight / (2.0f * fabs(tan(fieldOfView * 0.5f)));
+
+	return geometricError * objectScale * pixelsPerUnit / distance;
+}
+
+/* Picks the coarsest LOD whose projected error stays under lodPixelError
+ * Starts from the LOD used last frame, refines as soon as the threshold is
+ * exceeded but only coarsens once the next LOD is well below it so objects
+ * near the switching distance don't flicker between two LODs.
+ */
+GLint USelectLOD(const SceneObject& object, const glm::vec3& eye)
+{
+	GLint lod = min(object.lod, (GLint)chairLODs.size() - 1);
+
+	while (lod > 0 && UProjectedError(chairLODs[lod].geometricError, object, eye) > lodPixelError)
+		lod--;
+
+	while (lod + 1 < (GLint)chairLODs.size() &&
+		   UProjectedError(chairLODs[lod + 1].geometricError, object, eye) < lodPixelError * lodHysteresis)
+		lod++;
+
+	return lod;
+}
+
+/* Prints the triangle counts of the last frame */
+void UReportFrameStats(void)
+{
+	if (++statsFrameCount % statsReportInterval != 0)
+		return;
+
+	cout<<"Triangles per frame: "<<trianglesSubmitted<<" submitted with LOD "<<(lodEnabled ? "enabled" : "disabled")
+		<<", "<<trianglesFullDetail<<" at full detail, "<<drawCallsSubmitted<<" draw calls, "
+		<<textureBindsSubmitted<<" texture binds with material batching "<<(materialBatching ? "enabled" : "disabled")<<endl;
+
+	if (occlusionEnabled)
+		cout<<"Occlusion: "<<objectsOccluded<<" of "<<sceneObjects.size()<<" chairs occluded by "<<occludersRasterized
+			<<" occluders, "<<occlusionSeconds * 1000.0<<" ms culling"<<endl;
+
+	if (mipStreaming) {
+		cout<<"Finest resident mip level:";
+		for (const MaterialArray& array : materialArrays)
+			cout<<" "<<array.residentLevel<<" of "<<array.levels<<" ("<<array.width<<"x"<<array.height<<")";
+		cout<<endl;
+	}
+
+	if (residencyBudget > 0 || residencyEvictions > 0)
+		cout<<"GPU memory: "<<residentBytes / 1024<<" KB in buffers and textures, "<<residencyHighWater / 1024<<" KB high-water, "
+			<<residencyEvictions<<" evictions, "<<residencyReloads<<" reload stalls"<<endl;
+
+	if (transientBytesUnaliased > 0)
+		cout<<"Transient render targets: "<<transientBytesAliased / 1024<<" KB with aliasing "
+			<<(renderGraphAliasing ? "enabled" : "disabled")<<", "<<transientBytesUnaliased / 1024<<" KB without"<<endl;
+
+	UReportLatency();
+}
+
+/* Builds the cameras and viewports of the four views
+ * Top left: top, top right: the perspective camera,
+ * bottom left: front, bottom right: side
+ */
+void UComputeViews(const glm::mat4& view, const glm::mat4& projection)
+{
+	GLint halfWidth = windowWidth / 2;
+	GLint halfHeight = windowHeight / 2;
+	GLfloat aspect = (GLfloat)halfWidth / (GLfloat)max(halfHeight, 1);
+
+	// The orthographic projection that used to be commented out, widened to the view's aspect
+	glm::mat4 orthographic = glm::ortho(-5.0f * aspect, 5.0f * aspect, -5.0f, 5.0f, 0.1f, 100.0f);
+
+	viewMatrices[0] = glm::lookAt(glm::vec3(0.0f, 10.0f, 0.0f), cameraPosition, glm::vec3(0.0f, 0.0f, -1.0f));
+	viewMatrices[1] = view;
+	viewMatrices[2] = glm::lookAt(glm::vec3(0.0f, 0.0f, 10.0f), cameraPosition, CameraUpY);
+	viewMatrices[3] = glm::lookAt(glm::vec3(10.0f, 0.0f, 0.0f), cameraPosition, CameraUpY);
+
+	projectionMatrices[0] = orthographic;
+	// A quadrant has the window's aspect, the perspective view keeps the window's projection
+	projectionMatrices[1] = projection;
+	projectionMatrices[2] = orthographic;
+	projectionMatrices[3] = orthographic;
+
+	viewRects[0] = { 0, halfHeight, halfWidth, halfHeight };
+	viewRects[1] = { halfWidth, halfHeight, halfWidth, halfHeight };
+	viewRects[2] = { 0, 0, halfWidth, halfHeight };
+	viewRects[3] = { halfWidth, 0, halfWidth, halfHeight };
+
+	// The single pass shaders read the cameras from the uniform buffer
+	if (multiViewSinglePass) {
+		glBindBuffer(GL_UNIFORM_BUFFER, viewUBO);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, maxViews * sizeof(glm::mat4), viewMatrices);
+		glBufferSubData(GL_UNIFORM_BUFFER, maxViews * sizeof(glm::mat4), maxViews * sizeof(glm::mat4), projectionMatrices);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
 	}
 }
 
+/* Draws the chairs and lamps into every view with one submission
+ * Each draw is instanced viewCount times, instance i goes to view i.
+ */
+void UDrawSceneMultiView(void)
+{
 
+	glm::mat4 model(1.0f);
+
+	// One viewport per view index, view rectangles are in window pixels
+	GLfloat targetScale = (GLfloat)renderTargetWidth / windowWidth;
+	for (GLint i = 0; i < viewCount; i++)
+		glViewportIndexedf(i, viewRects[i].x * targetScale, viewRects[i].y * targetScale,
+						   viewRects[i].width * targetScale, viewRects[i].height * targetScale);
+
+	/****** CHAIRS ******/
+	glUseProgram(chairMultiViewShaderProgram);
+	UUseResource(chairMeshResource);
+	glBindVertexArray(chairVAO);
+
+	// Transforms the chair, the lamps are placed relative to it
+	model = glm::translate(model, chairPosition);
+	model = glm::scale(model, chairScale);
+
+	glUniform1i(glGetUniformLocation(chairMultiViewShaderProgram, "viewCount"), viewCount);
+
+	// Same lighting uniforms as the single view chair
+	glUniform1i(glGetUniformLocation(chairMultiViewShaderProgram, "uTexture"), 0);
+	glUniform3f(glGetUniformLocation(chairMultiViewShaderProgram, "keyLightColor"), keyLightColor.r, keyLightColor.g, keyLightColor.b);
+	glUniform3f(glGetUniformLocation(chairMultiViewShaderProgram, "fillLightColor"), fillLightColor.r, fillLightColor.g, fillLightColor.b);
+	glUniform3f(glGetUniformLocation(chairMultiViewShaderProgram, "keyLightPos"), keyLightPosition.x, keyLightPosition.y, keyLightPosition.z);
+	glUniform3f(glGetUniformLocation(chairMultiViewShaderProgram, "fillLightPos"), fillLightPosition.x, fillLightPosition.y, fillLightPosition.z);
+	glUniform3f(glGetUniformLocation(chairMultiViewShaderProgram, "viewPosition"), cameraPosition.x, cameraPosition.y, cameraPosition.z);
+	USetEnvironmentUniforms(chairMultiViewShaderProgram);
+
+	// Every chair repeats its instance attributes for each view
+	UDrawChairs(chairMultiViewShaderProgram, viewCount);
+
+	glBindVertexArray(0);
+
+	/****** KEY LAMP ******/
+	glUseProgram(keyLightMultiViewShaderProgram);
+	UUseResource(lightMeshResource);
+	glBindVertexArray(keyLightVAO);
+
+	// Same placement as the single view key lamp
+	model = glm::translate(model, keyLightPosition);
+	model = glm::scale(model, lightScale);
+
+	glUniformMatrix4fv(glGetUniformLocation(keyLightMultiViewShaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(model));
+	glUniform1i(glGetUniformLocation(keyLightMultiViewShaderProgram, "viewCount"), viewCount);
+	glDrawArraysInstanced(GL_TRIANGLES, 0, 36, viewCount);
+
+	glBindVertexArray(0);
+
+	/****** FILL LAMP ******/
+	glUseProgram(fillLightMultiViewShaderProgram);
+	glBindVertexArray(fillLightVAO);
+
+	// Same placement as the single view fill lamp
+	model = glm::translate(model, keyLightPosition);
+	model = glm::scale(model, lightScale);
+
+	glUniformMatrix4fv(glGetUniformLocation(fillLightMultiViewShaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(model));
+	glUniform1i(glGetUniformLocation(fillLightMultiViewShaderProgram, "viewCount"), viewCount);
+	glDrawArraysInstanced(GL_TRIANGLES, 0, 36, viewCount);
+
+	glBindVertexArray(0);
+
+	drawCallsSubmitted += 2;
+	trianglesSubmitted += viewCount * 2 * 12;
+	trianglesFullDetail += viewCount * 2 * 12;
+}
+
+/* BENCHMARKS */
+
+const int benchmarkFrames = 200;
+
+// Per frame averages of one benchmarked setting
+struct FrameTiming {
+	double submitMilliseconds;			// CPU time spent in UDrawFrame
+	double completeMilliseconds;		// Until the GPU finished the last frame
+	double gpuMilliseconds;				// GPU time from a timer query
+	GLuint64 fragments;					// Samples that passed the depth test
+};
+
+/* Applies toggle, draws benchmarkFrames frames and prints label with the CPU and GPU cost per frame
+ * The line is left open so callers can append their own counters before ending it.
+ */
+static FrameTiming BenchmarkFrames(const char* label, const function<void()>& toggle)
+{
+	FrameTiming timing;
+	GLuint queries[2];
+	glGenQueries(2, queries);
+
+	toggle();
+	glFinish();
+
+	double submitSeconds = 0.0;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	// One query pair spans every frame so reading them back does not stall the loop
+	glBeginQuery(GL_TIME_ELAPSED, queries[0]);
+	glBeginQuery(GL_SAMPLES_PASSED, queries[1]);
+	for (int frame = 0; frame < benchmarkFrames; frame++) {
+		chrono::steady_clock::time_point submitStart = chrono::steady_clock::now();
+		UDrawFrame();
+		submitSeconds += chrono::duration<double>(chrono::steady_clock::now() - submitStart).count();
+	}
+	glEndQuery(GL_SAMPLES_PASSED);
+	glEndQuery(GL_TIME_ELAPSED);
+
+	glFinish();
+	double totalSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	GLuint64 elapsed, samples;
+	glGetQueryObjectui64v(queries[0], GL_QUERY_RESULT, &elapsed);
+	glGetQueryObjectui64v(queries[1], GL_QUERY_RESULT, &samples);
+	glDeleteQueries(2, queries);
+
+	timing.submitMilliseconds = submitSeconds * 1000.0 / benchmarkFrames;
+	timing.completeMilliseconds = totalSeconds * 1000.0 / benchmarkFrames;
+	timing.gpuMilliseconds = elapsed / 1e6 / benchmarkFrames;
+	timing.fragments = samples / benchmarkFrames;
+
+	cout<<label<<timing.submitMilliseconds<<" ms CPU submission, "
+		<<timing.completeMilliseconds<<" ms GPU complete, "
+		<<drawCallsSubmitted<<" draw calls per frame";
+	return timing;
+}
+
+/* Times the four view layout drawn with one pass per view and with one instanced pass
+ * Reports the CPU time spent submitting a frame and the time until the GPU finished it.
+ */
+void UBenchmarkMultiView(void)
+{
+	bool wasEnabled = multiViewEnabled;
+	bool wasSinglePass = multiViewSinglePass;
+
+	multiViewEnabled = true;
+
+	BenchmarkFrames("Four pass multi-view:   ", [] { multiViewSinglePass = false; });
+	cout<<endl;
+
+	if (multiViewSupported) {
+		BenchmarkFrames("Single pass multi-view: ", [] { multiViewSinglePass = true; });
+		cout<<endl;
+	} else
+		cout<<"Single pass multi-view is not supported on this GPU"<<endl;
+
+	multiViewEnabled = wasEnabled;
+	multiViewSinglePass = wasSinglePass;
+}
+
+/* BVH CONSTRUCTION */
+
+static void GrowBounds(AABB& bounds, const AABB& other)
+{
+	bounds.min = glm::min(bounds.min, other.min);
+	bounds.max = glm::max(bounds.max, other.max);
+}
+
+static GLfloat SurfaceArea(const AABB& bounds)
+{
+	glm::vec3 extent = glm::max(bounds.max - bounds.min, glm::vec3(0.0f));
+	return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+static const AABB emptyBounds = { glm::vec3(1e30f), glm::vec3(-1e30f) };
+
+// Splits a node with binned SAH, recurses into both halves, returns the depth of its subtree
+static GLuint SubdivideBVH(const vector<AABB>& bounds, const vector<glm::vec3>& centroids,
+						   vector<BVHNode>& nodes, vector<GLuint>& order, GLuint nodeIndex, GLuint first, GLuint count)
+{
+	const int binCount = 16;
+
+	AABB nodeBounds = emptyBounds, centroidBounds = emptyBounds;
+	for (GLuint i = first; i < first + count; i++) {
+		GrowBounds(nodeBounds, bounds[order[i]]);
+		GrowBounds(centroidBounds, { centroids[order[i]], centroids[order[i]] });
+	}
+
+	nodes[nodeIndex].boundsMin = nodeBounds.min;
+	nodes[nodeIndex].boundsMax = nodeBounds.max;
+	nodes[nodeIndex].leftOrFirst = first;
+	nodes[nodeIndex].count = count;
+
+	if (count <= bvhMaxLeafSize)
+		return 0;
+
+	// Finds the cheapest bin boundary over all three axes
+	int bestAxis = -1, bestSplit = 0;
+	GLfloat bestCost = 1e30f;
+
+	for (int axis = 0; axis < 3; axis++) {
+
+		GLfloat extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+		if (extent <= 0.0f)
+			continue;
+
+		AABB binBounds[binCount];
+		GLuint binCounts[binCount] = {0};
+		for (int b = 0; b < binCount; b++)
+			binBounds[b] = emptyBounds;
+
+		GLfloat binScale = binCount / extent;
+		for (GLuint i = first; i < first + count; i++) {
+			int b = min(binCount - 1, (int)((centroids[order[i]][axis] - centroidBounds.min[axis]) * binScale));
+			binCounts[b]++;
+			GrowBounds(binBounds[b], bounds[order[i]]);
+		}
+
+		// Sweeps from the right to get the cost of every right side
+		GLfloat rightAreas[binCount];
+		GLuint rightCounts[binCount];
+		AABB sweep = emptyBounds;
+		GLuint sweepCount = 0;
+		for (int b = binCount - 1; b > 0; b--) {
+			GrowBounds(sweep, binBounds[b]);
+			sweepCount += binCounts[b];
+			rightAreas[b] = SurfaceArea(sweep);
+			rightCounts[b] = sweepCount;
+		}
+
+		sweep = emptyBounds;
+		sweepCount = 0;
+		for (int b = 0; b < binCount - 1; b++) {
+			GrowBounds(sweep, binBounds[b]);
+			sweepCount += binCounts[b];
+			if (sweepCount == 0 || rightCounts[b + 1] == 0)
+				continue;
+
+			GLfloat cost = SurfaceArea(sweep) * sweepCount + rightAreas[b + 1] * rightCounts[b + 1];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = b + 1;
+			}
+		}
+	}
+
+	// Partitions around the chosen boundary, or down the middle when every centroid coincides
+	GLuint middle;
+	if (bestAxis >= 0) {
+		GLfloat binScale = binCount / (centroidBounds.max[bestAxis] - centroidBounds.min[bestAxis]);
+		GLuint* split = partition(&order[first], &order[first] + count, [&](GLuint primitive) {
+			int b = min(binCount - 1, (int)((centroids[primitive][bestAxis] - centroidBounds.min[bestAxis]) * binScale));
+			return b < bestSplit;
+		});
+		middle = split - &order[0];
+	} else {
+		middle = first + count / 2;
+	}
+
+	GLuint leftIndex = nodes.size();
+	nodes.push_back(BVHNode());
+	nodes.push_back(BVHNode());
+	nodes[nodeIndex].leftOrFirst = leftIndex;
+	nodes[nodeIndex].count = 0;
+
+	GLuint leftDepth = SubdivideBVH(bounds, centroids, nodes, order, leftIndex, first, middle - first);
+	GLuint rightDepth = SubdivideBVH(bounds, centroids, nodes, order, leftIndex + 1, middle, first + count - middle);
+	return 1 + max(leftDepth, rightDepth);
+}
+
+/* Builds a BVH over primitive bounds and returns its depth
+ * Leaves reference order[leftOrFirst .. leftOrFirst + count), order holds primitive indices.
+ */
+GLuint UBuildBVH(const vector<AABB>& bounds, vector<BVHNode>& nodes, vector<GLuint>& order)
+{
+	vector<glm::vec3> centroids(bounds.size());
+	order.resize(bounds.size());
+	for (size_t i = 0; i < bounds.size(); i++) {
+		centroids[i] = (bounds[i].min + bounds[i].max) * 0.5f;
+		order[i] = i;
+	}
+
+	nodes.clear();
+	nodes.reserve(2 * bounds.size() + 1);
+	nodes.push_back(BVHNode());
+
+	if (bounds.empty()) {
+		nodes[0].boundsMin = emptyBounds.min;
+		nodes[0].boundsMax = emptyBounds.max;
+		nodes[0].leftOrFirst = 0;
+		nodes[0].count = 0;
+		return 0;
+	}
+
+	return SubdivideBVH(bounds, centroids, nodes, order, 0, 0, bounds.size());
+}
+
+/* Builds the BVH of a triangle list and packs its leaves for SSE intersection */
+void UBuildMeshBVH(const GLfloat* vertices, GLsizei vertexCount, GLint stride, MeshBVH& bvh)
+{
+	GLuint triangleCount = vertexCount / 3;
+
+	auto corner = [&](GLuint triangle, int c) {
+		const GLfloat* v = vertices + (triangle * 3 + c) * stride;
+		return glm::vec3(v[0], v[1], v[2]);
+	};
+
+	vector<AABB> bounds(triangleCount);
+	for (GLuint t = 0; t < triangleCount; t++) {
+		bounds[t].min = glm::min(corner(t, 0), glm::min(corner(t, 1), corner(t, 2)));
+		bounds[t].max = glm::max(corner(t, 0), glm::max(corner(t, 1), corner(t, 2)));
+	}
+
+	vector<GLuint> order;
+	bvh.depth = UBuildBVH(bounds, bvh.nodes, order);
+
+	// Every leaf becomes one packet of up to four triangles
+	bvh.packets.clear();
+	for (BVHNode& node : bvh.nodes) {
+
+		if (node.count == 0)
+			continue;
+
+		TrianglePacket packet;
+		memset(&packet, 0, sizeof(packet));
+
+		for (GLuint lane = 0; lane < 4; lane++) {
+
+			if (lane >= node.count) {
+				packet.triangle[lane] = ~0u;
+				continue;
+			}
+
+			GLuint t = order[node.leftOrFirst + lane];
+			glm::vec3 v0 = corner(t, 0), e1 = corner(t, 1) - v0, e2 = corner(t, 2) - v0;
+			for (int axis = 0; axis < 3; axis++) {
+				packet.v0[axis][lane] = v0[axis];
+				packet.edge1[axis][lane] = e1[axis];
+				packet.edge2[axis][lane] = e2[axis];
+			}
+			packet.triangle[lane] = t;
+		}
+
+		node.leftOrFirst = bvh.packets.size();
+		bvh.packets.push_back(packet);
+	}
+}
+
+/* Builds the hierarchy over the world bounds of every scene object */
+void UBuildSceneBVH(void)
+{
+	AABB chairBounds = { chairBVH.nodes[0].boundsMin, chairBVH.nodes[0].boundsMax };
+
+	vector<AABB> bounds(sceneObjects.size());
+	for (size_t i = 0; i < sceneObjects.size(); i++) {
+		glm::vec3 a = sceneObjects[i].position + chairBounds.min * sceneObjects[i].scale;
+		glm::vec3 b = sceneObjects[i].position + chairBounds.max * sceneObjects[i].scale;
+		bounds[i].min = glm::min(a, b);
+		bounds[i].max = glm::max(a, b);
+	}
+
+	sceneBVHDepth = UBuildBVH(bounds, sceneBVH, sceneBVHObjects);
+}
+
+
+/* BVH TRAVERSAL */
+
+// Slab test of one node, returns the entry distance or a miss
+static inline bool RayBoxSSE(const BVHNode& node, __m128 origin, __m128 inverseDirection, GLfloat tFar, GLfloat& tEnter)
+{
+	__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.boundsMin.x), origin), inverseDirection);
+	__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.boundsMax.x), origin), inverseDirection);
+	__m128 tNear = _mm_min_ps(t0, t1);
+	__m128 tExit = _mm_max_ps(t0, t1);
+
+	// Largest entry and smallest exit over x, y and z
+	tNear = _mm_max_ss(_mm_max_ss(tNear, _mm_shuffle_ps(tNear, tNear, _MM_SHUFFLE(3, 3, 3, 1))), _mm_movehl_ps(tNear, tNear));
+	tExit = _mm_min_ss(_mm_min_ss(tExit, _mm_shuffle_ps(tExit, tExit, _MM_SHUFFLE(3, 3, 3, 1))), _mm_movehl_ps(tExit, tExit));
+
+	tEnter = _mm_cvtss_f32(tNear);
+	GLfloat exit = _mm_cvtss_f32(tExit);
+	return tEnter <= exit && exit >= 0.0f && tEnter < tFar;
+}
+
+// Moller-Trumbore against four triangles at once, updates hit with the closest one
+static inline bool RayPacketSSE(const TrianglePacket& packet, const glm::vec3& origin, const glm::vec3& direction, RayHit& hit)
+{
+	const __m128 epsilon = _mm_set1_ps(1e-9f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+
+	__m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+	__m128 e1x = _mm_load_ps(packet.edge1[0]), e1y = _mm_load_ps(packet.edge1[1]), e1z = _mm_load_ps(packet.edge1[2]);
+	__m128 e2x = _mm_load_ps(packet.edge2[0]), e2y = _mm_load_ps(packet.edge2[1]), e2z = _mm_load_ps(packet.edge2[2]);
+
+	// p = direction x edge2, det = edge1 . p
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+
+	__m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+	__m128 valid = _mm_cmpgt_ps(absDet, epsilon);
+	__m128 inverseDet = _mm_div_ps(one, _mm_or_ps(_mm_and_ps(valid, det), _mm_andnot_ps(valid, one)));
+
+	// s = origin - v0, u = s . p / det
+	__m128 sx = _mm_sub_ps(_mm_set1_ps(origin.x), _mm_load_ps(packet.v0[0]));
+	__m128 sy = _mm_sub_ps(_mm_set1_ps(origin.y), _mm_load_ps(packet.v0[1]));
+	__m128 sz = _mm_sub_ps(_mm_set1_ps(origin.z), _mm_load_ps(packet.v0[2]));
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inverseDet);
+
+	// q = s x edge1, v = direction . q / det, t = edge2 . q / det
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inverseDet);
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inverseDet);
+
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+	valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+	valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, zero));
+	valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(hit.t)));
+
+	int mask = _mm_movemask_ps(valid);
+	if (mask == 0)
+		return false;
+
+	alignas(16) GLfloat distances[4];
+	_mm_store_ps(distances, t);
+	for (int lane = 0; lane < 4; lane++) {
+		if ((mask & (1 << lane)) && distances[lane] < hit.t) {
+			hit.t = distances[lane];
+			hit.triangle = packet.triangle[lane];
+		}
+	}
+	return true;
+}
+
+// Reciprocal direction with zero components nudged so the slab test stays finite
+static inline __m128 InverseDirection(const glm::vec3& direction)
+{
+	glm::vec3 d = direction;
+	for (int axis = 0; axis < 3; axis++)
+		if (fabs(d[axis]) < 1e-20f)
+			d[axis] = 1e-20f;
+	return _mm_set_ps(0.0f, 1.0f / d.z, 1.0f / d.y, 1.0f / d.x);
+}
+
+/* Finds the closest triangle hit closer than hit.t
+ * The direction doesn't need to be normalized, t is measured in direction lengths.
+ */
+bool UIntersectMeshBVH(const MeshBVH& bvh, const glm::vec3& origin, const glm::vec3& direction, RayHit& hit)
+{
+	__m128 rayOrigin = _mm_set_ps(0.0f, origin.z, origin.y, origin.x);
+	__m128 inverseDirection = InverseDirection(direction);
+
+	// Holds at most one pending sibling per level, only degenerate trees need the heap
+	GLuint localStack[64];
+	vector<GLuint> deepStack;
+	GLuint* stack = localStack;
+	if (bvh.depth >= 64) {
+		deepStack.resize(bvh.depth + 1);
+		stack = deepStack.data();
+	}
+	int stackSize = 0;
+	bool found = false;
+
+	GLfloat tEnter;
+	if (!RayBoxSSE(bvh.nodes[0], rayOrigin, inverseDirection, hit.t, tEnter))
+		return false;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0) {
+
+		const BVHNode& node = bvh.nodes[stack[--stackSize]];
+
+		if (node.count > 0) {
+			found |= RayPacketSSE(bvh.packets[node.leftOrFirst], origin, direction, hit);
+			continue;
+		}
+
+		// Visits the nearer child first so the far one is often culled by the closer hit
+		GLfloat tLeft, tRight;
+		bool hitLeft = RayBoxSSE(bvh.nodes[node.leftOrFirst], rayOrigin, inverseDirection, hit.t, tLeft);
+		bool hitRight = RayBoxSSE(bvh.nodes[node.leftOrFirst + 1], rayOrigin, inverseDirection, hit.t, tRight);
+
+		if (hitLeft && hitRight) {
+			bool leftFirst = tLeft <= tRight;
+			stack[stackSize++] = node.leftOrFirst + (leftFirst ? 1 : 0);
+			stack[stackSize++] = node.leftOrFirst + (leftFirst ? 0 : 1);
+		} else if (hitLeft) {
+			stack[stackSize++] = node.leftOrFirst;
+		} else if (hitRight) {
+			stack[stackSize++] = node.leftOrFirst + 1;
+		}
+	}
+
+	return found;
+}
+
+/* Finds the closest chair hit in the scene, object space rays keep the same t */
+bool UIntersectScene(const glm::vec3& origin, const glm::vec3& direction, RayHit& hit)
+{
+	__m128 rayOrigin = _mm_set_ps(0.0f, origin.z, origin.y, origin.x);
+	__m128 inverseDirection = InverseDirection(direction);
+
+	GLuint localStack[64];
+	vector<GLuint> deepStack;
+	GLuint* stack = localStack;
+	if (sceneBVHDepth >= 64) {
+		deepStack.resize(sceneBVHDepth + 1);
+		stack = deepStack.data();
+	}
+	int stackSize = 0;
+	bool found = false;
+
+	GLfloat tEnter;
+	if (sceneBVH.empty() || !RayBoxSSE(sceneBVH[0], rayOrigin, inverseDirection, hit.t, tEnter))
+		return false;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0) {
+
+		const BVHNode& node = sceneBVH[stack[--stackSize]];
+
+		if (node.count > 0) {
+			for (GLuint i = node.leftOrFirst; i < node.leftOrFirst + node.count; i++) {
+
+				const SceneObject& object = sceneObjects[sceneBVHObjects[i]];
+				glm::vec3 objectOrigin = (origin - object.position) / object.scale;
+				glm::vec3 objectDirection = direction / object.scale;
+
+				if (UIntersectMeshBVH(chairBVH, objectOrigin, objectDirection, hit)) {
+					hit.object = sceneBVHObjects[i];
+					found = true;
+				}
+			}
+			continue;
+		}
+
+		GLfloat tLeft, tRight;
+		bool hitLeft = RayBoxSSE(sceneBVH[node.leftOrFirst], rayOrigin, inverseDirection, hit.t, tLeft);
+		bool hitRight = RayBoxSSE(sceneBVH[node.leftOrFirst + 1], rayOrigin, inverseDirection, hit.t, tRight);
+
+		if (hitLeft && hitRight) {
+			bool leftFirst = tLeft <= tRight;
+			stack[stackSize++] = node.leftOrFirst + (leftFirst ? 1 : 0);
+			stack[stackSize++] = node.leftOrFirst + (leftFirst ? 0 : 1);
+		} else if (hitLeft) {
+			stack[stackSize++] = node.leftOrFirst;
+		} else if (hitRight) {
+			stack[stackSize++] = node.leftOrFirst + 1;
+		}
+	}
+
+	return found;
+}
+
+// Reciprocals of four directions with zero components nudged like InverseDirection
+static inline __m128 InversePacketDirection(__m128 direction)
+{
+	const __m128 tiny = _mm_set1_ps(1e-20f);
+	__m128 small = _mm_cmplt_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), direction), tiny);
+	direction = _mm_or_ps(_mm_and_ps(small, tiny), _mm_andnot_ps(small, direction));
+	return _mm_div_ps(_mm_set1_ps(1.0f), direction);
+}
+
+// Slab test of one node against four rays, returns the lanes entering it before their closest hit
+static inline GLint PacketBoxSSE(const BVHNode& node, const RayPacket& rays, __m128 tFar, __m128& tEnter)
+{
+	__m128 tNear = _mm_setzero_ps(), tExit = _mm_set1_ps(1e30f);
+	for (int axis = 0; axis < 3; axis++) {
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps((&node.boundsMin.x)[axis]), rays.origin[axis]), rays.inverseDirection[axis]);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps((&node.boundsMax.x)[axis]), rays.origin[axis]), rays.inverseDirection[axis]);
+		tNear = axis == 0 ? _mm_min_ps(t0, t1) : _mm_max_ps(tNear, _mm_min_ps(t0, t1));
+		tExit = _mm_min_ps(tExit, _mm_max_ps(t0, t1));
+	}
+
+	tEnter = tNear;
+	__m128 inside = _mm_and_ps(_mm_cmple_ps(tNear, tExit), _mm_cmpge_ps(tExit, _mm_setzero_ps()));
+	return _mm_movemask_ps(_mm_and_ps(inside, _mm_cmplt_ps(tNear, tFar)));
+}
+
+// Moller-Trumbore of four rays against each triangle of a leaf, closer lanes take the triangle
+static inline GLint PacketTrianglesSSE(const TrianglePacket& packet, const RayPacket& rays, __m128& t, GLuint triangles[4])
+{
+	const __m128 epsilon = _mm_set1_ps(1e-9f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	GLint hitMask = 0;
+
+	for (int k = 0; k < 4; k++) {
+
+		// Unused triangles have zero edges and fail the determinant test
+		__m128 e1x = _mm_set1_ps(packet.edge1[0][k]), e1y = _mm_set1_ps(packet.edge1[1][k]), e1z = _mm_set1_ps(packet.edge1[2][k]);
+		__m128 e2x = _mm_set1_ps(packet.edge2[0][k]), e2y = _mm_set1_ps(packet.edge2[1][k]), e2z = _mm_set1_ps(packet.edge2[2][k]);
+		const __m128& dx = rays.direction[0];
+		const __m128& dy = rays.direction[1];
+		const __m128& dz = rays.direction[2];
+
+		__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+
+		__m128 valid = _mm_cmpgt_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), det), epsilon);
+		__m128 inverseDet = _mm_div_ps(one, _mm_or_ps(_mm_and_ps(valid, det), _mm_andnot_ps(valid, one)));
+
+		__m128 sx = _mm_sub_ps(rays.origin[0], _mm_set1_ps(packet.v0[0][k]));
+		__m128 sy = _mm_sub_ps(rays.origin[1], _mm_set1_ps(packet.v0[1][k]));
+		__m128 sz = _mm_sub_ps(rays.origin[2], _mm_set1_ps(packet.v0[2][k]));
+		__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inverseDet);
+
+		__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+		__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+		__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+		__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inverseDet);
+		__m128 distance = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inverseDet);
+
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+		valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+		valid = _mm_and_ps(valid, _mm_cmpgt_ps(distance, zero));
+		valid = _mm_and_ps(valid, _mm_cmplt_ps(distance, t));
+
+		GLint mask = _mm_movemask_ps(valid);
+		if (mask == 0)
+			continue;
+
+		t = _mm_or_ps(_mm_and_ps(valid, distance), _mm_andnot_ps(valid, t));
+		for (int lane = 0; lane < 4; lane++)
+			if (mask & (1 << lane))
+				triangles[lane] = packet.triangle[k];
+		hitMask |= mask;
+	}
+
+	return hitMask;
+}
+
+// Traces four rays through a mesh BVH together, a node is visited while any active lane enters it
+static GLint IntersectMeshPacket(const MeshBVH& bvh, const RayPacket& rays, GLint active, __m128& t, GLuint triangles[4])
+{
+	GLuint localStack[64];
+	vector<GLuint> deepStack;
+	GLuint* stack = localStack;
+	if (bvh.depth >= 64) {
+		deepStack.resize(bvh.depth + 1);
+		stack = deepStack.data();
+	}
+	int stackSize = 0;
+	GLint hitMask = 0;
+
+	__m128 tEnter;
+	if ((PacketBoxSSE(bvh.nodes[0], rays, t, tEnter) & active) == 0)
+		return 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0) {
+
+		const BVHNode& node = bvh.nodes[stack[--stackSize]];
+
+		if (node.count > 0) {
+			hitMask |= PacketTrianglesSSE(bvh.packets[node.leftOrFirst], rays, t, triangles) & active;
+			continue;
+		}
+
+		// The child the first active lane enters first is visited first
+		__m128 tLeft, tRight;
+		GLint hitLeft = PacketBoxSSE(bvh.nodes[node.leftOrFirst], rays, t, tLeft) & active;
+		GLint hitRight = PacketBoxSSE(bvh.nodes[node.leftOrFirst + 1], rays, t, tRight) & active;
+
+		if (hitLeft && hitRight) {
+			alignas(16) GLfloat left[4], right[4];
+			_mm_store_ps(left, tLeft);
+			_mm_store_ps(right, tRight);
+			int lane = 0;
+			while (!(active & (1 << lane)))
+				lane++;
+			bool leftFirst = left[lane] <= right[lane];
+			stack[stackSize++] = node.leftOrFirst + (leftFirst ? 1 : 0);
+			stack[stackSize++] = node.leftOrFirst + (leftFirst ? 0 : 1);
+		} else if (hitLeft) {
+			stack[stackSize++] = node.leftOrFirst;
+		} else if (hitRight) {
+			stack[stackSize++] = node.leftOrFirst + 1;
+		}
+	}
+
+	return hitMask;
+}
+
+/* Finds the closest chair hit of each active lane, like UIntersectScene for four rays at once
+ * Lanes that hit nothing keep their hit as it was passed in.
+ */
+void UIntersectScenePacket(const RayPacket& rays, GLint active, RayHit hits[4])
+{
+	__m128 t = _mm_set_ps(hits[3].t, hits[2].t, hits[1].t, hits[0].t);
+
+	GLuint localStack[64];
+	vector<GLuint> deepStack;
+	GLuint* stack = localStack;
+	if (sceneBVHDepth >= 64) {
+		deepStack.resize(sceneBVHDepth + 1);
+		stack = deepStack.data();
+	}
+	int stackSize = 0;
+
+	__m128 tEnter;
+	if (sceneBVH.empty() || (PacketBoxSSE(sceneBVH[0], rays, t, tEnter) & active) == 0)
+		return;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0) {
+
+		const BVHNode& node = sceneBVH[stack[--stackSize]];
+
+		if (node.count > 0) {
+			for (GLuint i = node.leftOrFirst; i < node.leftOrFirst + node.count; i++) {
+
+				// Object space rays keep the same t
+				const SceneObject& object = sceneObjects[sceneBVHObjects[i]];
+				RayPacket objectRays;
+				for (int axis = 0; axis < 3; axis++) {
+					__m128 scale = _mm_set1_ps(object.scale[axis]);
+					objectRays.origin[axis] = _mm_div_ps(_mm_sub_ps(rays.origin[axis], _mm_set1_ps(object.position[axis])), scale);
+					objectRays.direction[axis] = _mm_div_ps(rays.direction[axis], scale);
+					objectRays.inverseDirection[axis] = InversePacketDirection(objectRays.direction[axis]);
+				}
+
+				GLuint triangles[4];
+				GLint mask = IntersectMeshPacket(chairBVH, objectRays, active, t, triangles);
+				for (int lane = 0; lane < 4; lane++) {
+					if (mask & (1 << lane)) {
+						hits[lane].triangle = triangles[lane];
+						hits[lane].object = sceneBVHObjects[i];
+					}
+				}
+			}
+			continue;
+		}
+
+		__m128 tLeft, tRight;
+		GLint hitLeft = PacketBoxSSE(sceneBVH[node.leftOrFirst], rays, t, tLeft) & active;
+		GLint hitRight = PacketBoxSSE(sceneBVH[node.leftOrFirst + 1], rays, t, tRight) & active;
+
+		if (hitLeft && hitRight) {
+			alignas(16) GLfloat left[4], right[4];
+			_mm_store_ps(left, tLeft);
+			_mm_store_ps(right, tRight);
+			int lane = 0;
+			while (!(active & (1 << lane)))
+				lane++;
+			bool leftFirst = left[lane] <= right[lane];
+			stack[stackSize++] = node.leftOrFirst + (leftFirst ? 1 : 0);
+			stack[stackSize++] = node.leftOrFirst + (leftFirst ? 0 : 1);
+		} else if (hitLeft) {
+			stack[stackSize++] = node.leftOrFirst;
+		} else if (hitRight) {
+			stack[stackSize++] = node.leftOrFirst + 1;
+		}
+	}
+
+	alignas(16) GLfloat distances[4];
+	_mm_store_ps(distances, t);
+	for (int lane = 0; lane < 4; lane++)
+		hits[lane].t = distances[lane];
+}
+
+// Unprojects the cursor through the camera of the view it is in and finds the chair it hits
+static bool PickRay(int x, int y, RayHit& hit)
+{
+	glm::mat4 view = lastView;
+	glm::mat4 projection = lastProjection;
+	glm::vec4 viewport(0.0f, 0.0f, windowWidth, windowHeight);
+
+	// GLUT measures y from the top of the window
+	GLfloat windowX = x, windowY = windowHeight - y;
+
+	if (multiViewEnabled) {
+		for (GLint i = 0; i < viewCount; i++) {
+			const ViewRect& rect = viewRects[i];
+			if (windowX >= rect.x && windowX < rect.x + rect.width && windowY >= rect.y && windowY < rect.y + rect.height) {
+				view = viewMatrices[i];
+				projection = projectionMatrices[i];
+				viewport = glm::vec4(rect.x, rect.y, rect.width, rect.height);
+			}
+		}
+	}
+
+	glm::vec3 nearPoint = glm::unProject(glm::vec3(windowX, windowY, 0.0f), view, projection, viewport);
+	glm::vec3 farPoint = glm::unProject(glm::vec3(windowX, windowY, 1.0f), view, projection, viewport);
+
+	hit = { 1.0f, ~0u, -1 };
+	return UIntersectScene(nearPoint, farPoint - nearPoint, hit);
+}
+
+/* Selects the chair part under the mouse */
+void UPickAt(int x, int y)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	RayHit hit;
+	bool found = PickRay(x, y, hit);
+
+	double milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	selectedObject = -1;
+	selectedPart = -1;
+	if (!found) {
+		cout<<"Picked nothing ("<<milliseconds<<" ms)"<<endl;
+		return;
+	}
+
+	selectedObject = hit.object;
+	selectedPart = 0;
+	for (GLint part = 0; part < (GLint)(sizeof(chairPartFirstTriangle) / sizeof(GLuint)); part++)
+		if (hit.triangle >= chairPartFirstTriangle[part])
+			selectedPart = part;
+
+	cout<<"Picked chair "<<selectedObject<<", "<<chairPartNames[selectedPart]<<" ("<<milliseconds<<" ms)"<<endl;
+}
+
+/* Measures picking on a grid of chairs merged into one million triangle mesh,
+ * then whole picks through the scene hierarchy of a showroom
+ * Rays are timed in small batches so the slowest ones show, not only the average.
+ */
+int UBenchmarkPicking(void)
+{
+	const GLint gridSize = 137;
+	const GLfloat spacing = 5.0f;
+	const GLint rayCount = 200000;
+	const GLint batchSize = 32;
+	const GLint pickCount = 10000;
+
+	// Copies of the chair positions, one mesh
+	vector<GLfloat> vertices;
+	vertices.reserve((size_t)gridSize * gridSize * chairVertexCount * 3);
+	for (GLint row = 0; row < gridSize; row++) {
+		for (GLint column = 0; column < gridSize; column++) {
+			for (GLsizei i = 0; i < chairVertexCount; i++) {
+				vertices.push_back(chairVertices[i * 8 + 0] + column * spacing);
+				vertices.push_back(chairVertices[i * 8 + 1]);
+				vertices.push_back(chairVertices[i * 8 + 2] - row * spacing);
+			}
+		}
+	}
+
+	GLuint triangleCount = vertices.size() / 9;
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	MeshBVH bvh;
+	UBuildMeshBVH(vertices.data(), vertices.size() / 3, 3, bvh);
+	double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	cout<<"Picking BVH: "<<triangleCount<<" triangles, "<<bvh.nodes.size()<<" nodes, built in "
+		<<buildSeconds * 1000.0<<" ms"<<endl;
+
+	// Rays from an elevated camera towards random points of the showroom floor
+	GLfloat extent = gridSize * spacing;
+	glm::vec3 eye(extent * 0.5f, 40.0f, 30.0f);
+	srand(1);
+
+	// Targets are drawn up front so only the traversal is timed
+	vector<glm::vec3> targets(rayCount);
+	for (glm::vec3& target : targets)
+		target = glm::vec3(extent * (rand() / (GLfloat)RAND_MAX), -3.0f, -extent * (rand() / (GLfloat)RAND_MAX));
+
+	GLint hits = 0;
+	double seconds = 0.0;
+	vector<double> batchRayMilliseconds;
+
+	for (GLint first = 0; first < rayCount; first += batchSize) {
+
+		GLint count = min(batchSize, rayCount - first);
+		chrono::steady_clock::time_point batchStart = chrono::steady_clock::now();
+
+		for (GLint i = first; i < first + count; i++) {
+			RayHit hit = { 1e30f, ~0u, -1 };
+			hits += UIntersectMeshBVH(bvh, eye, targets[i] - eye, hit);
+		}
+
+		double batchSeconds = chrono::duration<double>(chrono::steady_clock::now() - batchStart).count();
+		seconds += batchSeconds;
+		batchRayMilliseconds.push_back(batchSeconds * 1000.0 / count);
+	}
+
+	sort(batchRayMilliseconds.begin(), batchRayMilliseconds.end());
+
+	cout<<rayCount<<" rays: "<<rayCount / seconds<<" rays per second, "
+		<<seconds * 1000.0 / rayCount<<" ms average, "
+		<<batchRayMilliseconds[batchRayMilliseconds.size() * 99 / 100]<<" ms p99 and "
+		<<batchRayMilliseconds.back()<<" ms slowest per ray over batches of "<<batchSize<<", BVH depth "<<bvh.depth<<", "
+		<<hits<<" hits"<<endl;
+
+	// Whole picks as a click runs them, scene hierarchy and chair hierarchy, from the first frame's camera
+	UBuildMeshBVH(chairVertices, chairVertexCount, 8, chairBVH);
+	showroomSize = max(showroomSize, 100);
+	UCreateScene();
+	front = glm::vec3(10.0f * cos(yaw), 10.0f * sin(pitch), sin(yaw) * cos(pitch) * 10.0f);
+	UComputeCamera(lastView, lastProjection);
+
+	vector<double> pickMilliseconds;
+	GLint picked = 0;
+	for (GLint i = 0; i < pickCount; i++) {
+
+		int x = rand() % windowWidth, y = rand() % windowHeight;
+		chrono::steady_clock::time_point pickStart = chrono::steady_clock::now();
+		RayHit hit;
+		picked += PickRay(x, y, hit);
+		pickMilliseconds.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - pickStart).count());
+	}
+
+	sort(pickMilliseconds.begin(), pickMilliseconds.end());
+	double pickTotal = 0.0;
+	for (double milliseconds : pickMilliseconds)
+		pickTotal += milliseconds;
+
+	cout<<pickCount<<" picks of "<<sceneObjects.size()<<" chairs: "<<pickTotal / pickCount<<" ms average, "
+		<<pickMilliseconds[pickMilliseconds.size() * 99 / 100]<<" ms p99, "<<pickMilliseconds.back()<<" ms slowest, "
+		<<"scene BVH depth "<<sceneBVHDepth<<", "<<picked<<" hits"<<endl;
+
+	return 0;
+}
+
+/* INPUT RECORDING */
+
+/* Opens a recording, events are appended until the program exits */
+void UStartRecording(const char* path)
+{
+	recordFile = fopen(path, "wb");
+	if (!recordFile) {
+		cerr<<"Cannot open "<<path<<" for recording"<<endl;
+		exit(EXIT_FAILURE);
+	}
+
+	InputRecordHeader header = { {'C', 'H', 'R', 'I'}, inputRecordVersion, windowWidth, windowHeight };
+	fwrite(&header, sizeof(header), 1, recordFile);
+
+	recordStart = chrono::steady_clock::now();
+	atexit(UStopRecording);
+	cout<<"Recording input to "<<path<<endl;
+}
+
+void UStopRecording(void)
+{
+	if (recordFile) {
+		fclose(recordFile);
+		recordFile = NULL;
+	}
+}
+
+/* Appends an event and the camera state it left behind */
+void URecordInput(InputEventType type, int x, int y, int button, int state)
+{
+	// Every input handler ends here, the event waits for a frame to latch it
+	UTimestampInput();
+
+	if (!recordFile)
+		return;
+
+	InputRecord record;
+	record.time = chrono::duration<GLfloat>(chrono::steady_clock::now() - recordStart).count();
+	record.type = type;
+	record.button = button;
+	record.state = state;
+	record.modifiers = keymod;
+	record.x = x;
+	record.y = y;
+	record.yaw = yaw;
+	record.pitch = pitch;
+	record.front[0] = front.x;
+	record.front[1] = front.y;
+	record.front[2] = front.z;
+	record.scale[0] = scale_by_x;
+	record.scale[1] = scale_by_y;
+	record.scale[2] = scale_by_z;
+
+	fwrite(&record, sizeof(record), 1, recordFile);
+}
+
+
+/* INPUT REPLAY */
+
+/* Reads a whole recording and sizes the window like the recorded one */
+bool ULoadReplay(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file) {
+		cerr<<"Cannot open recording "<<path<<endl;
+		return false;
+	}
+
+	InputRecordHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "CHRI", 4) != 0 ||
+		header.version != inputRecordVersion) {
+		cerr<<path<<" is not a version "<<inputRecordVersion<<" input recording"<<endl;
+		fclose(file);
+		return false;
+	}
+
+	InputRecord record;
+	replayRecords.clear();
+	while (fread(&record, sizeof(record), 1, file) == 1)
+		replayRecords.push_back(record);
+	fclose(file);
+
+	windowWidth = header.windowWidth;
+	windowHeight = header.windowHeight;
+	replayActive = true;
+	return true;
+}
+
+/* Applies every event up to the time of the next frame */
+void UAdvanceReplay(void)
+{
+	GLfloat replayTime = replayFrame * replayTimestep;
+
+	while (replayNextRecord < replayRecords.size() && replayRecords[replayNextRecord].time <= replayTime) {
+
+		const InputRecord& record = replayRecords[replayNextRecord++];
+
+		yaw = record.yaw;
+		pitch = record.pitch;
+		front = glm::vec3(record.front[0], record.front[1], record.front[2]);
+		scale_by_x = record.scale[0];
+		scale_by_y = record.scale[1];
+		scale_by_z = record.scale[2];
+
+		// Key toggles change what gets drawn, so they are replayed too
+		if (record.type == InputKey) {
+			replayDispatching = true;
+			UKeyboard(record.button, record.x, record.y);
+			replayDispatching = false;
+		}
+	}
+}
+
+/* Times the frame just drawn, waits for the GPU so GPU cost is included */
+void UFinishReplayFrame(chrono::steady_clock::time_point frameStart, chrono::steady_clock::time_point submitEnd)
+{
+	glFinish();
+	chrono::steady_clock::time_point frameEnd = chrono::steady_clock::now();
+
+	replayCpuTimes.push_back(chrono::duration<GLfloat, milli>(submitEnd - frameStart).count());
+	replayFrameTimes.push_back(chrono::duration<GLfloat, milli>(frameEnd - frameStart).count());
+	replayFrame++;
+
+	// One more frame after the last event shows its final camera
+	if (replayNextRecord >= replayRecords.size() &&
+		(replayRecords.empty() || replayFrame * replayTimestep > replayRecords.back().time + replayTimestep))
+		UFinishReplay();
+}
+
+/* Writes the per frame timings, prints percentiles and leaves the main loop */
+void UFinishReplay(void)
+{
+	FILE* file = fopen(replayTimingsPath.c_str(), "w");
+	if (file) {
+		fprintf(file, "frame,time,cpu_ms,frame_ms\n");
+		for (size_t i = 0; i < replayFrameTimes.size(); i++)
+			fprintf(file, "%zu,%.4f,%.4f,%.4f\n", i, i * replayTimestep, replayCpuTimes[i], replayFrameTimes[i]);
+		fclose(file);
+	}
+
+	vector<GLfloat> sorted = replayFrameTimes;
+	sort(sorted.begin(), sorted.end());
+	auto percentile = [&](GLfloat p) { return sorted[min(sorted.size() - 1, (size_t)(p * sorted.size()))]; };
+
+	GLfloat total = 0.0f;
+	for (GLfloat time : sorted)
+		total += time;
+
+	cout<<"Replay: "<<sorted.size()<<" frames, mean "<<total / sorted.size()<<" ms, median "<<percentile(0.5f)
+		<<" ms, 95th "<<percentile(0.95f)<<" ms, 99th "<<percentile(0.99f)<<" ms, max "<<sorted.back()
+		<<" ms, timings in "<<replayTimingsPath<<endl;
+
+	if (replayPerfBudget > 0.0f && percentile(0.95f) > replayPerfBudget) {
+		cout<<"95th percentile frame time is over the "<<replayPerfBudget<<" ms budget"<<endl;
+		replayExitStatus = EXIT_FAILURE;
+	}
+
+	// main tears down the GL objects and the recording after the loop returns
+	replayActive = false;
+	glutLeaveMainLoop();
+}
+
+/* RENDER GRAPH */
+
+static size_t TextureBytes(const RenderTextureDesc& desc)
+{
+	size_t bytesPerPixel = 4;
+	if (desc.internalFormat == GL_RGBA16F)
+		bytesPerPixel = 8;
+	else if (desc.internalFormat == GL_R8)
+		bytesPerPixel = 1;
+	return (size_t)desc.width * desc.height * bytesPerPixel;
+}
+
+static bool SameDesc(const RenderTextureDesc& a, const RenderTextureDesc& b)
+{
+	return a.width == b.width && a.height == b.height && a.internalFormat == b.internalFormat;
+}
+
+/* Starts declaring a new frame */
+void URenderGraphReset(void)
+{
+	graphResources.clear();
+	graphPasses.clear();
+	graphOrder.clear();
+}
+
+/* Declares a resource owned outside the graph, writing it keeps a pass alive */
+GLint URenderGraphImport(const char* name)
+{
+	graphResources.push_back({ name, { windowWidth, windowHeight, GL_RGBA8 }, true, -1, -1, -1 });
+	return graphResources.size() - 1;
+}
+
+/* Declares a transient texture, it only gets memory if a live pass uses it */
+GLint URenderGraphCreateTexture(const char* name, RenderTextureDesc desc)
+{
+	graphResources.push_back({ name, desc, false, -1, -1, -1 });
+	return graphResources.size() - 1;
+}
+
+/* Declares a pass, passes must be declared after the passes producing what they read */
+GLint URenderGraphAddPass(const char* name, vector<GLint> reads, vector<GLint> writes, function<void()> execute)
+{
+	RenderPass pass;
+	pass.name = name;
+	pass.reads = reads;
+	pass.writes = writes;
+	pass.execute = execute;
+	pass.alive = false;
+	graphPasses.push_back(pass);
+	return graphPasses.size() - 1;
+}
+
+/* Culls, orders and allocates the declared graph */
+void URenderGraphCompile(void)
+{
+	GLint passCount = graphPasses.size();
+
+	// Dependencies: read after write, write after write and write after read
+	vector<GLint> lastWriter(graphResources.size(), -1);
+	vector<vector<GLint> > readersSinceWrite(graphResources.size());
+
+	for (GLint p = 0; p < passCount; p++) {
+
+		RenderPass& pass = graphPasses[p];
+
+		for (GLint resource : pass.reads) {
+			if (lastWriter[resource] >= 0) {
+				pass.dependencies.push_back(lastWriter[resource]);
+				pass.producers.push_back(lastWriter[resource]);
+			}
+			readersSinceWrite[resource].push_back(p);
+		}
+
+		for (GLint resource : pass.writes) {
+			if (lastWriter[resource] >= 0)
+				pass.dependencies.push_back(lastWriter[resource]);
+			for (GLint reader : readersSinceWrite[resource])
+				if (reader != p)
+					pass.dependencies.push_back(reader);
+			lastWriter[resource] = p;
+			readersSinceWrite[resource].clear();
+		}
+	}
+
+	// Culling: passes writing imported resources are roots, they keep their producers alive
+	for (GLint p = passCount - 1; p >= 0; p--) {
+
+		RenderPass& pass = graphPasses[p];
+		for (GLint resource : pass.writes)
+			if (graphResources[resource].imported)
+				pass.alive = true;
+
+		if (pass.alive)
+			for (GLint producer : pass.producers)
+				graphPasses[producer].alive = true;
+	}
+
+	// Ordering: Kahn's algorithm over the live passes, ties keep declaration order
+	vector<GLint> pending(passCount, 0);
+	for (GLint p = 0; p < passCount; p++)
+		if (graphPasses[p].alive)
+			for (GLint dependency : graphPasses[p].dependencies)
+				if (graphPasses[dependency].alive)
+					pending[p]++;
+
+	vector<bool> scheduled(passCount, false);
+	graphOrder.clear();
+	for (bool progress = true; progress; ) {
+		progress = false;
+		for (GLint p = 0; p < passCount; p++) {
+
+			if (!graphPasses[p].alive || scheduled[p] || pending[p] > 0)
+				continue;
+
+			scheduled[p] = true;
+			graphOrder.push_back(p);
+			progress = true;
+
+			for (GLint q = 0; q < passCount; q++)
+				if (graphPasses[q].alive && !scheduled[q])
+					for (GLint dependency : graphPasses[q].dependencies)
+						if (dependency == p)
+							pending[q]--;
+			break;
+		}
+	}
+
+	// Lifetimes in execution order
+	for (GLint i = 0; i < (GLint)graphOrder.size(); i++) {
+
+		const RenderPass& pass = graphPasses[graphOrder[i]];
+		for (const vector<GLint>* list : { &pass.reads, &pass.writes }) {
+			for (GLint resource : *list) {
+				RenderResource& r = graphResources[resource];
+				if (r.firstUse < 0)
+					r.firstUse = i;
+				r.lastUse = max(r.lastUse, i);
+			}
+		}
+	}
+
+	// Aliasing: a pooled texture is reused once the resource holding it is dead
+	for (PhysicalTexture& physical : physicalTextures)
+		physical.busyUntil = -1;
+
+	transientBytesAliased = 0;
+	transientBytesUnaliased = 0;
+
+	for (GLint i = 0; i < (GLint)graphOrder.size(); i++) {
+		for (size_t resource = 0; resource < graphResources.size(); resource++) {
+
+			RenderResource& r = graphResources[resource];
+			if (r.imported || r.firstUse != i)
+				continue;
+
+			transientBytesUnaliased += TextureBytes(r.desc);
+
+			for (size_t p = 0; p < physicalTextures.size() && r.physical < 0; p++) {
+				PhysicalTexture& physical = physicalTextures[p];
+				bool free = renderGraphAliasing ? physical.busyUntil < i : physical.busyUntil < 0;
+				if (free && SameDesc(physical.desc, r.desc)) {
+					if (physical.busyUntil < 0)
+						transientBytesAliased += TextureBytes(r.desc);
+					r.physical = p;
+				}
+			}
+
+			if (r.physical < 0) {
+
+				PhysicalTexture physical = { r.desc, 0, -1, renderGraphFrame };
+				bool depth = r.desc.internalFormat == GL_DEPTH_COMPONENT24;
+
+				glGenTextures(1, &physical.texture);
+				glBindTexture(GL_TEXTURE_2D, physical.texture);
+				glTexImage2D(GL_TEXTURE_2D, 0, r.desc.internalFormat, r.desc.width, r.desc.height, 0,
+							 depth ? GL_DEPTH_COMPONENT : GL_RGBA, depth ? GL_UNSIGNED_INT : GL_UNSIGNED_BYTE, NULL);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+				glBindTexture(GL_TEXTURE_2D, 0);
+
+				transientBytesAliased += TextureBytes(r.desc);
+				r.physical = physicalTextures.size();
+				physicalTextures.push_back(physical);
+			}
+
+			physicalTextures[r.physical].busyUntil = r.lastUse;
+			physicalTextures[r.physical].lastUsedFrame = renderGraphFrame;
+		}
+	}
+
+	// Frees pooled textures nothing used for a while, like targets of an old window size
+	for (size_t p = 0; p < physicalTextures.size(); ) {
+		if (renderGraphFrame - physicalTextures[p].lastUsedFrame > 60) {
+			glDeleteTextures(1, &physicalTextures[p].texture);
+			physicalTextures.erase(physicalTextures.begin() + p);
+			for (RenderResource& r : graphResources)
+				if (r.physical > (GLint)p)
+					r.physical--;
+		} else {
+			p++;
+		}
+	}
+
+	renderGraphFrame++;
+}
+
+/* GL texture behind a transient resource of the compiled graph */
+GLuint URenderGraphTexture(GLint resource)
+{
+	return physicalTextures[graphResources[resource].physical].texture;
+}
+
+/* Runs the live passes, offscreen passes get their written textures attached */
+void URenderGraphExecute(void)
+{
+	for (GLint p : graphOrder) {
+
+		const RenderPass& pass = graphPasses[p];
+
+		bool offscreen = false;
+		for (GLint resource : pass.writes)
+			offscreen |= !graphResources[resource].imported;
+
+		if (offscreen) {
+			glBindFramebuffer(GL_FRAMEBUFFER, renderGraphFBO);
+			GLuint color = 0, depth = 0;
+			for (GLint resource : pass.writes) {
+				if (graphResources[resource].desc.internalFormat == GL_DEPTH_COMPONENT24)
+					depth = URenderGraphTexture(resource);
+				else
+					color = URenderGraphTexture(resource);
+			}
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+		} else {
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		}
+
+		pass.execute();
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+/* Prints the compiled graph */
+void URenderGraphDump(void)
+{
+	cout<<"Render graph, "<<graphPasses.size()<<" passes declared, "<<graphOrder.size()<<" live"<<endl;
+
+	for (size_t p = 0; p < graphPasses.size(); p++) {
+
+		const RenderPass& pass = graphPasses[p];
+		GLint position = find(graphOrder.begin(), graphOrder.end(), (GLint)p) - graphOrder.begin();
+
+		if (pass.alive)
+			cout<<"  ["<<position<<"] "<<pass.name;
+		else
+			cout<<"  [culled] "<<pass.name;
+
+		cout<<"  reads:";
+		for (GLint resource : pass.reads)
+			cout<<" "<<graphResources[resource].name;
+		cout<<"  writes:";
+		for (GLint resource : pass.writes)
+			cout<<" "<<graphResources[resource].name;
+		cout<<endl;
+	}
+
+	for (const RenderResource& r : graphResources) {
+
+		cout<<"  "<<r.name;
+		if (r.imported)
+			cout<<" (imported)";
+		else if (r.physical < 0)
+			cout<<" (unused)";
+		else
+			cout<<" "<<r.desc.width<<"x"<<r.desc.height<<", passes "<<r.firstUse<<"-"<<r.lastUse
+				<<", physical texture "<<r.physical<<", "<<TextureBytes(r.desc) / 1024<<" KB";
+		cout<<endl;
+	}
+
+	cout<<"  Transient memory: "<<transientBytesAliased / 1024<<" KB with aliasing "
+		<<(renderGraphAliasing ? "enabled" : "disabled")<<", "<<transientBytesUnaliased / 1024<<" KB without"<<endl;
+}
+
+/* Declares, compiles and runs this frame's passes
+ * At full resolution without debug views the scene draws straight into the back buffer.
+ */
+void UBuildFrameGraph(void)
+{
+	URenderGraphReset();
+
+	GLint backbuffer = URenderGraphImport("Backbuffer");
+	bool offscreen = renderScale != 1.0f || showDepthBuffer;
+
+	renderTargetWidth = offscreen ? max(1, (GLint)(windowWidth * renderScale)) : windowWidth;
+	renderTargetHeight = offscreen ? max(1, (GLint)(windowHeight * renderScale)) : windowHeight;
+
+	if (!offscreen) {
+
+		URenderGraphAddPass("Scene", {}, { backbuffer }, UDrawFrame);
+
+	} else {
+
+		RenderTextureDesc colorDesc = { renderTargetWidth, renderTargetHeight, GL_RGBA8 };
+		RenderTextureDesc depthDesc = { renderTargetWidth, renderTargetHeight, GL_DEPTH_COMPONENT24 };
+
+		GLint sceneColor = URenderGraphCreateTexture("SceneColor", colorDesc);
+		GLint sceneDepth = URenderGraphCreateTexture("SceneDepth", depthDesc);
+		GLint depthView = URenderGraphCreateTexture("DepthView", colorDesc);
+
+		URenderGraphAddPass("Scene", {}, { sceneColor, sceneDepth }, UDrawFrame);
+
+		// Culled unless the depth view is shown
+		URenderGraphAddPass("DepthVisualize", { sceneDepth }, { depthView }, [=]() {
+			glViewport(0, 0, renderTargetWidth, renderTargetHeight);
+			glDisable(GL_DEPTH_TEST);
+			glUseProgram(depthViewShaderProgram);
+			glUniform1i(glGetUniformLocation(depthViewShaderProgram, "uDepth"), 0);
+			glUniform1f(glGetUniformLocation(depthViewShaderProgram, "nearPlane"), 0.1f);
+			glUniform1f(glGetUniformLocation(depthViewShaderProgram, "farPlane"), 100.0f);
+			glBindTexture(GL_TEXTURE_2D, URenderGraphTexture(sceneDepth));
+			glBindVertexArray(fullscreenVAO);
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+			glBindVertexArray(0);
+			glEnable(GL_DEPTH_TEST);
+		});
+
+		// Scales the shown image to the window
+		GLint shown = showDepthBuffer ? depthView : sceneColor;
+		URenderGraphAddPass("Present", { shown }, { backbuffer }, [=]() {
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, renderGraphFBO);
+			glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, URenderGraphTexture(shown), 0);
+			glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, 0, 0);
+			glBlitFramebuffer(0, 0, renderTargetWidth, renderTargetHeight, 0, 0, windowWidth, windowHeight,
+							  GL_COLOR_BUFFER_BIT, GL_LINEAR);
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		});
+	}
+
+	URenderGraphCompile();
+
+	if (renderGraphDumpRequested) {
+		URenderGraphDump();
+		renderGraphDumpRequested = false;
+	}
+
+	URenderGraphExecute();
+}
+
+/* PATH TRACER */
+
+// Hash based random numbers, every pixel and sample gets its own sequence
+static inline GLuint HashRandom(GLuint x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+static inline GLfloat NextRandom(GLuint& rng)
+{
+	rng = rng * 747796405U + 2891336453U;
+	return (HashRandom(rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+// Any two axes perpendicular to n
+static void OrthonormalBasis(const glm::vec3& n, glm::vec3& tangent, glm::vec3& bitangent)
+{
+	glm::vec3 helper = fabs(n.x) > 0.9f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+	tangent = glm::normalize(glm::cross(helper, n));
+	bitangent = glm::cross(n, tangent);
+}
+
+// Nearest texel of the wood texture, uv as stored in the chair vertices
+static glm::vec3 WoodAlbedo(GLfloat u, GLfloat v)
+{
+	if (woodTexels.empty())
+		return glm::vec3(0.55f, 0.4f, 0.25f);
+
+	// The shader flips v and GL's first texture row is the image's top row
+	u -= floor(u);
+	v -= floor(v);
+	GLint x = min(woodWidth - 1, (GLint)(u * woodWidth));
+	GLint y = min(woodHeight - 1, (GLint)((1.0f - v) * woodHeight));
+	const GLubyte* texel = &woodTexels[(y * woodWidth + x) * 3];
+
+	// sRGB texels to linear reflectance
+	return glm::vec3(pow(texel[0] / 255.0f, 2.2f), pow(texel[1] / 255.0f, 2.2f), pow(texel[2] / 255.0f, 2.2f));
+}
+
+// Distance to a sphere along a normalized ray, or a negative value on a miss
+static GLfloat IntersectSphere(const glm::vec3& origin, const glm::vec3& direction, const glm::vec3& center, GLfloat radius)
+{
+	glm::vec3 offset = origin - center;
+	GLfloat b = glm::dot(offset, direction);
+	GLfloat c = glm::dot(offset, offset) - radius * radius;
+	GLfloat discriminant = b * b - c;
+	if (discriminant < 0.0f)
+		return -1.0f;
+	GLfloat root = sqrt(discriminant);
+	return -b - root > 1e-4f ? -b - root : -b + root;
+}
+
+// Face normal and albedo of a chair at a hit point in world space
+static void ChairSurface(const RayHit& hit, const glm::vec3& position, glm::vec3& normal, glm::vec3& albedo)
+{
+	const SceneObject& object = sceneObjects[hit.object];
+	const GLfloat* v = chairVertices + hit.triangle * 3 * 8;
+	glm::vec3 a(v[0], v[1], v[2]), b(v[8], v[9], v[10]), c(v[16], v[17], v[18]);
+
+	// Barycentric coordinates of the hit in object space
+	glm::vec3 local = (position - object.position) / object.scale;
+	glm::vec3 faceNormal = glm::cross(b - a, c - a);
+	GLfloat area = glm::dot(faceNormal, faceNormal);
+	GLfloat wb = glm::dot(glm::cross(local - a, c - a), faceNormal) / area;
+	GLfloat wc = glm::dot(glm::cross(b - a, local - a), faceNormal) / area;
+	GLfloat wa = 1.0f - wb - wc;
+
+	normal = glm::normalize(faceNormal / object.scale);
+	// Only the wood texture has a CPU copy, other finishes use their flat color
+	if (object.material == 0) {
+		albedo = WoodAlbedo(wa * v[6] + wb * v[14] + wc * v[22], wa * v[7] + wb * v[15] + wc * v[23]);
+	} else {
+		glm::vec3 color = materials[object.material].fallbackColor;
+		albedo = glm::vec3(pow(color.r, 2.2f), pow(color.g, 2.2f), pow(color.b, 2.2f));
+	}
+}
+
+// True if anything blocks the segment from origin along direction for distance
+static bool Occluded(const glm::vec3& origin, const glm::vec3& direction, GLfloat distance)
+{
+	if (direction.y < 0.0f && (floorHeight - origin.y) / direction.y < distance)
+		return true;
+
+	RayHit hit = { distance, ~0u, -1 };
+	return UIntersectScene(origin, direction, hit);
+}
+
+/* Radiance arriving along a normalized ray
+ * Diffuse surfaces, light sampled at every bounce, cosine weighted bounces.
+ * hit is the ray's closest chair hit, traced by the caller with its neighbours.
+ */
+glm::vec3 UTracePath(glm::vec3 origin, glm::vec3 direction, RayHit hit, GLuint& rng)
+{
+	const glm::vec3 lightPositions[2] = { keyLightPosition, fillLightPosition };
+	const glm::vec3 lightColors[2] = { keyLightColor, fillLightColor };
+	const GLfloat lightRadius = lightScale.x;
+
+	glm::vec3 radiance(0.0f), throughput(1.0f);
+
+	for (GLint depth = 0; depth < pathTraceMaxDepth; depth++) {
+
+		if (depth > 0) {
+			hit = { 1e30f, ~0u, -1 };
+			UIntersectScene(origin, direction, hit);
+		}
+		bool hitChair = hit.object >= 0;
+
+		GLfloat floorT = direction.y < 0.0f ? (floorHeight - origin.y) / direction.y : -1.0f;
+		bool hitFloor = floorT > 1e-4f && floorT < hit.t;
+
+		// Camera rays see the lights, later bounces count them through light sampling only
+		if (depth == 0) {
+			for (int l = 0; l < 2; l++) {
+				GLfloat t = IntersectSphere(origin, direction, lightPositions[l], lightRadius);
+				if (t > 0.0f && t < (hitFloor ? floorT : hit.t))
+					return lightColors[l] * lightRadiance;
+			}
+		}
+
+		if (!hitChair && !hitFloor) {
+			// The viewport is cleared to black, only bounced light picks up the environment
+			if (depth > 0)
+				radiance += throughput * environmentRadiance;
+			break;
+		}
+
+		glm::vec3 position, normal, albedo;
+
+		if (hitFloor) {
+			position = origin + direction * floorT;
+			normal = glm::vec3(0.0f, 1.0f, 0.0f);
+			albedo = floorAlbedo;
+		} else {
+			position = origin + direction * hit.t;
+			ChairSurface(hit, position, normal, albedo);
+		}
+
+		if (glm::dot(normal, direction) > 0.0f)
+			normal = -normal;
+		glm::vec3 offsetOrigin = position + normal * 1e-4f;
+
+		// Direct light, one sample in the cone each light sphere covers
+		for (int l = 0; l < 2; l++) {
+
+			glm::vec3 toLight = lightPositions[l] - position;
+			GLfloat distanceSquared = glm::dot(toLight, toLight);
+			if (distanceSquared <= lightRadius * lightRadius)
+				continue;
+
+			GLfloat cosMax = sqrt(1.0f - lightRadius * lightRadius / distanceSquared);
+			GLfloat cosTheta = 1.0f - NextRandom(rng) * (1.0f - cosMax);
+			GLfloat sinTheta = sqrt(max(0.0f, 1.0f - cosTheta * cosTheta));
+			GLfloat phi = 2.0f * 3.14159265f * NextRandom(rng);
+
+			glm::vec3 axis = toLight / sqrt(distanceSquared), tangent, bitangent;
+			OrthonormalBasis(axis, tangent, bitangent);
+			glm::vec3 lightDirection = tangent * (cos(phi) * sinTheta) + bitangent * (sin(phi) * sinTheta) + axis * cosTheta;
+
+			GLfloat cosSurface = glm::dot(normal, lightDirection);
+			if (cosSurface <= 0.0f)
+				continue;
+
+			GLfloat lightDistance = IntersectSphere(offsetOrigin, lightDirection, lightPositions[l], lightRadius);
+			if (lightDistance <= 0.0f || Occluded(offsetOrigin, lightDirection, lightDistance))
+				continue;
+
+			// Lambert BRDF times radiance over the cone's pdf
+			GLfloat inversePdf = 2.0f * 3.14159265f * (1.0f - cosMax);
+			radiance += throughput * albedo * lightColors[l] * (lightRadiance * cosSurface * inversePdf / 3.14159265f);
+		}
+
+		// Cosine weighted bounce, the cosine and pdf cancel leaving the albedo
+		throughput *= albedo;
+
+		if (depth >= 2) {
+			GLfloat survive = min(0.95f, max(throughput.x, max(throughput.y, throughput.z)));
+			if (NextRandom(rng) >= survive)
+				break;
+			throughput /= survive;
+		}
+
+		GLfloat r = sqrt(NextRandom(rng)), phi = 2.0f * 3.14159265f * NextRandom(rng);
+		glm::vec3 tangent, bitangent;
+		OrthonormalBasis(normal, tangent, bitangent);
+		direction = glm::normalize(tangent * (r * cos(phi)) + bitangent * (r * sin(phi)) + normal * sqrt(max(0.0f, 1.0f - r * r)));
+		origin = offsetOrigin;
+	}
+
+	return radiance;
+}
+
+// Keeps a CPU copy of wood_texture.jpg for the surfaces rays hit
+static void LoadWoodTexels(void)
+{
+	if (!woodTexels.empty())
+		return;
+
+	int channels;
+	unsigned char* image = SOIL_load_image("wood_texture.jpg", &woodWidth, &woodHeight, &channels, SOIL_LOAD_RGB);
+	if (image) {
+		woodTexels.assign(image, image + woodWidth * woodHeight * 3);
+		SOIL_free_image_data(image);
+	} else {
+		cout<<"wood_texture.jpg not found, using a flat wood color"<<endl;
+	}
+}
+
+/* Builds what the path tracer needs without a GL context */
+void UPathTraceSetup(void)
+{
+	UBuildMeshBVH(chairVertices, chairVertexCount, 8, chairBVH);
+	UCreateScene();
+	LoadWoodTexels();
+
+	// Camera of the first interactive frame, before any mouse movement
+	front = glm::vec3(10.0f * cos(yaw), 10.0f * sin(pitch), sin(yaw) * cos(pitch) * 10.0f);
+}
+
+static void PathTraceHelper(PathTracePool* pool, GLint id)
+{
+	unsigned long seen = 0;
+	for (;;) {
+		{
+			unique_lock<mutex> lock(pool->lock);
+			pool->wake.wait(lock, [&] { return pool->stopping || pool->generation != seen; });
+			if (pool->stopping)
+				return;
+			seen = pool->generation;
+		}
+
+		pool->pass(id);
+
+		lock_guard<mutex> guard(pool->lock);
+		if (--pool->running == 0)
+			pool->finished.notify_one();
+	}
+}
+
+// Starts threads - 1 helpers, they wait for passes until the pool is stopped
+static void StartPathTracePool(PathTracePool& pool, GLint threads)
+{
+	pool.generation = 0;
+	pool.running = 0;
+	pool.stopping = false;
+	vector<TileQueue>(threads).swap(pool.queues);
+	for (GLint id = 1; id < threads; id++)
+		pool.helpers.push_back(thread(PathTraceHelper, &pool, id));
+}
+
+static void StopPathTracePool(PathTracePool& pool)
+{
+	{
+		lock_guard<mutex> guard(pool.lock);
+		pool.stopping = true;
+	}
+	pool.wake.notify_all();
+	for (thread& helper : pool.helpers)
+		helper.join();
+	pool.helpers.clear();
+}
+
+// Runs pass on every thread of the pool and returns once all of them are done
+static void RunPathTracePool(PathTracePool& pool, const function<void(GLint)>& pass)
+{
+	{
+		lock_guard<mutex> guard(pool.lock);
+		pool.pass = pass;
+		pool.running = pool.helpers.size();
+		pool.generation++;
+	}
+	pool.wake.notify_all();
+
+	pass(0);
+
+	unique_lock<mutex> lock(pool.lock);
+	pool.finished.wait(lock, [&] { return pool.running == 0; });
+}
+
+/* Adds one sample to every pixel of every tile started before the deadline, returns the seconds it took */
+double UPathTracePass(vector<glm::vec3>& accumulation, vector<GLuint>& sampleCounts, GLint width, GLint height,
+					  GLint sampleIndex, PathTracePool& pool, chrono::steady_clock::time_point deadline,
+					  const glm::mat4& inverseViewProjection, const glm::vec3& eye)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	GLint threads = pool.helpers.size() + 1;
+
+	// Deals the tiles round robin, neighbouring tiles go to different threads
+	vector<TileQueue>& queues = pool.queues;
+	for (TileQueue& queue : queues)
+		queue.tiles.clear();
+	GLint tileIndex = 0;
+	for (GLint y = 0; y < height; y += pathTraceTileSize)
+		for (GLint x = 0; x < width; x += pathTraceTileSize)
+			queues[tileIndex++ % threads].tiles.push_back({ x, y, min(x + pathTraceTileSize, width), min(y + pathTraceTileSize, height) });
+
+	auto worker = [&](GLint id) {
+		for (;;) {
+
+			PathTraceTile tile;
+			bool found = false;
+
+			// Own queue first, then steal from the others
+			for (GLint k = 0; k < threads && !found; k++) {
+				TileQueue& queue = queues[(id + k) % threads];
+				lock_guard<mutex> guard(queue.lock);
+				if (queue.tiles.empty())
+					continue;
+				if (k == 0) {
+					tile = queue.tiles.back();
+					queue.tiles.pop_back();
+				} else {
+					tile = queue.tiles.front();
+					queue.tiles.pop_front();
+				}
+				found = true;
+			}
+
+			// Tiles left when the time limit passes keep one sample less
+			if (!found || chrono::steady_clock::now() >= deadline)
+				return;
+
+			// 2x2 pixel quads, lanes past the tile's edge stay inactive
+			for (GLint y = tile.y0; y < tile.y1; y += 2) {
+				for (GLint x = tile.x0; x < tile.x1; x += 2) {
+
+					GLuint rngs[4];
+					glm::vec3 directions[4];
+					RayHit hits[4];
+					alignas(16) GLfloat components[3][4];
+					GLint active = 0;
+
+					for (int lane = 0; lane < 4; lane++) {
+
+						GLint px = x + (lane & 1), py = y + (lane >> 1);
+						hits[lane] = { 1e30f, ~0u, -1 };
+						directions[lane] = glm::vec3(0.0f, 0.0f, 1.0f);
+
+						if (px < tile.x1 && py < tile.y1) {
+							active |= 1 << lane;
+							rngs[lane] = HashRandom((py * width + px) * 9781U + sampleIndex * 6271U + 1U);
+
+							// Jittered position inside the pixel, unprojected through the raster camera
+							GLfloat ndcX = (px + NextRandom(rngs[lane])) / width * 2.0f - 1.0f;
+							GLfloat ndcY = 1.0f - (py + NextRandom(rngs[lane])) / height * 2.0f;
+							glm::vec4 farPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+							directions[lane] = glm::normalize(glm::vec3(farPoint.x, farPoint.y, farPoint.z) / farPoint.w - eye);
+						}
+
+						for (int axis = 0; axis < 3; axis++)
+							components[axis][lane] = directions[lane][axis];
+					}
+
+					RayPacket rays;
+					for (int axis = 0; axis < 3; axis++) {
+						rays.origin[axis] = _mm_set1_ps(eye[axis]);
+						rays.direction[axis] = _mm_load_ps(components[axis]);
+						rays.inverseDirection[axis] = InversePacketDirection(rays.direction[axis]);
+					}
+					UIntersectScenePacket(rays, active, hits);
+
+					for (int lane = 0; lane < 4; lane++) {
+						if (!(active & (1 << lane)))
+							continue;
+						GLint pixel = (y + (lane >> 1)) * width + x + (lane & 1);
+						accumulation[pixel] += UTracePath(eye, directions[lane], hits[lane], rngs[lane]);
+						sampleCounts[pixel]++;
+					}
+				}
+			}
+		}
+	};
+
+	RunPathTracePool(pool, worker);
+
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/* Writes the averaged samples as a binary PPM, gamma corrected */
+bool UWriteImage(const char* path, const vector<glm::vec3>& accumulation, const vector<GLuint>& sampleCounts, GLint width, GLint height)
+{
+	FILE* file = fopen(path, "wb");
+	if (!file)
+		return false;
+
+	fprintf(file, "P6\n%d %d\n255\n", width, height);
+	vector<GLubyte> row(width * 3);
+	for (GLint y = 0; y < height; y++) {
+		for (GLint x = 0; x < width; x++) {
+			glm::vec3 color = accumulation[y * width + x] / (GLfloat)max(1u, sampleCounts[y * width + x]);
+			for (int c = 0; c < 3; c++)
+				row[x * 3 + c] = (GLubyte)(255.0f * pow(glm::clamp(color[c], 0.0f, 1.0f), 1.0f / 2.2f) + 0.5f);
+		}
+		fwrite(row.data(), 1, row.size(), file);
+	}
+
+	fclose(file);
+	return true;
+}
+
+// Inverse camera of the interactive view at the given image size
+static glm::mat4 PathTraceCamera(GLint width, GLint height)
+{
+	glm::mat4 view = glm::lookAt(front, cameraPosition, CameraUpY);
+	glm::mat4 projection = glm::perspective(fieldOfView, (GLfloat)width / (GLfloat)height, 0.1f, 100.0f);
+	return glm::inverse(projection * view);
+}
+
+/* Renders pathTraceOutput progressively until the sample budget or time limit */
+int UPathTrace(void)
+{
+	UPathTraceSetup();
+
+	GLint threads = pathTraceThreads > 0 ? pathTraceThreads : max(1u, thread::hardware_concurrency());
+	GLint width = windowWidth, height = windowHeight;
+	glm::mat4 inverseViewProjection = PathTraceCamera(width, height);
+
+	vector<glm::vec3> accumulation(width * height, glm::vec3(0.0f));
+	vector<GLuint> sampleCounts(width * height, 0);
+	double seconds = 0.0;
+	GLint samples = 0;
+
+	// Checked before every tile, so the render stops within a tile of the limit
+	chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+	if (pathTraceTimeLimit > 0.0f)
+		deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(pathTraceTimeLimit));
+
+	PathTracePool pool;
+	StartPathTracePool(pool, threads);
+	while (samples < pathTraceSamples && chrono::steady_clock::now() < deadline) {
+		seconds += UPathTracePass(accumulation, sampleCounts, width, height, samples, pool, deadline, inverseViewProjection, front);
+		samples++;
+	}
+	StopPathTracePool(pool);
+
+	if (!UWriteImage(pathTraceOutput.c_str(), accumulation, sampleCounts, width, height)) {
+		cerr<<"Cannot write "<<pathTraceOutput<<endl;
+		return EXIT_FAILURE;
+	}
+
+	double traced = 0.0;
+	for (GLuint count : sampleCounts)
+		traced += count;
+
+	cout<<"Path traced "<<width<<"x"<<height<<" at "<<traced / (width * height)<<" spp in "<<seconds<<" s on "<<threads<<" threads: "
+		<<traced / seconds / threads<<" samples per second per core, written to "<<pathTraceOutput<<endl;
+	return EXIT_SUCCESS;
+}
+
+/* Renders the same small image with 1, 2, 4 ... N threads and reports scaling efficiency */
+int UPathTraceScaling(void)
+{
+	UPathTraceSetup();
+
+	const GLint width = 320, height = 240, samples = 8;
+	GLint maxThreads = pathTraceThreads > 0 ? pathTraceThreads : max(1u, thread::hardware_concurrency());
+	glm::mat4 inverseViewProjection = PathTraceCamera(width, height);
+
+	vector<GLint> counts;
+	for (GLint threads = 1; threads < maxThreads; threads *= 2)
+		counts.push_back(threads);
+	counts.push_back(maxThreads);
+
+	double singleThreadSeconds = 0.0;
+	for (GLint threads : counts) {
+
+		vector<glm::vec3> accumulation(width * height, glm::vec3(0.0f));
+		vector<GLuint> sampleCounts(width * height, 0);
+		double seconds = 0.0;
+
+		PathTracePool pool;
+		StartPathTracePool(pool, threads);
+		for (GLint sample = 0; sample < samples; sample++)
+			seconds += UPathTracePass(accumulation, sampleCounts, width, height, sample, pool,
+									  chrono::steady_clock::time_point::max(), inverseViewProjection, front);
+		StopPathTracePool(pool);
+
+		if (threads == 1)
+			singleThreadSeconds = seconds;
+
+		double samplesPerSecondPerCore = (double)width * height * samples / seconds / threads;
+		cout<<threads<<" threads: "<<seconds<<" s, "<<samplesPerSecondPerCore<<" samples per second per core, "
+			<<100.0 * singleThreadSeconds / (seconds * threads)<<"% scaling efficiency"<<endl;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* MATERIAL BATCHING */
+
+/* Points the instance attributes of the bound chair VAO at chairInstances[firstInstance]
+ * GL 3.3 has no base instance, so every batch moves the pointers instead.
+ * divisor is how many instances reuse one chair's attributes, viewCount for multi-view.
+ */
+void UBindInstanceAttributes(size_t firstInstance, GLuint divisor)
+{
+	GLsizei stride = sizeof(ChairInstance);
+	size_t offset = firstInstance * stride;
+
+	glBindBuffer(GL_ARRAY_BUFFER, chairInstanceVBO);
+
+	// A mat4 attribute takes one location per column
+	for (GLuint column = 0; column < 4; column++) {
+		glVertexAttribPointer(3 + column, 4, GL_FLOAT, GL_FALSE, stride, (GLvoid*)(offset + column * sizeof(glm::vec4)));
+		glVertexAttribDivisor(3 + column, divisor);
+	}
+
+	glVertexAttribPointer(7, 1, GL_FLOAT, GL_FALSE, stride, (GLvoid*)(offset + offsetof(ChairInstance, layer)));
+	glVertexAttribDivisor(7, divisor);
+
+	glVertexAttribPointer(8, 1, GL_FLOAT, GL_FALSE, stride, (GLvoid*)(offset + offsetof(ChairInstance, lightmapLayer)));
+	glVertexAttribDivisor(8, divisor);
+}
+
+/* Draws every chair with the bound chair program and VAO
+ * Batched: chairs are grouped by texture array and LOD, each group is one
+ * instanced draw and each array is bound once.
+ * Unbatched: one draw and one texture bind per chair, the model matrix
+ * and layer are set as constant attributes before each draw.
+ */
+void UDrawChairs(GLuint program, GLint instancesPerObject)
+{
+	// Worker threads record the chairs into command lists, this thread replays them
+	if (commandWorkers > 0) {
+		URecordCommandLists(program, instancesPerObject);
+		UExecuteCommandLists();
+		return;
+	}
+
+	if (!materialBatching) {
+
+		for (GLuint i = 3; i <= 8; i++)
+			glDisableVertexAttribArray(i);
+
+		for (size_t i = 0; i < sceneObjects.size(); i++) {
+
+			const SceneObject& object = sceneObjects[i];
+			const MeshLOD& lod = chairLODs[object.lod];
+			const Material& material = materials[object.material];
+
+			if (object.occluded)
+				continue;
+
+			glm::mat4 objectModel(1.0f);
+			objectModel = glm::translate(objectModel, object.position);
+			objectModel = glm::scale(objectModel, object.scale);
+			for (GLuint column = 0; column < 4; column++)
+				glVertexAttrib4fv(3 + column, glm::value_ptr(objectModel) + column * 4);
+			glVertexAttrib1f(7, (GLfloat)material.layer);
+			glVertexAttrib1f(8, (GLfloat)i);
+
+			glBindTexture(GL_TEXTURE_2D_ARRAY, UUseResource(materialArrays[material.array].resource));
+			glDrawArraysInstanced(GL_TRIANGLES, lod.firstVertex, lod.vertexCount, instancesPerObject);
+
+			textureBindsSubmitted++;
+			drawCallsSubmitted++;
+			trianglesSubmitted += instancesPerObject * (lod.vertexCount / 3);
+			trianglesFullDetail += instancesPerObject * (chairLODs[0].vertexCount / 3);
+		}
+
+		for (GLuint i = 3; i <= 8; i++)
+			glEnableVertexAttribArray(i);
+		return;
+	}
+
+	// Counting sort of the chairs by texture array, then LOD
+	size_t lodCount = chairLODs.size();
+	size_t batchCount = materialArrays.size() * lodCount;
+	batchOffsets.assign(batchCount + 1, 0);
+	for (size_t i = 0; i < sceneObjects.size(); i++)
+		if (!sceneObjects[i].occluded)
+			batchOffsets[materials[sceneObjects[i].material].array * lodCount + sceneObjects[i].lod + 1]++;
+	for (size_t b = 0; b < batchCount; b++)
+		batchOffsets[b + 1] += batchOffsets[b];
+	batchCursors.assign(batchOffsets.begin(), batchOffsets.end() - 1);
+
+	// Instance data in batch order, so every batch is a contiguous range
+	chairInstances.resize(batchOffsets[batchCount]);
+	for (size_t i = 0; i < sceneObjects.size(); i++) {
+
+		const SceneObject& object = sceneObjects[i];
+		if (object.occluded)
+			continue;
+
+		glm::mat4 objectModel(1.0f);
+		objectModel = glm::translate(objectModel, object.position);
+		objectModel = glm::scale(objectModel, object.scale);
+
+		GLuint slot = batchCursors[materials[object.material].array * lodCount + object.lod]++;
+		chairInstances[slot] = { objectModel, (GLfloat)materials[object.material].layer, (GLfloat)i };
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, chairInstanceVBO);
+	glBufferData(GL_ARRAY_BUFFER, chairInstances.size() * sizeof(ChairInstance), chairInstances.data(), GL_STREAM_DRAW);
+	UResizeResource(chairInstanceResource, chairInstances.size() * sizeof(ChairInstance));
+
+	GLint boundArray = -1;
+
+	for (size_t b = 0; b < batchCount; b++) {
+
+		GLuint firstInstance = batchOffsets[b];
+		GLsizei count = batchOffsets[b + 1] - firstInstance;
+		if (count == 0)
+			continue;
+
+		GLint array = b / lodCount;
+		const MeshLOD& lod = chairLODs[b % lodCount];
+
+		if (array != boundArray) {
+			glBindTexture(GL_TEXTURE_2D_ARRAY, UUseResource(materialArrays[array].resource));
+			boundArray = array;
+			textureBindsSubmitted++;
+		}
+
+		UBindInstanceAttributes(firstInstance, instancesPerObject);
+		glDrawArraysInstanced(GL_TRIANGLES, lod.firstVertex, lod.vertexCount, count * instancesPerObject);
+
+		drawCallsSubmitted++;
+		trianglesSubmitted += count * instancesPerObject * (lod.vertexCount / 3);
+		trianglesFullDetail += count * instancesPerObject * (chairLODs[0].vertexCount / 3);
+	}
+
+	// Leaves the VAO pointing at the start of the buffer
+	UBindInstanceAttributes(0, 1);
+}
+
+/* Draws the scene with and without material batching and reports the cost of each */
+void UBenchmarkMaterials(void)
+{
+	bool wasBatching = materialBatching;
+
+	BenchmarkFrames("Per chair materials: ", [] { materialBatching = false; });
+	cout<<", "<<textureBindsSubmitted<<" texture binds per frame"<<endl;
+
+	BenchmarkFrames("Batched materials: ", [] { materialBatching = true; });
+	cout<<", "<<textureBindsSubmitted<<" texture binds per frame"<<endl;
+
+	materialBatching = wasBatching;
+}
+
+/* RESIDENCY MANAGER */
+
+// Bytes held by the render graph's texture pool
+static size_t RenderTargetBytes(void)
+{
+	size_t bytes = 0;
+	for (const PhysicalTexture& physical : physicalTextures)
+		bytes += TextureBytes(physical.desc);
+	return bytes;
+}
+
+static void UpdateHighWater(void)
+{
+	residencyHighWater = max(residencyHighWater, residentBytes + RenderTargetBytes());
+}
+
+/* Tracks a GL object and returns its resource index
+ * With no handle the loader creates it now. Resources without a loader are never evicted.
+ */
+GLint URegisterResource(const char* name, ResourceKind kind, function<size_t(GLuint&)> load, GLuint handle, size_t bytes)
+{
+	if (handle == 0 && load)
+		bytes = load(handle);
+
+	managedResources.push_back({ name, kind, handle, bytes, residencyFrame, load });
+	residentBytes += bytes;
+	UpdateHighWater();
+
+	return managedResources.size() - 1;
+}
+
+/* Marks a resource as drawn this frame and returns its GL name, reloading it if it was evicted */
+GLuint UUseResource(GLint resource)
+{
+	ManagedResource& r = managedResources[resource];
+	r.lastUsedFrame = residencyFrame;
+
+	if (r.handle == 0) {
+
+		// The draw waits for the asset to be read and uploaded again
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		r.bytes = r.load(r.handle);
+		residencyStallSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		residencyReloads++;
+
+		residentBytes += r.bytes;
+		UpdateHighWater();
+		UEnforceBudget();
+	}
+
+	return r.handle;
+}
+
+/* Updates the size of a resource that is reallocated in place, like a streamed buffer */
+void UResizeResource(GLint resource, size_t bytes)
+{
+	residentBytes += bytes - managedResources[resource].bytes;
+	managedResources[resource].bytes = bytes;
+	UpdateHighWater();
+}
+
+/* Evicts the least recently drawn resources until usage fits in the budget */
+void UEnforceBudget(void)
+{
+	if (residencyBudget == 0)
+		return;
+
+	while (residentBytes + RenderTargetBytes() > residencyBudget) {
+
+		// Least recently drawn resource that can be reloaded and wasn't drawn in the last two frames
+		GLint victim = -1;
+		for (size_t i = 0; i < managedResources.size(); i++) {
+			const ManagedResource& r = managedResources[i];
+			if (r.handle == 0 || !r.load || r.lastUsedFrame + 1 >= residencyFrame)
+				continue;
+			if (victim < 0 || r.lastUsedFrame < managedResources[victim].lastUsedFrame)
+				victim = i;
+		}
+
+		if (victim < 0)
+			return;
+
+		ManagedResource& r = managedResources[victim];
+		if (r.kind == ResourceBuffer)
+			glDeleteBuffers(1, &r.handle);
+		else
+			glDeleteTextures(1, &r.handle);
+
+		r.handle = 0;
+		residentBytes -= r.bytes;
+		residencyEvictions++;
+	}
+}
+
+/* Deletes every tracked GL object at exit */
+void UReleaseResources(void)
+{
+	for (ManagedResource& r : managedResources) {
+		if (r.handle == 0)
+			continue;
+		if (r.kind == ResourceBuffer)
+			glDeleteBuffers(1, &r.handle);
+		else
+			glDeleteTextures(1, &r.handle);
+		r.handle = 0;
+	}
+	residentBytes = 0;
+}
+
+/* Prints usage against the budget and the state of every resource */
+void UReportResidency(void)
+{
+	size_t targetBytes = RenderTargetBytes();
+
+	cout<<"GPU memory: "<<(residentBytes + targetBytes) / 1024<<" KB used ("<<targetBytes / 1024<<" KB render targets), budget ";
+	if (residencyBudget > 0)
+		cout<<residencyBudget / 1024<<" KB";
+	else
+		cout<<"unlimited";
+	cout<<", "<<residencyHighWater / 1024<<" KB high-water"<<endl;
+
+	cout<<residencyEvictions<<" evictions, "<<residencyReloads<<" reload stalls totalling "
+		<<residencyStallSeconds * 1000.0<<" ms"<<endl;
+
+	for (const ManagedResource& r : managedResources)
+		cout<<"  "<<r.name<<": "<<r.bytes / 1024<<" KB, "<<(r.handle ? "resident" : "evicted")
+			<<", last drawn "<<residencyFrame - r.lastUsedFrame<<" frames ago"<<endl;
+}
+
+/* MIP STREAMING */
+
+/* Reads the dimensions from a JPEG or PNG header without decoding the image */
+bool UReadImageSize(const char* path, GLint& width, GLint& height)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return false;
+
+	unsigned char header[24];
+	bool found = false;
+
+	if (fread(header, 1, 24, file) == 24) {
+
+		if (memcmp(header, "\x89PNG", 4) == 0) {
+
+			// The IHDR chunk follows the signature
+			width = (header[16] << 24) | (header[17] << 16) | (header[18] << 8) | header[19];
+			height = (header[20] << 24) | (header[21] << 16) | (header[22] << 8) | header[23];
+			found = true;
+
+		} else if (header[0] == 0xFF && header[1] == 0xD8) {
+
+			// Walks the JPEG segments up to the start of frame
+			fseek(file, 2, SEEK_SET);
+			while (!found && fgetc(file) == 0xFF) {
+
+				// Any number of 0xFF fill bytes may come before the marker type
+				int type;
+				do
+					type = fgetc(file);
+				while (type == 0xFF);
+
+				unsigned char lengthBytes[2];
+				if (type == EOF || fread(lengthBytes, 1, 2, file) != 2)
+					break;
+
+				GLint length = (lengthBytes[0] << 8) | lengthBytes[1];
+				bool startOfFrame = type >= 0xC0 && type <= 0xCF && type != 0xC4 && type != 0xC8 && type != 0xCC;
+				if (startOfFrame) {
+					unsigned char frame[5];
+					if (fread(frame, 1, 5, file) == 5) {
+						height = (frame[1] << 8) | frame[2];
+						width = (frame[3] << 8) | frame[4];
+						found = true;
+					}
+				} else {
+					fseek(file, length - 2, SEEK_CUR);
+				}
+			}
+		}
+	}
+
+	fclose(file);
+	return found && width > 0 && height > 0;
+}
+
+/* Box filters an RGB image down to a full mip chain */
+static void BuildMipChain(const unsigned char* image, GLint width, GLint height, GLint levelCount, MipChain& chain)
+{
+	chain.levels.resize(levelCount);
+	chain.levels[0].assign(image, image + width * height * 3);
+
+	for (GLint level = 1; level < levelCount; level++) {
+
+		const vector<GLubyte>& source = chain.levels[level - 1];
+		GLint sourceWidth = max(1, width >> (level - 1)), sourceHeight = max(1, height >> (level - 1));
+		GLint levelWidth = max(1, width >> level), levelHeight = max(1, height >> level);
+
+		vector<GLubyte>& destination = chain.levels[level];
+		destination.resize(levelWidth * levelHeight * 3);
+
+		for (GLint y = 0; y < levelHeight; y++) {
+			for (GLint x = 0; x < levelWidth; x++) {
+
+				// Odd sizes reuse the last row or column
+				GLint x0 = min(x * 2, sourceWidth - 1), x1 = min(x * 2 + 1, sourceWidth - 1);
+				GLint y0 = min(y * 2, sourceHeight - 1), y1 = min(y * 2 + 1, sourceHeight - 1);
+
+				for (int c = 0; c < 3; c++) {
+					GLint sum = source[(y0 * sourceWidth + x0) * 3 + c] + source[(y0 * sourceWidth + x1) * 3 + c] +
+								source[(y1 * sourceWidth + x0) * 3 + c] + source[(y1 * sourceWidth + x1) * 3 + c];
+					destination[(y * levelWidth + x) * 3 + c] = (GLubyte)((sum + 2) / 4);
+				}
+			}
+		}
+	}
+}
+
+// Decodes one material and builds its mip chain
+static void DecodeMipChain(size_t m, MipChain& chain)
+{
+	const MaterialArray& array = materialArrays[materials[m].array];
+
+	GLint width, height;
+	unsigned char* image = ULoadMaterialImage(materials[m], width, height);
+
+	// A header that didn't match the image leaves the finish at its flat color
+	if (width != array.width || height != array.height) {
+		cout<<materials[m].file<<" is "<<width<<"x"<<height<<", expected "<<array.width<<"x"<<array.height<<endl;
+		SOIL_free_image_data(image);
+		image = (unsigned char*)malloc(array.width * array.height * 3);
+		for (GLint t = 0; t < array.width * array.height; t++)
+			for (int c = 0; c < 3; c++)
+				image[t * 3 + c] = (unsigned char)(materials[m].fallbackColor[c] * 255.0f);
+	}
+
+	BuildMipChain(image, array.width, array.height, array.levels, chain);
+	SOIL_free_image_data(image);
+}
+
+/* Loader thread, decodes the queued materials and builds their mip chains until streaming stops */
+void UMipLoader(void)
+{
+	for (;;) {
+
+		GLint m, keepLevel;
+		{
+			unique_lock<mutex> lock(materialMipsLock);
+			mipLoaderWake.wait(lock, [] { return mipLoaderStop || !mipDecodeQueue.empty(); });
+			if (mipLoaderStop)
+				return;
+			m = mipDecodeQueue.front();
+			mipDecodeQueue.pop_front();
+			keepLevel = mipKeepLevels[m];
+		}
+
+		MipChain chain;
+		DecodeMipChain(m, chain);
+
+		// Levels finer than the array wants would only be freed unused
+		for (GLint level = 0; level < keepLevel; level++)
+			vector<GLubyte>().swap(chain.levels[level]);
+
+		lock_guard<mutex> guard(materialMipsLock);
+		materialMips[m].levels.swap(chain.levels);
+		materialMipsReady[m] = true;
+	}
+}
+
+/* Waits for the loader thread at exit */
+void UStopMipStreaming(void)
+{
+	{
+		lock_guard<mutex> guard(materialMipsLock);
+		mipLoaderStop = true;
+	}
+	mipLoaderWake.notify_all();
+	if (mipLoaderThread.joinable())
+		mipLoaderThread.join();
+}
+
+/* True once every material of the array has its mip chain decoded */
+bool UMipsReady(GLint array)
+{
+	lock_guard<mutex> guard(materialMipsLock);
+	for (size_t m = 0; m < materials.size(); m++)
+		if (materials[m].array == array && !materialMipsReady[m])
+			return false;
+	return true;
+}
+
+/* Sends the materials of an array whose level was freed back to the loader thread
+ * Returns true when every material still holds the level, otherwise UMipsReady stays false until they are decoded.
+ */
+bool URequestMipLevel(GLint arrayIndex, GLint level)
+{
+	bool decoded = true;
+
+	lock_guard<mutex> guard(materialMipsLock);
+	for (size_t m = 0; m < materials.size(); m++) {
+		if (materials[m].array != arrayIndex || !materialMips[m].levels[level].empty())
+			continue;
+		materialMipsReady[m] = false;
+		mipKeepLevels[m] = materialArrays[arrayIndex].wantedLevel;
+		mipDecodeQueue.push_back(m);
+		decoded = false;
+	}
+
+	if (!decoded)
+		mipLoaderWake.notify_one();
+	return decoded;
+}
+
+/* Defines one level of the bound array texture from the decoded chains
+ * Levels finer than the tail are freed after the upload, URequestMipLevel has them decoded again.
+ */
+void UUploadMipLevel(GLint arrayIndex, GLint level)
+{
+	const MaterialArray& array = materialArrays[arrayIndex];
+	GLint levelWidth = max(1, array.width >> level), levelHeight = max(1, array.height >> level);
+
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGB, levelWidth, levelHeight, array.layers, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+	for (size_t m = 0; m < materials.size(); m++) {
+
+		if (materials[m].array != arrayIndex)
+			continue;
+
+		vector<GLubyte>& texels = materialMips[m].levels[level];
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, materials[m].layer, levelWidth, levelHeight, 1,
+						GL_RGB, GL_UNSIGNED_BYTE, texels.data());
+
+		if (level < array.tailLevel)
+			vector<GLubyte>().swap(texels);
+	}
+}
+
+/* Defines the last level of the bound array texture with each material's flat color */
+void UUploadMipPlaceholder(GLint arrayIndex)
+{
+	const MaterialArray& array = materialArrays[arrayIndex];
+
+	vector<GLubyte> texels(array.layers * 3);
+	for (size_t m = 0; m < materials.size(); m++)
+		if (materials[m].array == arrayIndex)
+			for (int c = 0; c < 3; c++)
+				texels[materials[m].layer * 3 + c] = (GLubyte)(materials[m].fallbackColor[c] * 255.0f);
+
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, array.levels - 1, GL_RGB, 1, 1, array.layers, 0, GL_RGB, GL_UNSIGNED_BYTE, texels.data());
+}
+
+/* Bytes of the levels from firstLevel to the end of the chain, drivers pad RGB texels to four bytes */
+size_t UMipBytes(const MaterialArray& array, GLint firstLevel)
+{
+	size_t bytes = 0;
+	for (GLint level = firstLevel; level < array.levels; level++)
+		bytes += (size_t)max(1, array.width >> level) * max(1, array.height >> level) * array.layers * 4;
+	return bytes;
+}
+
+/* Uploads the coarse tail of every array whose images are decoded, then at
+ * most one finer level per array per frame while the chairs need it
+ */
+void UStreamMips(void)
+{
+	if (!mipStreaming)
+		return;
+
+	// Texels wanted across a chair, from the screen size of the chair's bounds
+	const BVHNode& root = chairBVH.nodes[0];
+	glm::vec3 extent = root.boundsMax - root.boundsMin;
+	GLfloat chairSize = max(extent.x, max(extent.y, extent.z));
+
+	for (MaterialArray& array : materialArrays)
+		array.wantedLevel = array.levels - 1;
+
+	for (const SceneObject& object : sceneObjects) {
+
+		MaterialArray& array = materialArrays[materials[object.material].array];
+		GLfloat pixels = UProjectedError(chairSize, object, CameraForwardZ);
+		GLint level = pixels >= 1.0f ? (GLint)floor(log2(max(array.width, array.height) / pixels)) : array.levels - 1;
+
+		array.wantedLevel = min(array.wantedLevel, max(0, min(level, array.levels - 1)));
+	}
+
+	for (GLint a = 0; a < (GLint)materialArrays.size(); a++) {
+
+		MaterialArray& array = materialArrays[a];
+
+		// Evicted arrays start over from the tail when they are reloaded
+		GLuint texture = managedResources[array.resource].handle;
+		bool settled = array.residentLevel <= array.tailLevel && array.residentLevel <= array.wantedLevel && array.minLod <= 0.0f;
+		if (texture == 0 || settled || !UMipsReady(a))
+			continue;
+
+		glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+
+		bool uploaded = false;
+		if (array.residentLevel > array.tailLevel) {
+			for (GLint level = array.levels - 1; level >= array.tailLevel; level--)
+				UUploadMipLevel(a, level);
+			array.residentLevel = array.tailLevel;
+			uploaded = true;
+		} else if (array.wantedLevel < array.residentLevel && URequestMipLevel(a, array.residentLevel - 1)) {
+			// Freed levels wait for the loader thread, this array is skipped until UMipsReady
+			UUploadMipLevel(a, --array.residentLevel);
+			array.minLod = 1.0f;
+			uploaded = true;
+		}
+
+		if (uploaded) {
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, array.residentLevel);
+			UResizeResource(array.resource, UMipBytes(array, array.residentLevel));
+		}
+
+		// The minimum LOD is relative to the base level, 1 keeps sampling on the previous level
+		array.minLod = max(0.0f, array.minLod - mipFadeStep);
+		glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_LOD, array.minLod);
+
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	}
+}
+
+/* Prints how long the first frame took to appear and the texture memory it needed */
+void UReportFirstFrame(void)
+{
+	glFinish();
+	firstFrameDrawn = true;
+
+	size_t textureBytes = 0;
+	for (const MaterialArray& array : materialArrays)
+		if (managedResources[array.resource].handle)
+			textureBytes += managedResources[array.resource].bytes;
+
+	cout<<"First frame after "<<chrono::duration<double>(chrono::steady_clock::now() - programStart).count() * 1000.0
+		<<" ms with mip streaming "<<(mipStreaming ? "enabled" : "disabled")<<", "
+		<<textureBytes / 1024<<" KB of material textures resident"<<endl;
+}
+
+/* COMMAND LISTS */
+
+// Appends a command to an arena, the arena only grows when a frame needs more than any before it
+template <typename Command>
+static Command* ArenaPush(CommandArena& arena, CommandType type)
+{
+	size_t offset = arena.used;
+	if (offset + sizeof(Command) > arena.memory.size())
+		arena.memory.resize(max(offset + sizeof(Command), arena.memory.size() * 2));
+	arena.used += sizeof(Command);
+
+	// Constructed in place so replay reads live objects
+	Command* command = new (&arena.memory[offset]) Command();
+	command->header.type = type;
+	return command;
+}
+
+/* Records one range of the chairs into its command list
+ * Batched ranges write their instances into their own slice of chairInstances.
+ */
+void URecordChairRange(GLint range)
+{
+	CommandRecorder& recorder = commandRecorders[range];
+	recorder.arena.used = 0;
+
+	size_t begin = sceneObjects.size() * range / commandRanges;
+	size_t end = sceneObjects.size() * (range + 1) / commandRanges;
+
+	if (!materialBatching) {
+
+		for (size_t i = begin; i < end; i++) {
+
+			const SceneObject& object = sceneObjects[i];
+			const Material& material = materials[object.material];
+			const MeshLOD& lod = chairLODs[object.lod];
+
+			if (object.occluded)
+				continue;
+
+			glm::mat4 objectModel(1.0f);
+			objectModel = glm::translate(objectModel, object.position);
+			objectModel = glm::scale(objectModel, object.scale);
+
+			DrawConstantCommand* command = ArenaPush<DrawConstantCommand>(recorder.arena, CommandDrawConstant);
+			command->header.program = commandProgram;
+			command->header.vao = chairVAO;
+			command->header.textureResource = materialArrays[material.array].resource;
+			command->header.firstVertex = lod.firstVertex;
+			command->header.vertexCount = lod.vertexCount;
+			command->header.instanceCount = commandInstancesPerObject;
+			command->layer = (GLfloat)material.layer;
+			command->lightmapLayer = (GLfloat)i;
+			memcpy(command->model, glm::value_ptr(objectModel), sizeof(command->model));
+		}
+		return;
+	}
+
+	// Counting sort of the range by texture array, then LOD
+	size_t lodCount = chairLODs.size();
+	size_t bucketCount = materialArrays.size() * lodCount;
+	recorder.bucketOffsets.assign(bucketCount + 1, 0);
+
+	for (size_t i = begin; i < end; i++)
+		if (!sceneObjects[i].occluded)
+			recorder.bucketOffsets[materials[sceneObjects[i].material].array * lodCount + sceneObjects[i].lod + 1]++;
+	for (size_t b = 0; b < bucketCount; b++)
+		recorder.bucketOffsets[b + 1] += recorder.bucketOffsets[b];
+
+	recorder.bucketCursors.assign(recorder.bucketOffsets.begin(), recorder.bucketOffsets.end() - 1);
+
+	for (size_t i = begin; i < end; i++) {
+
+		const SceneObject& object = sceneObjects[i];
+		const Material& material = materials[object.material];
+
+		if (object.occluded)
+			continue;
+
+		glm::mat4 objectModel(1.0f);
+		objectModel = glm::translate(objectModel, object.position);
+		objectModel = glm::scale(objectModel, object.scale);
+
+		GLuint slot = begin + recorder.bucketCursors[material.array * lodCount + object.lod]++;
+		chairInstances[slot] = { objectModel, (GLfloat)material.layer, (GLfloat)i };
+	}
+
+	for (size_t b = 0; b < bucketCount; b++) {
+
+		GLuint count = recorder.bucketOffsets[b + 1] - recorder.bucketOffsets[b];
+		if (count == 0)
+			continue;
+
+		const MeshLOD& lod = chairLODs[b % lodCount];
+
+		DrawInstancedCommand* command = ArenaPush<DrawInstancedCommand>(recorder.arena, CommandDrawInstanced);
+		command->header.program = commandProgram;
+		command->header.vao = chairVAO;
+		command->header.textureResource = materialArrays[b / lodCount].resource;
+		command->header.firstVertex = lod.firstVertex;
+		command->header.vertexCount = lod.vertexCount;
+		command->header.instanceCount = count * commandInstancesPerObject;
+		command->firstInstance = begin + recorder.bucketOffsets[b];
+		command->divisor = commandInstancesPerObject;
+	}
+}
+
+/* Worker thread, records its range whenever the GL thread starts a generation after the one it was started in */
+void UCommandWorker(GLint range, unsigned long generation)
+{
+	unsigned long seen = generation;
+
+	for (;;) {
+
+		unique_lock<mutex> lock(commandLock);
+		commandWake.wait(lock, [&] { return commandStop || commandGeneration != seen; });
+		if (commandStop)
+			return;
+		seen = commandGeneration;
+		bool active = range < commandRanges;
+		lock.unlock();
+
+		if (active)
+			URecordChairRange(range);
+
+		lock.lock();
+		if (--commandPending == 0)
+			commandDone.notify_one();
+	}
+}
+
+/* Joins the worker threads at exit */
+void UStopCommandWorkers(void)
+{
+	{
+		lock_guard<mutex> guard(commandLock);
+		commandStop = true;
+	}
+	commandWake.notify_all();
+
+	for (thread& worker : commandThreads)
+		worker.join();
+	commandThreads.clear();
+}
+
+/* Records every chair into the command lists, split over commandWorkers threads */
+void URecordCommandLists(GLuint program, GLint instancesPerObject)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	commandProgram = program;
+	commandInstancesPerObject = instancesPerObject;
+	commandRanges = commandWorkers;
+
+	if ((GLint)commandRecorders.size() < commandRanges)
+		commandRecorders.resize(commandRanges);
+
+	// Starts the missing workers, range 0 is this thread's, the first one registers their join at exit
+	static bool joinAtExit = false;
+	while ((GLint)commandThreads.size() < commandRanges - 1) {
+		if (!joinAtExit) {
+			atexit(UStopCommandWorkers);
+			joinAtExit = true;
+		}
+		commandThreads.push_back(thread(UCommandWorker, (GLint)commandThreads.size() + 1, commandGeneration));
+	}
+
+	// Every chair gets one instance slot, each range fills its own slice
+	if (materialBatching)
+		chairInstances.resize(sceneObjects.size());
+
+	if (commandRanges > 1) {
+		{
+			lock_guard<mutex> guard(commandLock);
+			commandGeneration++;
+			commandPending = commandThreads.size();
+		}
+		commandWake.notify_all();
+	}
+
+	URecordChairRange(0);
+
+	if (commandRanges > 1) {
+		unique_lock<mutex> lock(commandLock);
+		commandDone.wait(lock, [] { return commandPending == 0; });
+	}
+
+	commandRecordSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/* Replays the command lists in range order, skipping redundant state changes */
+void UExecuteCommandLists(void)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	if (materialBatching) {
+		glBindBuffer(GL_ARRAY_BUFFER, chairInstanceVBO);
+		glBufferData(GL_ARRAY_BUFFER, chairInstances.size() * sizeof(ChairInstance), chairInstances.data(), GL_STREAM_DRAW);
+		UResizeResource(chairInstanceResource, chairInstances.size() * sizeof(ChairInstance));
+	}
+
+	GLuint program = 0, vao = 0;
+	GLint textureResource = -1;
+	bool constantAttributes = false;
+
+	for (GLint range = 0; range < commandRanges; range++) {
+
+		const CommandArena& arena = commandRecorders[range].arena;
+		size_t offset = 0;
+
+		while (offset < arena.used) {
+
+			// Every command starts with the header, the type says which command encloses it
+			const DrawCommandHeader* common = (const DrawCommandHeader*)&arena.memory[offset];
+
+			if (common->program != program) {
+				program = common->program;
+				glUseProgram(program);
+			}
+			if (common->vao != vao) {
+				vao = common->vao;
+				glBindVertexArray(vao);
+			}
+			if (common->textureResource != textureResource) {
+				textureResource = common->textureResource;
+				glBindTexture(GL_TEXTURE_2D_ARRAY, UUseResource(textureResource));
+				textureBindsSubmitted++;
+			}
+
+			if (common->type == CommandDrawInstanced) {
+
+				if (constantAttributes) {
+					for (GLuint i = 3; i <= 8; i++)
+						glEnableVertexAttribArray(i);
+					constantAttributes = false;
+				}
+
+				const DrawInstancedCommand* command = (const DrawInstancedCommand*)common;
+
+				UBindInstanceAttributes(command->firstInstance, command->divisor);
+				glDrawArraysInstanced(GL_TRIANGLES, common->firstVertex, common->vertexCount, common->instanceCount);
+				offset += sizeof(DrawInstancedCommand);
+
+			} else {
+
+				const DrawConstantCommand* command = (const DrawConstantCommand*)common;
+
+				if (!constantAttributes) {
+					for (GLuint i = 3; i <= 8; i++)
+						glDisableVertexAttribArray(i);
+					constantAttributes = true;
+				}
+
+				for (GLuint column = 0; column < 4; column++)
+					glVertexAttrib4fv(3 + column, command->model + column * 4);
+				glVertexAttrib1f(7, command->layer);
+				glVertexAttrib1f(8, command->lightmapLayer);
+				glDrawArraysInstanced(GL_TRIANGLES, common->firstVertex, common->vertexCount, common->instanceCount);
+				offset += sizeof(DrawConstantCommand);
+			}
+
+			drawCallsSubmitted++;
+			trianglesSubmitted += common->instanceCount * (common->vertexCount / 3);
+			trianglesFullDetail += common->instanceCount * (chairLODs[0].vertexCount / 3);
+		}
+	}
+
+	// Leaves the chair VAO as the other paths do
+	if (constantAttributes)
+		for (GLuint i = 3; i <= 8; i++)
+			glEnableVertexAttribArray(i);
+	UBindInstanceAttributes(0, 1);
+
+	commandReplaySeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/* Draws the scene inline and with 1, 2, 4 ... every core recording, and reports the submission cost of each */
+void UBenchmarkCommandLists(void)
+{
+	GLint wasWorkers = commandWorkers;
+	GLint maxWorkers = max(1u, thread::hardware_concurrency());
+
+	vector<GLint> counts = { 0 };
+	for (GLint workers = 1; workers < maxWorkers; workers *= 2)
+		counts.push_back(workers);
+	counts.push_back(maxWorkers);
+
+	for (GLint workers : counts) {
+
+		string label = workers == 0 ? string("Inline recording: ") : to_string(workers) + " recording threads: ";
+		BenchmarkFrames(label.c_str(), [workers] {
+			commandWorkers = workers;
+			commandRecordSeconds = commandReplaySeconds = 0.0;
+		});
+		if (workers > 0)
+			cout<<", "<<commandRecordSeconds * 1000.0 / benchmarkFrames<<" ms recording and "
+				<<commandReplaySeconds * 1000.0 / benchmarkFrames<<" ms replay";
+		cout<<endl;
+	}
+
+	commandWorkers = wasWorkers;
+}
+
+/* OCCLUSION CULLING */
+
+/* Rasterizes occluderTriangles into the rows [firstRow, endRow) of the depth buffer and builds their tiles
+ * Pixels are sampled at their centers, four at a time.
+ */
+void URasterizeOccluders(GLint firstRow, GLint endRow)
+{
+	fill(occlusionDepth.begin() + firstRow * occlusionWidth, occlusionDepth.begin() + endRow * occlusionWidth, 0.0f);
+
+	const __m128 laneOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+	const __m128 zero = _mm_setzero_ps();
+
+	for (size_t t = 0; t + 2 < occluderTriangles.size(); t += 3) {
+
+		glm::vec3 v0 = occluderTriangles[t], v1 = occluderTriangles[t + 1], v2 = occluderTriangles[t + 2];
+
+		// Counter clockwise on screen, so every edge function is positive inside
+		GLfloat area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+		if (fabs(area) < 1e-6f)
+			continue;
+		if (area < 0.0f) {
+			swap(v1, v2);
+			area = -area;
+		}
+
+		GLint minX = max(0, (GLint)floor(min(v0.x, min(v1.x, v2.x))));
+		GLint maxX = min(occlusionWidth - 1, (GLint)ceil(max(v0.x, max(v1.x, v2.x))));
+		GLint minY = max(firstRow, (GLint)floor(min(v0.y, min(v1.y, v2.y))));
+		GLint maxY = min(endRow - 1, (GLint)ceil(max(v0.y, max(v1.y, v2.y))));
+		if (minX > maxX || minY > maxY)
+			continue;
+		minX &= ~3;
+
+		// Edge i is opposite vertex i, E(x, y) = A x + B y + C
+		glm::vec3 a[3] = { v1, v2, v0 }, b[3] = { v2, v0, v1 };
+		__m128 edgeA[3], edgeRow[3];
+		GLfloat edgeB[3], edgeC[3];
+		for (int e = 0; e < 3; e++) {
+			edgeA[e] = _mm_set1_ps(-(b[e].y - a[e].y));
+			edgeB[e] = b[e].x - a[e].x;
+			edgeC[e] = (b[e].y - a[e].y) * a[e].x - (b[e].x - a[e].x) * a[e].y;
+		}
+
+		// Interpolates 1/w with the edge functions as barycentric weights
+		__m128 depth0 = _mm_set1_ps(v0.z / area), depth1 = _mm_set1_ps(v1.z / area), depth2 = _mm_set1_ps(v2.z / area);
+
+		for (GLint y = minY; y <= maxY; y++) {
+
+			GLfloat centerY = y + 0.5f;
+			for (int e = 0; e < 3; e++)
+				edgeRow[e] = _mm_set1_ps(edgeB[e] * centerY + edgeC[e]);
+
+			GLfloat* row = &occlusionDepth[y * occlusionWidth];
+
+			for (GLint x = minX; x <= maxX; x += 4) {
+
+				__m128 centerX = _mm_add_ps(_mm_set1_ps((GLfloat)x), laneOffsets);
+				__m128 w0 = _mm_add_ps(_mm_mul_ps(edgeA[0], centerX), edgeRow[0]);
+				__m128 w1 = _mm_add_ps(_mm_mul_ps(edgeA[1], centerX), edgeRow[1]);
+				__m128 w2 = _mm_add_ps(_mm_mul_ps(edgeA[2], centerX), edgeRow[2]);
+
+				__m128 inside = _mm_and_ps(_mm_cmpge_ps(w0, zero), _mm_and_ps(_mm_cmpge_ps(w1, zero), _mm_cmpge_ps(w2, zero)));
+				if (_mm_movemask_ps(inside) == 0)
+					continue;
+
+				__m128 depth = _mm_add_ps(_mm_mul_ps(w0, depth0), _mm_add_ps(_mm_mul_ps(w1, depth1), _mm_mul_ps(w2, depth2)));
+				__m128 old = _mm_loadu_ps(row + x);
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, _mm_max_ps(old, depth)), _mm_andnot_ps(inside, old)));
+			}
+		}
+	}
+
+	// Farthest occluder depth of every tile in the band
+	GLint tilesPerRow = occlusionWidth / occlusionTileSize;
+	for (GLint ty = firstRow / occlusionTileSize; ty < endRow / occlusionTileSize; ty++) {
+		for (GLint tx = 0; tx < tilesPerRow; tx++) {
+
+			__m128 farthest = _mm_set1_ps(1e30f);
+			for (GLint y = ty * occlusionTileSize; y < (ty + 1) * occlusionTileSize; y++)
+				for (GLint x = tx * occlusionTileSize; x < (tx + 1) * occlusionTileSize; x += 4)
+					farthest = _mm_min_ps(farthest, _mm_loadu_ps(&occlusionDepth[y * occlusionWidth + x]));
+
+			GLfloat lanes[4];
+			_mm_storeu_ps(lanes, farthest);
+			occlusionTiles[ty * tilesPerRow + tx] = min(min(lanes[0], lanes[1]), min(lanes[2], lanes[3]));
+		}
+	}
+}
+
+/* True if the chair's bounds are hidden behind the rasterized occluders */
+bool UTestOcclusion(const SceneObject& object, const glm::mat4& viewProjection)
+{
+	const BVHNode& root = chairBVH.nodes[0];
+
+	GLfloat minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f, nearest = 0.0f;
+
+	for (int corner = 0; corner < 8; corner++) {
+
+		glm::vec3 local((corner & 1) ? root.boundsMax.x : root.boundsMin.x,
+						(corner & 2) ? root.boundsMax.y : root.boundsMin.y,
+						(corner & 4) ? root.boundsMax.z : root.boundsMin.z);
+		glm::vec4 clip = viewProjection * glm::vec4(object.position + local * object.scale, 1.0f);
+
+		// Bounds crossing the near plane are always drawn
+		if (clip.w < 0.1f)
+			return false;
+
+		GLfloat x = (clip.x / clip.w * 0.5f + 0.5f) * occlusionWidth;
+		GLfloat y = (clip.y / clip.w * 0.5f + 0.5f) * occlusionHeight;
+		minX = min(minX, x);
+		maxX = max(maxX, x);
+		minY = min(minY, y);
+		maxY = max(maxY, y);
+		nearest = max(nearest, 1.0f / clip.w);
+	}
+
+	GLint x0 = max(0, (GLint)floor(minX)), x1 = min(occlusionWidth - 1, (GLint)floor(maxX));
+	GLint y0 = max(0, (GLint)floor(minY)), y1 = min(occlusionHeight - 1, (GLint)floor(maxY));
+
+	// Off screen chairs are left to the GPU's clipping
+	if (x0 > x1 || y0 > y1)
+		return false;
+
+	GLint tilesPerRow = occlusionWidth / occlusionTileSize;
+	for (GLint ty = y0 / occlusionTileSize; ty <= y1 / occlusionTileSize; ty++) {
+		for (GLint tx = x0 / occlusionTileSize; tx <= x1 / occlusionTileSize; tx++) {
+
+			// The whole tile is in front of the chair
+			if (occlusionTiles[ty * tilesPerRow + tx] > nearest)
+				continue;
+
+			// Otherwise only the pixels of the rectangle inside the tile count
+			for (GLint y = max(y0, ty * occlusionTileSize); y <= min(y1, (ty + 1) * occlusionTileSize - 1); y++)
+				for (GLint x = max(x0, tx * occlusionTileSize); x <= min(x1, (tx + 1) * occlusionTileSize - 1); x++)
+					if (occlusionDepth[y * occlusionWidth + x] <= nearest)
+						return false;
+		}
+	}
+
+	return true;
+}
+
+// Rasterizes one band out of bands, each a run of whole tile rows
+static void RasterizeOcclusionBand(GLint band, GLint bands)
+{
+	GLint tileRows = occlusionHeight / occlusionTileSize;
+	URasterizeOccluders(tileRows * band / bands * occlusionTileSize, tileRows * (band + 1) / bands * occlusionTileSize);
+}
+
+/* Marks the chairs hidden behind the nearest large chairs
+ * The multi-view layout isn't single view, every chair is marked visible.
+ */
+void UCullOccluded(const glm::mat4& viewProjection, bool singleView)
+{
+	objectsOccluded = 0;
+	occludersRasterized = 0;
+
+	for (SceneObject& object : sceneObjects)
+		object.occluded = false;
+
+	if (!occlusionEnabled || !singleView || sceneObjects.size() < 2)
+		return;
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	// Nearest chairs large enough on screen to hide anything
+	const BVHNode& root = chairBVH.nodes[0];
+	glm::vec3 extent = root.boundsMax - root.boundsMin;
+	GLfloat chairSize = max(extent.x, max(extent.y, extent.z));
+
+	vector<pair<GLfloat, GLuint>> candidates;
+	for (size_t i = 0; i < sceneObjects.size(); i++)
+		if (UProjectedError(chairSize, sceneObjects[i], CameraForwardZ) >= occluderMinPixels)
+			candidates.push_back({ glm::length(sceneObjects[i].position - CameraForwardZ), (GLuint)i });
+	sort(candidates.begin(), candidates.end());
+	candidates.resize(min(candidates.size(), (size_t)maxOccluders));
+
+	// The seat and the back are the only parts solid enough to occlude
+	occluderTriangles.clear();
+	for (const pair<GLfloat, GLuint>& candidate : candidates) {
+
+		const SceneObject& object = sceneObjects[candidate.second];
+		glm::mat4 objectTransform = glm::translate(glm::mat4(1.0f), object.position);
+		objectTransform = viewProjection * glm::scale(objectTransform, object.scale);
+
+		for (GLuint triangle = 0; triangle < chairPartFirstTriangle[2]; triangle++) {
+
+			glm::vec3 corners[3];
+			bool clipped = false;
+			for (int c = 0; c < 3; c++) {
+				const GLfloat* v = chairVertices + (triangle * 3 + c) * 8;
+				glm::vec4 clip = objectTransform * glm::vec4(v[0], v[1], v[2], 1.0f);
+				// Triangles crossing the near plane are left out, fewer occluders are still correct
+				if (clip.w < 0.1f) {
+					clipped = true;
+					break;
+				}
+				corners[c] = glm::vec3((clip.x / clip.w * 0.5f + 0.5f) * occlusionWidth,
+									   (clip.y / clip.w * 0.5f + 0.5f) * occlusionHeight, 1.0f / clip.w);
+			}
+
+			if (!clipped)
+				occluderTriangles.insert(occluderTriangles.end(), corners, corners + 3);
+		}
+	}
+	occludersRasterized = candidates.size();
+
+	// Every thread rasterizes all occluders into its own band of whole tile rows
+	GLint threads = occlusionThreads > 0 ? occlusionThreads : min(4u, max(1u, thread::hardware_concurrency()));
+	threads = min(threads, occlusionHeight / occlusionTileSize);
+
+	UParallelFor(threads, [&](GLint first, GLint end) {
+		for (GLint band = first; band < end; band++)
+			RasterizeOcclusionBand(band, threads);
+	}, 1);
+
+	for (SceneObject& object : sceneObjects) {
+		object.occluded = UTestOcclusion(object, viewProjection);
+		objectsOccluded += object.occluded;
+	}
+
+	occlusionSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+
+/* LIGHTMAP BAKING */
+
+// Triangle t's corners in object space
+static void LightmapTriangle(GLuint t, glm::vec3 corners[3])
+{
+	const GLfloat* v = &chairLODVertices[t * 3 * 8];
+	for (GLint c = 0; c < 3; c++)
+		corners[c] = glm::vec3(v[c * 8], v[c * 8 + 1], v[c * 8 + 2]);
+}
+
+/* Lays the corners of a chart's triangles flat in their plane
+ * The rotation is the one of its edges that gives the smallest bounding rectangle, so a quad lies square.
+ */
+static void FlattenChart(const glm::vec3* corners, GLint cornerCount, glm::vec2* flat, GLfloat& width, GLfloat& height)
+{
+	glm::vec3 normal = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+	GLfloat bestArea = 1e30f;
+	width = height = 0.0f;
+
+	for (GLint c = 0; c < cornerCount; c++)
+		flat[c] = glm::vec2(0.0f, 0.0f);
+	if (glm::dot(normal, normal) < 1e-12f)
+		return;
+	normal = glm::normalize(normal);
+
+	for (GLint e = 0; e < cornerCount; e++) {
+
+		glm::vec3 edge = corners[e % 3 == 2 ? e - 2 : e + 1] - corners[e];
+		if (glm::dot(edge, edge) < 1e-12f)
+			continue;
+		glm::vec3 xAxis = glm::normalize(edge), yAxis = glm::cross(normal, xAxis);
+
+		GLfloat minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+		for (GLint c = 0; c < cornerCount; c++) {
+			GLfloat x = glm::dot(corners[c], xAxis), y = glm::dot(corners[c], yAxis);
+			minX = min(minX, x); maxX = max(maxX, x);
+			minY = min(minY, y); maxY = max(maxY, y);
+		}
+
+		if ((maxX - minX) * (maxY - minY) < bestArea) {
+			bestArea = (maxX - minX) * (maxY - minY);
+			width = maxX - minX;
+			height = maxY - minY;
+			for (GLint c = 0; c < cornerCount; c++)
+				flat[c] = glm::vec2(glm::dot(corners[c], xAxis) - minX, glm::dot(corners[c], yAxis) - minY);
+		}
+	}
+}
+
+/* Gives every triangle of chairLODVertices a place in the lightmap atlas
+ * Two neighbouring triangles that share an edge in one plane, the halves of a
+ * box face, share a chart. Charts are shelf packed at the largest scale that
+ * fits, so every chart has the same texel density.
+ */
+void UBuildLightmapCharts(void)
+{
+	GLuint triangleCount = chairLODVertices.size() / (3 * 8);
+	vector<glm::vec2> flat(triangleCount * 3);
+	vector<GLfloat> widths, heights;
+	GLfloat area = 0.0f;
+
+	lightmapCharts.clear();
+
+	for (GLuint t = 0; t < triangleCount; ) {
+
+		glm::vec3 corners[6];
+		LightmapTriangle(t, corners);
+		GLuint count = 1;
+
+		if (t + 1 < triangleCount) {
+
+			LightmapTriangle(t + 1, corners + 3);
+
+			GLint shared = 0;
+			for (GLint a = 0; a < 3; a++)
+				for (GLint b = 3; b < 6; b++)
+					shared += corners[a] == corners[b];
+
+			glm::vec3 first = glm::cross(corners[1] - corners[0], corners[2] - corners[0]);
+			glm::vec3 second = glm::cross(corners[4] - corners[3], corners[5] - corners[3]);
+			GLfloat lengths = glm::length(first) * glm::length(second);
+
+			if (shared == 2 && lengths > 0.0f && glm::dot(first, second) > 0.999f * lengths)
+				count = 2;
+		}
+
+		LightmapChart chart;
+		chart.firstTriangle = t;
+		chart.triangleCount = count;
+		lightmapCharts.push_back(chart);
+
+		GLfloat width, height;
+		FlattenChart(corners, count * 3, &flat[t * 3], width, height);
+		widths.push_back(width);
+		heights.push_back(height);
+		area += width * height;
+
+		t += count;
+	}
+
+	// Shelf packing, tallest charts first
+	GLuint chartCount = lightmapCharts.size();
+	vector<GLuint> order(chartCount);
+	for (GLuint c = 0; c < chartCount; c++)
+		order[c] = c;
+	sort(order.begin(), order.end(), [&](GLuint a, GLuint b) { return heights[a] > heights[b]; });
+
+	GLfloat texelsPerUnit = area > 0.0f ? sqrt((GLfloat)lightmapSize * lightmapSize / area) : 1.0f;
+
+	for (;;) {
+
+		GLint x = lightmapPadding, y = lightmapPadding, shelfHeight = 0;
+		bool fits = true;
+
+		for (GLuint c : order) {
+
+			LightmapChart& chart = lightmapCharts[c];
+			chart.width = (GLint)ceil(widths[c] * texelsPerUnit);
+			chart.height = (GLint)ceil(heights[c] * texelsPerUnit);
+
+			if (x + chart.width + lightmapPadding > lightmapSize) {
+				x = lightmapPadding;
+				y += shelfHeight + lightmapPadding;
+				shelfHeight = 0;
+			}
+			if (y + chart.height + lightmapPadding > lightmapSize) {
+				fits = false;
+				break;
+			}
+
+			chart.x = x;
+			chart.y = y;
+			x += chart.width + lightmapPadding;
+			shelfHeight = max(shelfHeight, chart.height);
+		}
+
+		if (fits)
+			break;
+		texelsPerUnit *= 0.95f;
+	}
+
+	// Corners in texels from their chart's corner, and the vertices' coordinates in the atlas
+	lightmapCorners.resize(triangleCount * 3);
+	chairLightmapCoordinates.resize(triangleCount * 3 * 2);
+	for (const LightmapChart& chart : lightmapCharts) {
+		for (GLuint i = chart.firstTriangle * 3; i < (chart.firstTriangle + chart.triangleCount) * 3; i++) {
+			lightmapCorners[i] = flat[i] * texelsPerUnit;
+			chairLightmapCoordinates[i * 2] = (chart.x + lightmapCorners[i].x) / lightmapSize;
+			chairLightmapCoordinates[i * 2 + 1] = (chart.y + lightmapCorners[i].y) / lightmapSize;
+		}
+	}
+
+	cout<<"Lightmap atlas: "<<triangleCount<<" triangles in "<<chartCount<<" charts at "
+		<<texelsPerUnit<<" texels per unit in "<<lightmapSize<<"x"<<lightmapSize<<endl;
+}
+
+// Squared distance from p to a triangle, weights gets the barycentric coordinates of the closest point
+static GLfloat ClosestOnTriangle(const glm::vec2 corners[3], const glm::vec2& p, glm::vec3& weights)
+{
+	glm::vec2 e1 = corners[1] - corners[0], e2 = corners[2] - corners[0], d = p - corners[0];
+	GLfloat area = e1.x * e2.y - e1.y * e2.x;
+	GLfloat wb = (d.x * e2.y - d.y * e2.x) / area;
+	GLfloat wc = (e1.x * d.y - e1.y * d.x) / area;
+	weights = glm::vec3(1.0f - wb - wc, wb, wc);
+	if (weights.x >= 0.0f && weights.y >= 0.0f && weights.z >= 0.0f)
+		return 0.0f;
+
+	// Outside, the closest point is on one of the edges
+	GLfloat closest = 1e30f;
+	for (GLint e = 0; e < 3; e++) {
+
+		glm::vec2 edge = corners[(e + 1) % 3] - corners[e];
+		GLfloat t = glm::clamp(glm::dot(p - corners[e], edge) / glm::dot(edge, edge), 0.0f, 1.0f);
+		glm::vec2 offset = corners[e] + edge * t - p;
+		GLfloat distance = glm::dot(offset, offset);
+
+		if (distance < closest) {
+			closest = distance;
+			weights = glm::vec3(0.0f);
+			weights[e] = 1.0f - t;
+			weights[(e + 1) % 3] = t;
+		}
+	}
+	return closest;
+}
+
+/* Diffuse term of the chair shader for both lights, zero where the scene blocks a light
+ * origin is the surface point lifted off the surface, keyVisible reports the key light.
+ */
+static glm::vec3 DirectDiffuse(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& origin, bool& keyVisible)
+{
+	const glm::vec3 lightPositions[2] = { keyLightPosition, fillLightPosition };
+	const glm::vec3 lightColors[2] = { keyLightColor, fillLightColor };
+
+	glm::vec3 diffuse(0.0f);
+	keyVisible = false;
+
+	for (int l = 0; l < 2; l++) {
+
+		glm::vec3 toLight = lightPositions[l] - position;
+		GLfloat distance = glm::length(toLight);
+		glm::vec3 direction = toLight / distance;
+		GLfloat impact = glm::dot(normal, direction);
+		if (impact <= 0.0f)
+			continue;
+
+		RayHit hit = { distance, ~0u, -1 };
+		if (UIntersectScene(origin, direction, hit))
+			continue;
+
+		diffuse += impact * lightColors[l];
+		if (l == 0)
+			keyVisible = true;
+	}
+	return diffuse;
+}
+
+/* Light arriving at one lightmap texel in the units of the chair shader
+ * Without indirect light that's the shader's ambient plus the shadowed diffuse term.
+ * With it the ambient becomes the sky seen by cosine weighted rays and chairs
+ * they hit reflect their own direct light, which gives contact darkening and
+ * color bleeding between chairs. The sky is the environment map when it's on.
+ */
+static glm::vec4 BakeTexel(const glm::vec3& position, const glm::vec3& normal, GLfloat bias, GLuint& rng)
+{
+	const GLfloat ambientStrength = 0.1f;
+	glm::vec3 ambient = environmentLighting ? UEnvironmentAmbient(normal) : ambientStrength * (keyLightColor + fillLightColor);
+	glm::vec3 origin = position + normal * bias;
+
+	bool keyVisible;
+	glm::vec3 light = DirectDiffuse(position, normal, origin, keyVisible);
+
+	if (!lightmapIndirect)
+		return glm::vec4(light + ambient, keyVisible ? 1.0f : 0.0f);
+
+	glm::vec3 tangent, bitangent, bounced(0.0f);
+	OrthonormalBasis(normal, tangent, bitangent);
+
+	for (GLint s = 0; s < lightmapSamples; s++) {
+
+		GLfloat r = sqrt(NextRandom(rng)), phi = 2.0f * 3.14159265f * NextRandom(rng);
+		glm::vec3 direction = glm::normalize(tangent * (r * cos(phi)) + bitangent * (r * sin(phi)) + normal * sqrt(max(0.0f, 1.0f - r * r)));
+
+		RayHit hit = { 1e30f, ~0u, -1 };
+		if (!UIntersectScene(origin, direction, hit)) {
+			bounced += environmentLighting ? UEnvironmentRadiance(direction) : ambient;
+			continue;
+		}
+
+		glm::vec3 hitPosition = origin + direction * hit.t, hitNormal, albedo;
+		ChairSurface(hit, hitPosition, hitNormal, albedo);
+		if (glm::dot(hitNormal, direction) > 0.0f)
+			hitNormal = -hitNormal;
+
+		bool hitKeyVisible;
+		bounced += albedo * DirectDiffuse(hitPosition, hitNormal, hitPosition + hitNormal * 1e-3f, hitKeyVisible);
+	}
+
+	return glm::vec4(light + bounced / (GLfloat)lightmapSamples, keyVisible ? 1.0f : 0.0f);
+}
+
+/* Bakes every scene object's layer of lightmapTexels on threads, returns the seconds it took
+ * A job is one chart of one object. Texels within lightmapDilation of the
+ * chart's triangles are baked too, so bilinear filtering at their edges stays
+ * inside the chart, each from the triangle nearest to it.
+ */
+double UBakeLightmaps(GLint threads)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	GLuint chartCount = lightmapCharts.size();
+	GLuint jobCount = sceneObjects.size() * chartCount;
+	size_t layerTexels = (size_t)lightmapSize * lightmapSize;
+
+	lightmapTexels.assign(sceneObjects.size() * layerTexels * 4, 0);
+
+	// Simplified triangles are lifted past the full mesh they approximate before tracing
+	vector<GLfloat> lodError(chairLODVertices.size() / (3 * 8), 0.0f);
+	for (const MeshLOD& lod : chairLODs)
+		for (GLint t = lod.firstVertex / 3; t < (lod.firstVertex + lod.vertexCount) / 3; t++)
+			lodError[t] = lod.geometricError;
+
+	atomic<GLuint> nextJob(0);
+
+	auto worker = [&]() {
+		for (GLuint job = nextJob++; job < jobCount; job = nextJob++) {
+
+			GLuint objectIndex = job / chartCount;
+			const SceneObject& object = sceneObjects[objectIndex];
+			const LightmapChart& chart = lightmapCharts[job % chartCount];
+			GLushort* layer = &lightmapTexels[objectIndex * layerTexels * 4];
+
+			GLfloat scale = max(object.scale.x, max(object.scale.y, object.scale.z));
+			GLint reach = (GLint)ceil(lightmapDilation);
+
+			for (GLint y = max(0, chart.y - reach); y < min(lightmapSize, chart.y + chart.height + reach); y++) {
+				for (GLint x = max(0, chart.x - reach); x < min(lightmapSize, chart.x + chart.width + reach); x++) {
+
+					glm::vec2 center(x + 0.5f - chart.x, y + 0.5f - chart.y);
+					GLfloat closest = lightmapDilation * lightmapDilation;
+					GLint nearest = -1;
+					glm::vec3 w;
+
+					for (GLuint t = chart.firstTriangle; t < chart.firstTriangle + chart.triangleCount; t++) {
+
+						// Degenerate triangles cover no pixels
+						const glm::vec2* corners = &lightmapCorners[t * 3];
+						glm::vec2 e1 = corners[1] - corners[0], e2 = corners[2] - corners[0];
+						if (fabs(e1.x * e2.y - e1.y * e2.x) < 1e-6f)
+							continue;
+
+						glm::vec3 weights;
+						GLfloat distance = ClosestOnTriangle(corners, center, weights);
+						if (distance <= closest) {
+							closest = distance;
+							nearest = t;
+							w = weights;
+						}
+					}
+
+					if (nearest < 0)
+						continue;
+
+					const GLfloat* v = &chairLODVertices[nearest * 3 * 8];
+					glm::vec3 local(0.0f), normal(0.0f);
+					for (GLint c = 0; c < 3; c++) {
+						local += glm::vec3(v[c * 8], v[c * 8 + 1], v[c * 8 + 2]) * w[c];
+						normal += glm::vec3(v[c * 8 + 3], v[c * 8 + 4], v[c * 8 + 5]) * w[c];
+					}
+
+					// Same transform as the chair vertex shader
+					glm::vec3 position = object.position + local * object.scale;
+					normal = glm::normalize(normal / object.scale);
+
+					GLuint rng = HashRandom((GLuint)(objectIndex * layerTexels + y * lightmapSize + x) * 9781U + 1U);
+					glm::vec4 texel = BakeTexel(position, normal, (1e-3f + lodError[nearest]) * scale, rng);
+					for (GLint c = 0; c < 4; c++)
+						layer[(y * lightmapSize + x) * 4 + c] = glm::packHalf1x16(texel[c]);
+				}
+			}
+		}
+	};
+
+	vector<thread> pool;
+	for (GLint id = 1; id < threads; id++)
+		pool.push_back(thread(worker));
+	worker();
+	for (thread& t : pool)
+		t.join();
+
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/* Creates the lightmap texture array from lightmapTexels
+ * Each layer holds lightmapTiles x lightmapTiles chairs, as few as fit every chair in GL_MAX_ARRAY_TEXTURE_LAYERS.
+ */
+size_t ULoadLightmap(GLuint& texture)
+{
+	GLint maxLayers, maxSize;
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+
+	GLint objects = sceneObjects.size();
+	lightmapTiles = 1;
+	while ((objects + lightmapTiles * lightmapTiles - 1) / (lightmapTiles * lightmapTiles) > maxLayers &&
+		   lightmapSize * (lightmapTiles + 1) <= maxSize)
+		lightmapTiles++;
+
+	GLint tilesPerLayer = lightmapTiles * lightmapTiles;
+	GLint layers = max(1, min(maxLayers, (objects + tilesPerLayer - 1) / tilesPerLayer));
+	GLint side = lightmapSize * lightmapTiles;
+
+	// Chairs past the largest array the GPU allows sample its last layer
+	if (objects > layers * tilesPerLayer)
+		cout<<"The lightmap holds "<<layers * tilesPerLayer<<" of "<<objects<<" chairs, the others reuse its last layer"<<endl;
+
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA16F, side, side, layers, 0, GL_RGBA, GL_HALF_FLOAT, NULL);
+
+	size_t layerTexels = (size_t)lightmapSize * lightmapSize;
+	for (GLint o = 0; o < min(objects, layers * tilesPerLayer); o++) {
+		GLint tile = o % tilesPerLayer;
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, tile % lightmapTiles * lightmapSize, tile / lightmapTiles * lightmapSize,
+						o / tilesPerLayer, lightmapSize, lightmapSize, 1, GL_RGBA, GL_HALF_FLOAT, &lightmapTexels[o * layerTexels * 4]);
+	}
+
+	// No mips, the charts' padding only protects the full resolution level
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	return (size_t)side * side * layers * 4 * sizeof(GLushort);
+}
+
+/* Bakes the scene's lighting on every core and hands the lightmap to the residency manager */
+void UBakeLighting(void)
+{
+	// Bounces off wood chairs use the texture's colors
+	if (lightmapIndirect)
+		LoadWoodTexels();
+
+	GLint threads = pathTraceThreads > 0 ? pathTraceThreads : max(1u, thread::hardware_concurrency());
+	lightmapBakeSeconds = UBakeLightmaps(threads);
+	lightmapBaked = true;
+
+	cout<<"Baked "<<sceneObjects.size()<<" lightmaps"<<(lightmapIndirect ? " with indirect light" : "")<<" in "
+		<<lightmapBakeSeconds<<" s on "<<threads<<" threads"<<endl;
+}
+
+/* Creates the lightmap texture once the lighting is baked */
+void UUploadLightmap(void)
+{
+	if (lightmapResource < 0)
+		lightmapResource = URegisterResource("chair lightmaps", ResourceTexture, ULoadLightmap);
+}
+
+/* Bakes the scene with 1, 2, 4 ... N threads and reports scaling efficiency */
+int ULightmapScaling(void)
+{
+	UPathTraceSetup();
+	UBuildLODChain(chairVertices, chairVertexCount, chairLODVertices);
+	UBuildLightmapCharts();
+	if (environmentLighting)
+		ULoadEnvironment();
+
+	GLint maxThreads = pathTraceThreads > 0 ? pathTraceThreads : max(1u, thread::hardware_concurrency());
+
+	vector<GLint> counts;
+	for (GLint threads = 1; threads < maxThreads; threads *= 2)
+		counts.push_back(threads);
+	counts.push_back(maxThreads);
+
+	double singleThreadSeconds = 0.0;
+	for (GLint threads : counts) {
+
+		double seconds = UBakeLightmaps(threads);
+		if (threads == 1)
+			singleThreadSeconds = seconds;
+
+		double texelsPerSecondPerCore = (double)lightmapTexels.size() / 4 / seconds / threads;
+		cout<<threads<<" threads: "<<seconds<<" s, "<<texelsPerSecondPerCore<<" atlas texels per second per core, "
+			<<100.0 * singleThreadSeconds / (seconds * threads)<<"% scaling efficiency"<<endl;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Draws the scene with full Phong and with baked lighting and reports the GPU cost per fragment of each
+ * Both draw the same geometry, so the difference is the fragment shading.
+ */
+void UBenchmarkLightmap(void)
+{
+	bool wasEnabled = lightmapEnabled;
+
+	if (!lightmapBaked) {
+		UBakeLighting();
+		UUploadLightmap();
+	}
+
+	for (int baked = 0; baked < 2; baked++) {
+
+		FrameTiming timing = BenchmarkFrames(baked ? "Baked lighting: " : "Full Phong: ",
+											 [baked] { lightmapEnabled = baked == 1; });
+		cout<<", "<<timing.gpuMilliseconds<<" ms GPU time, "<<timing.fragments<<" fragments, "
+			<<(timing.fragments > 0 ? timing.gpuMilliseconds * 1e6 / timing.fragments : 0.0)<<" ns per fragment"<<endl;
+	}
+
+	lightmapEnabled = wasEnabled;
+}
+
+/* ENVIRONMENT LIGHTING */
+
+/* Reads a Radiance .hdr image into three float planes, red, green and blue
+ * Handles flat and run length encoded scanlines, the -Y H +X W orientation
+ * every common tool writes, and the RGBE pixel format.
+ */
+bool ULoadHDR(const char* path, GLint& width, GLint& height, vector<GLfloat>& planes)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return false;
+
+	char line[256];
+	bool valid = fgets(line, sizeof(line), file) && strncmp(line, "#?", 2) == 0;
+
+	// Header lines until a blank one, only the pixel format matters
+	while (valid && fgets(line, sizeof(line), file) && line[0] != '\n')
+		if (strncmp(line, "FORMAT=", 7) == 0 && strncmp(line + 7, "32-bit_rle_rgbe", 15) != 0)
+			valid = false;
+
+	valid = valid && fgets(line, sizeof(line), file) && sscanf(line, "-Y %d +X %d", &height, &width) == 2
+		&& width > 0 && height > 0;
+
+	if (!valid) {
+		fclose(file);
+		return false;
+	}
+
+	planes.resize(3 * (size_t)width * height);
+	vector<unsigned char> scanline(width * 4);
+	GLfloat* red = &planes[0];
+	GLfloat* green = red + (size_t)width * height;
+	GLfloat* blue = green + (size_t)width * height;
+
+	for (GLint y = 0; y < height && valid; y++) {
+
+		unsigned char start[4];
+		valid = fread(start, 1, 4, file) == 4;
+
+		if (valid && width >= 8 && width < 32768 && start[0] == 2 && start[1] == 2 && ((start[2] << 8) | start[3]) == width) {
+
+			// Run length encoded, every component is stored for the whole row before the next
+			for (GLint c = 0; c < 4 && valid; c++) {
+				for (GLint x = 0; x < width && valid; ) {
+					GLint count = fgetc(file);
+					if (count > 128) {
+						count -= 128;
+						GLint value = fgetc(file);
+						valid = value != EOF && x + count <= width;
+						for (GLint i = 0; i < count && valid; i++)
+							scanline[(x++) * 4 + c] = value;
+					} else {
+						valid = count > 0 && x + count <= width;
+						for (GLint i = 0; i < count && valid; i++) {
+							GLint value = fgetc(file);
+							valid = value != EOF;
+							scanline[(x++) * 4 + c] = value;
+						}
+					}
+				}
+			}
+
+		} else if (valid) {
+
+			// Flat pixels, the four bytes already read are the first one
+			memcpy(&scanline[0], start, 4);
+			valid = fread(&scanline[4], 1, (width - 1) * 4, file) == (size_t)(width - 1) * 4;
+		}
+
+		for (GLint x = 0; x < width && valid; x++) {
+			const unsigned char* rgbe = &scanline[x * 4];
+			GLfloat scale = rgbe[3] ? ldexp(1.0f, rgbe[3] - 136) : 0.0f;
+			size_t i = (size_t)y * width + x;
+			red[i] = rgbe[0] * scale;
+			green[i] = rgbe[1] * scale;
+			blue[i] = rgbe[2] * scale;
+		}
+	}
+
+	fclose(file);
+	return valid;
+}
+
+/* Built in environment when no map is given, a bright overhead softbox
+ * fading to a dim warm floor, in the same layout as a loaded map
+ */
+static void StudioEnvironment(GLint width, GLint height, vector<GLfloat>& planes)
+{
+	size_t texels = (size_t)width * height;
+	planes.resize(3 * texels);
+
+	for (GLint y = 0; y < height; y++) {
+
+		GLfloat up = cos(3.14159265f * (y + 0.5f) / height);
+		glm::vec3 radiance = up > 0.0f ? glm::mix(glm::vec3(0.5f, 0.55f, 0.6f), glm::vec3(2.0f, 2.0f, 2.1f), up * up)
+									   : glm::mix(glm::vec3(0.35f, 0.3f, 0.25f), glm::vec3(0.15f, 0.12f, 0.1f), -up);
+
+		for (GLint x = 0; x < width; x++)
+			for (GLint c = 0; c < 3; c++)
+				planes[c * texels + (size_t)y * width + x] = radiance[c];
+	}
+}
+
+/* Projects an equirectangular radiance map onto the first 9 real SH functions
+ * Rows are split over the threads. Along a row the direction only changes in
+ * longitude, so four texels at a time go through the basis functions in SSE
+ * lanes with the row's latitude and solid angle splatted.
+ */
+double UProjectSH(const vector<GLfloat>& planes, GLint width, GLint height, GLint threads, glm::vec3 sh[9])
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	size_t texels = (size_t)width * height;
+	threads = max(1, min(threads, height));
+
+	// Longitude only depends on the column
+	vector<GLfloat> cosPhi(width), sinPhi(width);
+	for (GLint x = 0; x < width; x++) {
+		GLfloat phi = 2.0f * 3.14159265f * (x + 0.5f) / width;
+		cosPhi[x] = cos(phi);
+		sinPhi[x] = sin(phi);
+	}
+
+	vector<array<double, 27>> partial(threads);
+
+	auto worker = [&](GLint id) {
+
+		array<double, 27>& sums = partial[id];
+		sums.fill(0.0);
+
+		for (GLint y = height * id / threads; y < height * (id + 1) / threads; y++) {
+
+			GLfloat theta = 3.14159265f * (y + 0.5f) / height;
+			GLfloat sinTheta = sin(theta), cosTheta = cos(theta);
+			GLfloat solidAngle = (2.0f * 3.14159265f / width) * (3.14159265f / height) * sinTheta;
+			const GLfloat* row[3] = { &planes[(size_t)y * width], &planes[texels + (size_t)y * width], &planes[2 * texels + (size_t)y * width] };
+
+			__m128 accumulators[27];
+			for (GLint k = 0; k < 27; k++)
+				accumulators[k] = _mm_setzero_ps();
+
+			__m128 dirY = _mm_set1_ps(cosTheta), scaleXZ = _mm_set1_ps(sinTheta), weight = _mm_set1_ps(solidAngle);
+			GLint x = 0;
+
+			for (; x + 4 <= width; x += 4) {
+
+				__m128 dirX = _mm_mul_ps(scaleXZ, _mm_loadu_ps(&cosPhi[x]));
+				__m128 dirZ = _mm_mul_ps(scaleXZ, _mm_loadu_ps(&sinPhi[x]));
+
+				__m128 basis[9];
+				basis[0] = _mm_set1_ps(0.282095f);
+				basis[1] = _mm_mul_ps(_mm_set1_ps(0.488603f), dirY);
+				basis[2] = _mm_mul_ps(_mm_set1_ps(0.488603f), dirZ);
+				basis[3] = _mm_mul_ps(_mm_set1_ps(0.488603f), dirX);
+				basis[4] = _mm_mul_ps(_mm_set1_ps(1.092548f), _mm_mul_ps(dirX, dirY));
+				basis[5] = _mm_mul_ps(_mm_set1_ps(1.092548f), _mm_mul_ps(dirY, dirZ));
+				basis[6] = _mm_mul_ps(_mm_set1_ps(0.315392f), _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(3.0f), _mm_mul_ps(dirZ, dirZ)), _mm_set1_ps(1.0f)));
+				basis[7] = _mm_mul_ps(_mm_set1_ps(1.092548f), _mm_mul_ps(dirX, dirZ));
+				basis[8] = _mm_mul_ps(_mm_set1_ps(0.546274f), _mm_sub_ps(_mm_mul_ps(dirX, dirX), _mm_mul_ps(dirY, dirY)));
+
+				for (GLint c = 0; c < 3; c++) {
+					__m128 radiance = _mm_mul_ps(_mm_loadu_ps(row[c] + x), weight);
+					for (GLint k = 0; k < 9; k++)
+						accumulators[k * 3 + c] = _mm_add_ps(accumulators[k * 3 + c], _mm_mul_ps(radiance, basis[k]));
+				}
+			}
+
+			// Row totals are added in double, a large map sums millions of texels
+			for (GLint k = 0; k < 27; k++) {
+				alignas(16) GLfloat lanes[4];
+				_mm_store_ps(lanes, accumulators[k]);
+				sums[k] += (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+			}
+
+			// Columns left over from the groups of four
+			for (; x < width; x++) {
+				GLfloat dx = sinTheta * cosPhi[x], dy = cosTheta, dz = sinTheta * sinPhi[x];
+				GLfloat basis[9] = { 0.282095f, 0.488603f * dy, 0.488603f * dz, 0.488603f * dx,
+									 1.092548f * dx * dy, 1.092548f * dy * dz, 0.315392f * (3.0f * dz * dz - 1.0f),
+									 1.092548f * dx * dz, 0.546274f * (dx * dx - dy * dy) };
+				for (GLint c = 0; c < 3; c++)
+					for (GLint k = 0; k < 9; k++)
+						sums[k * 3 + c] += row[c][x] * solidAngle * basis[k];
+			}
+		}
+	};
+
+	vector<thread> pool;
+	for (GLint id = 1; id < threads; id++)
+		pool.push_back(thread(worker, id));
+	worker(0);
+	for (thread& t : pool)
+		t.join();
+
+	for (GLint k = 0; k < 27; k++) {
+		double total = 0.0;
+		for (const array<double, 27>& sums : partial)
+			total += sums[k];
+		sh[k / 3][k % 3] = total;
+	}
+
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// 64 bit FNV-1a hash of a file's bytes, false if it can't be read
+static bool HashFile(const char* path, unsigned long long& hash)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return false;
+
+	hash = 14695981039346656037ULL;
+	unsigned char buffer[1 << 16];
+	size_t count;
+	while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		for (size_t i = 0; i < count; i++)
+			hash = (hash ^ buffer[i]) * 1099511628211ULL;
+
+	fclose(file);
+	return true;
+}
+
+// Cache file of the SH coefficients of the environment map whose bytes hash to hash
+static string SHCachePath(unsigned long long hash)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "environment_%016llx.sh9", hash);
+	return name;
+}
+
+/* Reads cached coefficients, false if there are none for this hash */
+bool UReadSHCache(unsigned long long hash, glm::vec3 sh[9])
+{
+	FILE* file = fopen(SHCachePath(hash).c_str(), "rb");
+	if (!file)
+		return false;
+
+	SHCacheHeader header;
+	GLfloat coefficients[27];
+	bool valid = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, "SH9", 4) == 0
+		&& header.version == shCacheVersion && header.hash == hash
+		&& fread(coefficients, sizeof(coefficients), 1, file) == 1;
+	fclose(file);
+
+	if (valid)
+		for (GLint k = 0; k < 9; k++)
+			sh[k] = glm::vec3(coefficients[k * 3], coefficients[k * 3 + 1], coefficients[k * 3 + 2]);
+	return valid;
+}
+
+/* Stores the coefficients of a projected map under its hash */
+void UWriteSHCache(unsigned long long hash, const glm::vec3 sh[9])
+{
+	FILE* file = fopen(SHCachePath(hash).c_str(), "wb");
+	if (!file) {
+		cout<<"Cannot write "<<SHCachePath(hash)<<endl;
+		return;
+	}
+
+	SHCacheHeader header = { "SH9", shCacheVersion, hash };
+	GLfloat coefficients[27];
+	for (GLint k = 0; k < 9; k++)
+		for (GLint c = 0; c < 3; c++)
+			coefficients[k * 3 + c] = sh[k][c];
+
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(coefficients, sizeof(coefficients), 1, file);
+	fclose(file);
+}
+
+/* Gets the environment's SH coefficients from the cache or by projecting the map
+ * then prepares the irradiance coefficients the shaders evaluate.
+ */
+void ULoadEnvironment(void)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	GLint threads = pathTraceThreads > 0 ? pathTraceThreads : max(1u, thread::hardware_concurrency());
+
+	unsigned long long hash = 0;
+	bool fromFile = !environmentPath.empty() && HashFile(environmentPath.c_str(), hash);
+
+	if (!environmentPath.empty() && !fromFile)
+		cout<<environmentPath<<" not found, using the studio environment"<<endl;
+
+	if (fromFile && UReadSHCache(hash, environmentSH)) {
+
+		cout<<"SH9 of "<<environmentPath<<" read from "<<SHCachePath(hash)<<" in "
+			<<chrono::duration<double>(chrono::steady_clock::now() - start).count() * 1000.0<<" ms"<<endl;
+
+	} else {
+
+		vector<GLfloat> planes;
+		GLint width = 512, height = 256;
+
+		if (fromFile && !ULoadHDR(environmentPath.c_str(), width, height, planes)) {
+			cout<<environmentPath<<" is not a Radiance HDR image, using the studio environment"<<endl;
+			fromFile = false;
+			width = 512;
+			height = 256;
+		}
+		if (!fromFile)
+			StudioEnvironment(width, height, planes);
+
+		double decodeSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		double projectSeconds = UProjectSH(planes, width, height, threads, environmentSH);
+
+		cout<<"Projected the "<<width<<"x"<<height<<" environment onto SH9 in "<<projectSeconds * 1000.0
+			<<" ms on "<<threads<<" threads ("<<decodeSeconds * 1000.0<<" ms decoding)"<<endl;
+
+		if (fromFile)
+			UWriteSHCache(hash, environmentSH);
+	}
+
+	// Convolving with the clamped cosine scales the bands by 1, 2/3 and 1/4 once divided by pi
+	const GLfloat bands[9] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+
+	// The map's average brightness is matched to the flat ambient term, it only adds direction and color
+	const GLfloat ambientStrength = 0.1f;
+	glm::vec3 flatAmbient = ambientStrength * (keyLightColor + fillLightColor);
+	glm::vec3 averageRadiance = environmentSH[0] * 0.282095f;
+	GLfloat averageLuminance = glm::dot(averageRadiance, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+	environmentScale = averageLuminance > 0.0f ? glm::dot(flatAmbient, glm::vec3(0.2126f, 0.7152f, 0.0722f)) / averageLuminance : 0.0f;
+
+	for (GLint k = 0; k < 9; k++)
+		environmentIrradianceSH[k] = environmentSH[k] * (bands[k] * environmentScale);
+
+	environmentLoaded = true;
+}
+
+// Value of the 9 SH functions with coefficients sh in direction n
+static glm::vec3 EvaluateSH(const glm::vec3 sh[9], const glm::vec3& n)
+{
+	return sh[0] * 0.282095f
+		 + (sh[1] * n.y + sh[2] * n.z + sh[3] * n.x) * 0.488603f
+		 + (sh[4] * (n.x * n.y) + sh[5] * (n.y * n.z) + sh[7] * (n.x * n.z)) * 1.092548f
+		 + sh[6] * (0.315392f * (3.0f * n.z * n.z - 1.0f))
+		 + sh[8] * (0.546274f * (n.x * n.x - n.y * n.y));
+}
+
+/* Ambient light on a surface facing normal, what the chair shader adds for the environment */
+glm::vec3 UEnvironmentAmbient(const glm::vec3& normal)
+{
+	return glm::max(EvaluateSH(environmentIrradianceSH, normal), glm::vec3(0.0f));
+}
+
+/* Ambient radiance arriving from direction, in the chair shader's units */
+glm::vec3 UEnvironmentRadiance(const glm::vec3& direction)
+{
+	return glm::max(EvaluateSH(environmentSH, direction) * environmentScale, glm::vec3(0.0f));
+}
+
+/* Passes the environment switch and coefficients to a chair program */
+void USetEnvironmentUniforms(GLuint program)
+{
+	glUniform1i(glGetUniformLocation(program, "environmentLighting"), environmentLighting);
+	glUniform3fv(glGetUniformLocation(program, "environmentSH"), 9, &environmentIrradianceSH[0].x);
+}
+
+/* SCENE FILES */
+
+// Rounds offset up to the next section boundary
+static unsigned long long AlignScene(unsigned long long offset)
+{
+	return (offset + sceneAlignment - 1) / sceneAlignment * sceneAlignment;
+}
+
+// Writes count elements of a section, starting at its element first
+static bool WriteSceneSection(FILE* file, const SceneSection& section, unsigned long long first, const void* data, size_t count)
+{
+	return fseek(file, (long)(section.offset + first * section.elementSize), SEEK_SET) == 0
+		&& fwrite(data, section.elementSize, count, file) == count;
+}
+
+// Writes the buffered chunk of every per object section
+static void FlushSceneWriter(SceneWriter& writer)
+{
+	size_t count = writer.positions.size();
+	if (count == 0)
+		return;
+
+	const void* chunks[] = { writer.positions.data(), writer.scales.data(), writer.meshes.data(), writer.materials.data() };
+	for (GLuint type = SectionPositions; type <= SectionMaterials; type++)
+		if (!WriteSceneSection(writer.file, writer.sections[type], writer.written, chunks[type], count))
+			writer.failed = true;
+
+	writer.written += count;
+	writer.positions.clear();
+	writer.scales.clear();
+	writer.meshes.clear();
+	writer.materials.clear();
+}
+
+/* Creates a scene file for objectCount objects. The per object sections are
+ * laid out up front, so every chunk goes straight to its place in the file.
+ */
+bool USceneWriterBegin(SceneWriter& writer, const char* path, unsigned long long objectCount)
+{
+	writer.file = fopen(path, "wb");
+	if (!writer.file) {
+		cout<<"Cannot write "<<path<<endl;
+		return false;
+	}
+
+	writer.objectCount = objectCount;
+	writer.written = 0;
+	writer.failed = false;
+
+	const GLuint elementSizes[SceneSectionCount] = { sizeof(glm::vec3), sizeof(glm::vec3), sizeof(GLuint), sizeof(GLuint),
+													 sizeof(SceneLight), sizeof(SceneCamera), 1, 1 };
+	unsigned long long offset = AlignScene(sizeof(SceneFileHeader) + sizeof(writer.sections));
+
+	// The sections after the per object ones are placed by USceneWriterEnd
+	for (GLuint type = 0; type < SceneSectionCount; type++) {
+		writer.sections[type] = { type, elementSizes[type], offset, 0 };
+		if (type <= SectionMaterials) {
+			writer.sections[type].count = objectCount;
+			offset = AlignScene(offset + objectCount * elementSizes[type]);
+		}
+	}
+
+	size_t chunk = (size_t)min<unsigned long long>(objectCount, sceneWriterChunk);
+	writer.positions.reserve(chunk);
+	writer.scales.reserve(chunk);
+	writer.meshes.reserve(chunk);
+	writer.materials.reserve(chunk);
+	return true;
+}
+
+/* Appends an object, mesh and material index the names USceneWriterEnd writes */
+void USceneWriterAdd(SceneWriter& writer, const glm::vec3& position, const glm::vec3& scale, GLuint mesh, GLuint material)
+{
+	if (writer.written + writer.positions.size() >= writer.objectCount) {
+		writer.failed = true;
+		return;
+	}
+
+	writer.positions.push_back(position);
+	writer.scales.push_back(scale);
+	writer.meshes.push_back(mesh);
+	writer.materials.push_back(material);
+
+	if (writer.positions.size() == sceneWriterChunk)
+		FlushSceneWriter(writer);
+}
+
+/* Writes the lights, camera and name tables from the current scene state, then
+ * the header. The header goes in last, so a file cut short is never valid.
+ */
+bool USceneWriterEnd(SceneWriter& writer)
+{
+	FlushSceneWriter(writer);
+	if (writer.written != writer.objectCount) {
+		cout<<"Scene writer was given "<<writer.written<<" of "<<writer.objectCount<<" objects"<<endl;
+		writer.failed = true;
+	}
+
+	SceneLight lights[2] = {
+		{ { keyLightPosition.x, keyLightPosition.y, keyLightPosition.z }, { keyLightColor.r, keyLightColor.g, keyLightColor.b } },
+		{ { fillLightPosition.x, fillLightPosition.y, fillLightPosition.z }, { fillLightColor.r, fillLightColor.g, fillLightColor.b } },
+	};
+	SceneCamera camera = { yaw, pitch, { front.x, front.y, front.z }, { cameraPosition.x, cameraPosition.y, cameraPosition.z },
+						   { scale_by_x, scale_by_y, scale_by_z }, fieldOfView };
+
+	// Every object is the chair mesh for now
+	string meshNames("chair", 6);
+	string materialNames;
+	for (const Material& material : materials)
+		materialNames.append(material.name, strlen(material.name) + 1);
+
+	const void* data[] = { lights, &camera, meshNames.data(), materialNames.data() };
+	size_t counts[] = { 2, 1, meshNames.size(), materialNames.size() };
+
+	const SceneSection& last = writer.sections[SectionMaterials];
+	unsigned long long offset = AlignScene(last.offset + last.count * last.elementSize);
+	unsigned long long fileSize = offset;
+
+	for (GLuint type = SectionLights; type < SceneSectionCount; type++) {
+		SceneSection& section = writer.sections[type];
+		section.offset = offset;
+		section.count = counts[type - SectionLights];
+		if (!WriteSceneSection(writer.file, section, 0, data[type - SectionLights], section.count))
+			writer.failed = true;
+		fileSize = offset + section.count * section.elementSize;
+		offset = AlignScene(fileSize);
+	}
+
+	SceneFileHeader header = { "3DCHAIR", sceneFileVersion, SceneSectionCount, writer.objectCount, fileSize };
+	if (fseek(writer.file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, writer.file) != 1
+		|| fwrite(writer.sections, sizeof(writer.sections), 1, writer.file) != 1)
+		writer.failed = true;
+
+	if (fclose(writer.file) != 0)
+		writer.failed = true;
+	writer.file = NULL;
+
+	return !writer.failed;
+}
+
+/* Saves the chairs, lights and camera */
+bool USaveScene(const char* path)
+{
+	SceneWriter writer;
+	if (!USceneWriterBegin(writer, path, sceneObjects.size()))
+		return false;
+
+	for (const SceneObject& object : sceneObjects)
+		USceneWriterAdd(writer, object.position, object.scale, 0, object.material);
+
+	return USceneWriterEnd(writer);
+}
+
+// A file mapped read only, or read into memory where there is no mmap
+struct FileMapping {
+	const unsigned char* data;
+	size_t size;
+};
+
+static FileMapping MapFile(const char* path)
+{
+	FileMapping mapping = { NULL, 0 };
+
+#ifdef _WIN32
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return mapping;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	unsigned char* data = (unsigned char*)malloc(max(1L, size));
+	if (data && fread(data, 1, size, file) == (size_t)size) {
+		mapping.data = data;
+		mapping.size = size;
+	} else {
+		free(data);
+	}
+	fclose(file);
+#else
+	int file = open(path, O_RDONLY);
+	if (file < 0)
+		return mapping;
+
+	struct stat status;
+	if (fstat(file, &status) == 0 && status.st_size > 0) {
+		void* data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (data != MAP_FAILED) {
+			mapping.data = (const unsigned char*)data;
+			mapping.size = status.st_size;
+		}
+	}
+	close(file);
+#endif
+
+	return mapping;
+}
+
+static void UnmapFile(FileMapping& mapping)
+{
+#ifdef _WIN32
+	free((void*)mapping.data);
+#else
+	munmap((void*)mapping.data, mapping.size);
+#endif
+	mapping.data = NULL;
+}
+
+// Indices into known of every name in a names section, 0 for names it doesn't have
+static vector<GLuint> ResolveSceneNames(const FileMapping& mapping, const SceneSection* section, const vector<string>& known, const char* kind)
+{
+	vector<GLuint> indices;
+	if (!section)
+		return indices;
+
+	const char* name = (const char*)mapping.data + section->offset;
+	const char* end = name + section->count;
+	while (name < end) {
+		size_t length = strnlen(name, end - name);
+		string value(name, length);
+		GLuint index = find(known.begin(), known.end(), value) - known.begin();
+		if (index == known.size()) {
+			cout<<"Unknown "<<kind<<" "<<value<<", using "<<known[0]<<endl;
+			index = 0;
+		}
+		indices.push_back(index);
+		name += length + 1;
+	}
+	return indices;
+}
+
+/* Replaces the chairs, lights and camera with the ones in a scene file. The
+ * sections are read straight from the mapped file, with no parsing or
+ * intermediate buffers, and copied into sceneObjects and the light and camera
+ * globals. Sections a scene doesn't have keep their defaults.
+ */
+bool ULoadScene(const char* path)
+{
+	FileMapping mapping = MapFile(path);
+	if (!mapping.data) {
+		cout<<"Cannot read "<<path<<endl;
+		return false;
+	}
+
+	const SceneFileHeader* header = (const SceneFileHeader*)mapping.data;
+	const SceneSection* table = (const SceneSection*)(mapping.data + sizeof(SceneFileHeader));
+
+	if (mapping.size < sizeof(SceneFileHeader) || memcmp(header->magic, "3DCHAIR", 8) != 0) {
+		cout<<path<<" is not a scene file"<<endl;
+		UnmapFile(mapping);
+		return false;
+	}
+	if (header->version > sceneFileVersion) {
+		cout<<path<<" is a version "<<header->version<<" scene, this program reads up to version "<<sceneFileVersion<<endl;
+		UnmapFile(mapping);
+		return false;
+	}
+
+	bool valid = header->fileSize <= mapping.size
+		&& header->sectionCount <= (mapping.size - sizeof(SceneFileHeader)) / sizeof(SceneSection);
+
+	// Sections by type, types added by later versions are skipped
+	const GLuint elementSizes[SceneSectionCount] = { sizeof(glm::vec3), sizeof(glm::vec3), sizeof(GLuint), sizeof(GLuint),
+													 sizeof(SceneLight), sizeof(SceneCamera), 1, 1 };
+	const SceneSection* sections[SceneSectionCount] = {};
+
+	for (GLuint i = 0; valid && i < header->sectionCount; i++) {
+		const SceneSection& section = table[i];
+		if (section.type >= SceneSectionCount)
+			continue;
+
+		valid = section.elementSize == elementSizes[section.type] && section.offset % sceneAlignment == 0
+			&& section.offset <= mapping.size && section.count <= (mapping.size - section.offset) / section.elementSize
+			&& (section.type > SectionMaterials || section.count == header->objectCount);
+		sections[section.type] = &section;
+	}
+
+	if (!valid || !sections[SectionPositions]) {
+		cout<<path<<" is damaged"<<endl;
+		UnmapFile(mapping);
+		return false;
+	}
+
+	vector<string> meshNames = { "chair" };
+	vector<string> materialNames;
+	for (const Material& material : materials)
+		materialNames.push_back(material.name);
+
+	vector<GLuint> meshIndices = ResolveSceneNames(mapping, sections[SectionMeshNames], meshNames, "mesh");
+	vector<GLuint> materialIndices = ResolveSceneNames(mapping, sections[SectionMaterialNames], materialNames, "material");
+
+	const glm::vec3* positions = (const glm::vec3*)(mapping.data + sections[SectionPositions]->offset);
+	const glm::vec3* scales = sections[SectionScales] ? (const glm::vec3*)(mapping.data + sections[SectionScales]->offset) : NULL;
+	const GLuint* meshes = sections[SectionMeshes] ? (const GLuint*)(mapping.data + sections[SectionMeshes]->offset) : NULL;
+	const GLuint* objectMaterials = sections[SectionMaterials] ? (const GLuint*)(mapping.data + sections[SectionMaterials]->offset) : NULL;
+
+	size_t count = header->objectCount;
+	size_t otherMeshes = 0;
+	sceneObjects.resize(count);
+
+	for (size_t i = 0; i < count; i++) {
+		GLuint material = objectMaterials && objectMaterials[i] < materialIndices.size() ? materialIndices[objectMaterials[i]] : 0;
+		sceneObjects[i] = { positions[i], scales ? scales[i] : chairScale, 0, (GLint)material, false };
+
+		// Only the chair mesh exists, objects of other meshes are drawn as chairs
+		if (meshes && (meshes[i] >= meshIndices.size() || meshIndices[meshes[i]] != 0))
+			otherMeshes++;
+	}
+
+	if (otherMeshes > 0)
+		cout<<otherMeshes<<" objects in "<<path<<" use meshes this program doesn't have, they are drawn as chairs"<<endl;
+
+	if (sections[SectionLights] && sections[SectionLights]->count >= 2) {
+		const SceneLight* lights = (const SceneLight*)(mapping.data + sections[SectionLights]->offset);
+		keyLightPosition = glm::vec3(lights[0].position[0], lights[0].position[1], lights[0].position[2]);
+		keyLightColor = glm::vec3(lights[0].color[0], lights[0].color[1], lights[0].color[2]);
+		fillLightPosition = glm::vec3(lights[1].position[0], lights[1].position[1], lights[1].position[2]);
+		fillLightColor = glm::vec3(lights[1].color[0], lights[1].color[1], lights[1].color[2]);
+	}
+
+	if (sections[SectionCamera] && sections[SectionCamera]->count >= 1) {
+		const SceneCamera& camera = *(const SceneCamera*)(mapping.data + sections[SectionCamera]->offset);
+		yaw = camera.yaw;
+		pitch = camera.pitch;
+		front = glm::vec3(camera.front[0], camera.front[1], camera.front[2]);
+		cameraPosition = glm::vec3(camera.position[0], camera.position[1], camera.position[2]);
+		scale_by_x = camera.scale[0];
+		scale_by_y = camera.scale[1];
+		scale_by_z = camera.scale[2];
+		fieldOfView = camera.fieldOfView;
+	}
+
+	UnmapFile(mapping);
+	return true;
+}
+
+/* Saves the scene as JSON, the same content as USaveScene */
+bool USaveSceneJSON(const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if (!file) {
+		cout<<"Cannot write "<<path<<endl;
+		return false;
+	}
+
+	fprintf(file, "{\n\"version\": %u,\n", sceneFileVersion);
+	fprintf(file, "\"camera\": {\"yaw\": %.9g, \"pitch\": %.9g, \"front\": [%.9g, %.9g, %.9g], \"position\": [%.9g, %.9g, %.9g], "
+			"\"scale\": [%.9g, %.9g, %.9g], \"fieldOfView\": %.9g},\n", yaw, pitch, front.x, front.y, front.z,
+			cameraPosition.x, cameraPosition.y, cameraPosition.z, scale_by_x, scale_by_y, scale_by_z, fieldOfView);
+	fprintf(file, "\"lights\": [\n{\"position\": [%.9g, %.9g, %.9g], \"color\": [%.9g, %.9g, %.9g]},\n"
+			"{\"position\": [%.9g, %.9g, %.9g], \"color\": [%.9g, %.9g, %.9g]}\n],\n",
+			keyLightPosition.x, keyLightPosition.y, keyLightPosition.z, keyLightColor.r, keyLightColor.g, keyLightColor.b,
+			fillLightPosition.x, fillLightPosition.y, fillLightPosition.z, fillLightColor.r, fillLightColor.g, fillLightColor.b);
+	fprintf(file, "\"objects\": [\n");
+
+	for (size_t i = 0; i < sceneObjects.size(); i++) {
+		const SceneObject& object = sceneObjects[i];
+		fprintf(file, "{\"mesh\": \"chair\", \"material\": \"%s\", \"position\": [%.9g, %.9g, %.9g], \"scale\": [%.9g, %.9g, %.9g]}%s\n",
+				materials[object.material].name, object.position.x, object.position.y, object.position.z,
+				object.scale.x, object.scale.y, object.scale.z, i + 1 < sceneObjects.size() ? "," : "");
+	}
+
+	fprintf(file, "]\n}\n");
+	return fclose(file) == 0;
+}
+
+// Cursor over a JSON document, it stops at the first unexpected character
+struct JSONReader {
+	const char* p;
+	bool failed;
+};
+
+static void JSONSpace(JSONReader& reader)
+{
+	while (*reader.p == ' ' || *reader.p == '\n' || *reader.p == '\r' || *reader.p == '\t')
+		reader.p++;
+}
+
+// Consumes c if it is the next character after white space
+static bool JSONNext(JSONReader& reader, char c)
+{
+	JSONSpace(reader);
+	if (*reader.p != c)
+		return false;
+	reader.p++;
+	return true;
+}
+
+static void JSONExpect(JSONReader& reader, char c)
+{
+	if (!reader.failed && !JSONNext(reader, c))
+		reader.failed = true;
+}
+
+// Reads a string, escapes are kept as written, none of the names need them
+static string JSONString(JSONReader& reader)
+{
+	JSONExpect(reader, '"');
+	const char* start = reader.p;
+	while (!reader.failed && *reader.p != '"') {
+		if (*reader.p == '\0')
+			reader.failed = true;
+		else
+			reader.p += *reader.p == '\\' && reader.p[1] ? 2 : 1;
+	}
+	string value(start, reader.failed ? 0 : reader.p - start);
+	if (!reader.failed)
+		reader.p++;
+	return value;
+}
+
+static double JSONNumber(JSONReader& reader)
+{
+	JSONSpace(reader);
+	char* end;
+	double value = strtod(reader.p, &end);
+	if (end == reader.p)
+		reader.failed = true;
+	reader.p = end;
+	return value;
+}
+
+// Reads a fixed size array of numbers
+static void JSONFloats(JSONReader& reader, GLfloat* values, GLint count)
+{
+	JSONExpect(reader, '[');
+	for (GLint i = 0; i < count; i++) {
+		if (i > 0)
+			JSONExpect(reader, ',');
+		values[i] = JSONNumber(reader);
+	}
+	JSONExpect(reader, ']');
+}
+
+// Moves to the next member of an object or element of an array, false at its closing bracket
+static bool JSONMore(JSONReader& reader, char close, bool first)
+{
+	if (reader.failed || JSONNext(reader, close))
+		return false;
+	if (!first)
+		JSONExpect(reader, ',');
+	return !reader.failed;
+}
+
+// Reads the key of the next member of an object, false at its closing brace
+static bool JSONKey(JSONReader& reader, string& key, bool first)
+{
+	if (!JSONMore(reader, '}', first))
+		return false;
+	key = JSONString(reader);
+	JSONExpect(reader, ':');
+	return !reader.failed;
+}
+
+// Skips a value of any type
+static void JSONSkip(JSONReader& reader)
+{
+	string key;
+	if (JSONNext(reader, '{')) {
+		for (bool first = true; JSONKey(reader, key, first); first = false)
+			JSONSkip(reader);
+	} else if (JSONNext(reader, '[')) {
+		for (bool first = true; JSONMore(reader, ']', first); first = false)
+			JSONSkip(reader);
+	} else if (JSONSpace(reader), *reader.p == '"') {
+		JSONString(reader);
+	} else if (strncmp(reader.p, "true", 4) == 0 || strncmp(reader.p, "null", 4) == 0) {
+		reader.p += 4;
+	} else if (strncmp(reader.p, "false", 5) == 0) {
+		reader.p += 5;
+	} else {
+		JSONNumber(reader);
+	}
+}
+
+/* Scene files ending in .json are read and written as JSON */
+bool UIsJSONScene(const string& path)
+{
+	return path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+}
+
+/* Replaces the chairs, lights and camera with the ones in a JSON scene */
+bool ULoadSceneJSON(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file) {
+		cout<<"Cannot read "<<path<<endl;
+		return false;
+	}
+
+	string text;
+	fseek(file, 0, SEEK_END);
+	text.resize(max(0L, ftell(file)));
+	fseek(file, 0, SEEK_SET);
+	bool read = fread(&text[0], 1, text.size(), file) == text.size();
+	fclose(file);
+	if (!read) {
+		cout<<"Cannot read "<<path<<endl;
+		return false;
+	}
+
+	map<string, GLint> materialIndices;
+	for (size_t i = 0; i < materials.size(); i++)
+		materialIndices[materials[i].name] = i;
+
+	JSONReader reader = { text.c_str(), false };
+	vector<SceneObject> objects;
+	vector<SceneLight> lights;
+	// Members the file leaves out keep the current camera's values
+	SceneCamera camera = { yaw, pitch, { front.x, front.y, front.z }, { cameraPosition.x, cameraPosition.y, cameraPosition.z },
+						   { scale_by_x, scale_by_y, scale_by_z }, fieldOfView };
+	bool hasCamera = false;
+	string key, value;
+
+	JSONExpect(reader, '{');
+	for (bool first = true; JSONKey(reader, key, first); first = false) {
+
+		if (key == "camera") {
+			hasCamera = true;
+			JSONExpect(reader, '{');
+			for (bool firstMember = true; JSONKey(reader, key, firstMember); firstMember = false) {
+				if (key == "yaw")
+					camera.yaw = JSONNumber(reader);
+				else if (key == "pitch")
+					camera.pitch = JSONNumber(reader);
+				else if (key == "front")
+					JSONFloats(reader, camera.front, 3);
+				else if (key == "position")
+					JSONFloats(reader, camera.position, 3);
+				else if (key == "scale")
+					JSONFloats(reader, camera.scale, 3);
+				else if (key == "fieldOfView")
+					camera.fieldOfView = JSONNumber(reader);
+				else
+					JSONSkip(reader);
+			}
+
+		} else if (key == "lights") {
+			JSONExpect(reader, '[');
+			for (bool firstLight = true; JSONMore(reader, ']', firstLight); firstLight = false) {
+				SceneLight light = {};
+				JSONExpect(reader, '{');
+				for (bool firstMember = true; JSONKey(reader, key, firstMember); firstMember = false) {
+					if (key == "position")
+						JSONFloats(reader, light.position, 3);
+					else if (key == "color")
+						JSONFloats(reader, light.color, 3);
+					else
+						JSONSkip(reader);
+				}
+				lights.push_back(light);
+			}
+
+		} else if (key == "objects") {
+			JSONExpect(reader, '[');
+			for (bool firstObject = true; JSONMore(reader, ']', firstObject); firstObject = false) {
+				SceneObject object = { glm::vec3(0.0f), chairScale, 0, 0, false };
+				JSONExpect(reader, '{');
+				for (bool firstMember = true; JSONKey(reader, key, firstMember); firstMember = false) {
+					if (key == "position") {
+						JSONFloats(reader, &object.position.x, 3);
+					} else if (key == "scale") {
+						JSONFloats(reader, &object.scale.x, 3);
+					} else if (key == "material") {
+						value = JSONString(reader);
+						map<string, GLint>::iterator material = materialIndices.find(value);
+						object.material = material != materialIndices.end() ? material->second : 0;
+					} else {
+						JSONSkip(reader);
+					}
+				}
+				objects.push_back(object);
+			}
+
+		} else {
+			JSONSkip(reader);
+		}
+	}
+
+	if (reader.failed) {
+		cout<<path<<" is not a valid scene at byte "<<reader.p - text.c_str()<<endl;
+		return false;
+	}
+
+	sceneObjects.swap(objects);
+
+	if (lights.size() >= 2) {
+		keyLightPosition = glm::vec3(lights[0].position[0], lights[0].position[1], lights[0].position[2]);
+		keyLightColor = glm::vec3(lights[0].color[0], lights[0].color[1], lights[0].color[2]);
+		fillLightPosition = glm::vec3(lights[1].position[0], lights[1].position[1], lights[1].position[2]);
+		fillLightColor = glm::vec3(lights[1].color[0], lights[1].color[1], lights[1].color[2]);
+	}
+
+	if (hasCamera) {
+		yaw = camera.yaw;
+		pitch = camera.pitch;
+		front = glm::vec3(camera.front[0], camera.front[1], camera.front[2]);
+		cameraPosition = glm::vec3(camera.position[0], camera.position[1], camera.position[2]);
+		scale_by_x = camera.scale[0];
+		scale_by_y = camera.scale[1];
+		scale_by_z = camera.scale[2];
+		fieldOfView = camera.fieldOfView;
+	}
+
+	return true;
+}
+
+/* Times saving and loading a showroom of sceneBenchmarkObjects chairs as a
+ * binary scene and as JSON, and checks both load back the same chairs.
+ */
+int UBenchmarkSceneFiles(void)
+{
+	const char* binaryPath = "scene_benchmark.scene";
+	const char* jsonPath = "scene_benchmark.json";
+	const GLint runs = 5;
+
+	// A square showroom with alternating finishes
+	GLint count = sceneBenchmarkObjects;
+	GLint side = (GLint)ceil(sqrt((double)count));
+	sceneObjects.clear();
+	for (GLint i = 0; i < count; i++) {
+		glm::vec3 offset((i % side) * showroomSpacing, 0.0f, -(i / side) * showroomSpacing);
+		sceneObjects.push_back({chairPosition + offset, chairScale * (1.0f + 0.001f * (i % 7)), 0, (GLint)(i % materials.size()), false});
+	}
+	vector<SceneObject> expected = sceneObjects;
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	bool saved = USaveScene(binaryPath);
+	double binarySave = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	start = chrono::steady_clock::now();
+	saved = USaveSceneJSON(jsonPath) && saved;
+	double jsonSave = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	if (!saved)
+		return EXIT_FAILURE;
+
+	// Best of several loads, each one replaces the scene
+	double binaryLoad = 1e30, jsonLoad = 1e30;
+	bool matches = true;
+
+	for (GLint run = 0; run < runs; run++) {
+		for (GLint format = 0; format < 2; format++) {
+			sceneObjects.clear();
+			start = chrono::steady_clock::now();
+			bool loaded = format == 0 ? ULoadScene(binaryPath) : ULoadSceneJSON(jsonPath);
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+			double& best = format == 0 ? binaryLoad : jsonLoad;
+			best = min(best, seconds);
+
+			matches = matches && loaded && sceneObjects.size() == expected.size();
+			for (size_t i = 0; matches && i < expected.size(); i++)
+				matches = sceneObjects[i].position == expected[i].position && sceneObjects[i].scale == expected[i].scale
+					&& sceneObjects[i].material == expected[i].material;
+		}
+	}
+
+	FILE* file;
+	long binaryBytes = 0, jsonBytes = 0;
+	if ((file = fopen(binaryPath, "rb"))) {
+		fseek(file, 0, SEEK_END);
+		binaryBytes = ftell(file);
+		fclose(file);
+	}
+	if ((file = fopen(jsonPath, "rb"))) {
+		fseek(file, 0, SEEK_END);
+		jsonBytes = ftell(file);
+		fclose(file);
+	}
+	remove(binaryPath);
+	remove(jsonPath);
+
+	cout<<"Scene files with "<<count<<" objects, best of "<<runs<<" loads"<<endl;
+	cout<<"  binary: "<<binaryBytes / (1024.0 * 1024.0)<<" MB, saved in "<<binarySave * 1000.0<<" ms, loaded in "
+		<<binaryLoad * 1000.0<<" ms"<<endl;
+	cout<<"  JSON:   "<<jsonBytes / (1024.0 * 1024.0)<<" MB, saved in "<<jsonSave * 1000.0<<" ms, loaded in "
+		<<jsonLoad * 1000.0<<" ms"<<endl;
+	cout<<"  binary loads "<<jsonLoad / binaryLoad<<"x faster"<<endl;
+
+	if (!matches) {
+		cout<<"The loaded scenes don't match the saved one"<<endl;
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
+
+/* JOB SYSTEM */
+
+// Seconds since the program started
+static double ProgramSeconds(chrono::steady_clock::time_point time)
+{
+	return chrono::duration<double>(time - programStart).count();
+}
+
+/* Adds a trace entry and returns its index. A job comes after its dependency
+ * with the longest chain of work. A step of the GL thread also comes after
+ * its previous step, a wait after the job it waited for.
+ */
+static GLint RecordTrace(const string& name, chrono::steady_clock::time_point start, chrono::steady_clock::time_point end,
+						 GLint dependency, bool step, bool wait)
+{
+	lock_guard<mutex> guard(jobTraceLock);
+
+	GLint after = dependency;
+	if (step && jobTraceLastStep >= 0 && (after < 0 || jobTrace[jobTraceLastStep].pathWork > jobTrace[after].pathWork))
+		after = jobTraceLastStep;
+
+	double work = wait ? 0.0 : chrono::duration<double>(end - start).count();
+	double pathWork = (after >= 0 ? jobTrace[after].pathWork : 0.0) + work;
+	GLint thread = jobWorkerIndex >= 0 ? jobWorkerIndex : jobWorkers.size();
+	jobTrace.push_back({ name, thread, ProgramSeconds(start), ProgramSeconds(end), after, wait, pathWork });
+
+	if (step)
+		jobTraceLastStep = jobTrace.size() - 1;
+	return jobTrace.size() - 1;
+}
+
+static void PushJob(const JobHandle& job);
+
+// Keeps the finished dependency with the longest chain of work for the trace
+static void NoteDependency(const JobHandle& job, const JobHandle& dependency)
+{
+	if (dependency->traceIndex < 0)
+		return;
+
+	lock_guard<mutex> guard(job->lock);
+	lock_guard<mutex> trace(jobTraceLock);
+	GLint& critical = job->criticalDependency;
+	if (critical < 0 || jobTrace[dependency->traceIndex].pathWork > jobTrace[critical].pathWork)
+		critical = dependency->traceIndex;
+}
+
+// Marks a job done and queues the jobs it was the last dependency of
+static void FinishJob(const JobHandle& job)
+{
+	vector<JobHandle> released;
+	{
+		lock_guard<mutex> guard(job->lock);
+		job->done = true;
+		released.swap(job->continuations);
+	}
+
+	for (const JobHandle& continuation : released) {
+		NoteDependency(continuation, job);
+		if (--continuation->pending == 0)
+			PushJob(continuation);
+	}
+
+	// Wakes the threads waiting for this job
+	{ lock_guard<mutex> guard(jobWakeLock); }
+	jobWake.notify_all();
+}
+
+static void RunJob(const JobHandle& job)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	bool nested = jobRunning;
+	jobRunning = true;
+	job->work();
+	jobRunning = nested;
+
+	if (jobTracing)
+		job->traceIndex = RecordTrace(job->name, start, chrono::steady_clock::now(), job->criticalDependency, false, false);
+	FinishJob(job);
+}
+
+static void PushJob(const JobHandle& job)
+{
+	if (jobQueues.empty()) {
+		RunJob(job);
+		return;
+	}
+
+	JobQueue& queue = jobQueues[jobWorkerIndex >= 0 ? jobWorkerIndex : jobQueues.size() - 1];
+	{
+		lock_guard<mutex> guard(queue.lock);
+		queue.jobs.push_back(job);
+	}
+	jobsQueued++;
+
+	// Taking the lock orders the push against a worker about to sleep
+	{ lock_guard<mutex> guard(jobWakeLock); }
+	jobWake.notify_one();
+}
+
+// Runs one ready job, own queue first, then stolen from the others, false if there were none
+static bool RunOneJob(void)
+{
+	GLint queues = jobQueues.size();
+	GLint own = jobWorkerIndex >= 0 ? jobWorkerIndex : queues - 1;
+	JobHandle job;
+
+	for (GLint k = 0; k < queues && !job; k++) {
+		JobQueue& queue = jobQueues[(own + k) % queues];
+		lock_guard<mutex> guard(queue.lock);
+		if (queue.jobs.empty())
+			continue;
+		if (k == 0) {
+			job = queue.jobs.back();
+			queue.jobs.pop_back();
+		} else {
+			job = queue.jobs.front();
+			queue.jobs.pop_front();
+		}
+	}
+
+	if (!job)
+		return false;
+
+	jobsQueued--;
+	RunJob(job);
+	return true;
+}
+
+static void JobWorker(GLint index)
+{
+	jobWorkerIndex = index;
+
+	for (;;) {
+		if (RunOneJob())
+			continue;
+
+		unique_lock<mutex> lock(jobWakeLock);
+		jobWake.wait(lock, [] { return jobsQueued > 0 || jobStopping; });
+		if (jobStopping && jobsQueued == 0)
+			return;
+	}
+}
+
+/* Starts the worker threads, they live until the program exits */
+void UStartJobSystem(GLint workers)
+{
+	jobQueues = vector<JobQueue>(workers + 1);
+	for (GLint index = 0; index < workers; index++)
+		jobWorkers.push_back(thread(JobWorker, index));
+	atexit(UStopJobSystem);
+}
+
+void UStopJobSystem(void)
+{
+	jobStopping = true;
+	{ lock_guard<mutex> guard(jobWakeLock); }
+	jobWake.notify_all();
+
+	for (thread& worker : jobWorkers)
+		worker.join();
+	jobWorkers.clear();
+	jobQueues.clear();
+}
+
+/* Makes a job that runs once it's submitted and its dependencies have finished */
+JobHandle UCreateJob(const char* name, function<void()> work)
+{
+	JobHandle job = make_shared<Job>();
+	job->name = name;
+	job->work = move(work);
+	job->pending = 1;
+	job->done = false;
+	job->criticalDependency = -1;
+	job->traceIndex = -1;
+	return job;
+}
+
+/* Makes job wait for dependency, only before job is submitted */
+void UAddDependency(const JobHandle& job, const JobHandle& dependency)
+{
+	unique_lock<mutex> guard(dependency->lock);
+	if (dependency->done) {
+		guard.unlock();
+		NoteDependency(job, dependency);
+		return;
+	}
+	job->pending++;
+	dependency->continuations.push_back(job);
+}
+
+void USubmitJob(const JobHandle& job)
+{
+	if (--job->pending == 0)
+		PushJob(job);
+}
+
+/* Creates and submits a job in one go */
+JobHandle URunJob(const char* name, function<void()> work, const vector<JobHandle>& dependencies)
+{
+	JobHandle job = UCreateJob(name, move(work));
+	for (const JobHandle& dependency : dependencies)
+		if (dependency)
+			UAddDependency(job, dependency);
+	USubmitJob(job);
+	return job;
+}
+
+/* Returns once job has finished, running other jobs until then */
+void UWaitJob(const JobHandle& job)
+{
+	if (!job)
+		return;
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	while (!job->done) {
+		if (RunOneJob())
+			continue;
+
+		unique_lock<mutex> lock(jobWakeLock);
+		jobWake.wait(lock, [&] { return job->done || jobsQueued > 0; });
+	}
+
+	// The GL thread's steps come after the jobs it waited for, even ones already done
+	if (jobTracing && jobWorkerIndex < 0 && !jobRunning)
+		RecordTrace(string("wait for ") + job->name, start, chrono::steady_clock::now(), job->traceIndex, true, true);
+}
+
+/* Calls body on consecutive ranges that together cover 0 to count, in parallel.
+ * Without a grain the range is cut into four chunks per thread, so threads that
+ * finish early take over the rest. Returns once every chunk has run.
+ */
+void UParallelFor(GLint count, const function<void(GLint, GLint)>& body, GLint grain)
+{
+	GLint threads = jobWorkers.size() + 1;
+	if (grain <= 0)
+		grain = max(1, count / (threads * 4));
+
+	if (threads == 1 || count <= grain) {
+		if (count > 0)
+			body(0, count);
+		return;
+	}
+
+	JobHandle all = UCreateJob("parallel for", [] {});
+	for (GLint begin = 0; begin < count; begin += grain) {
+		GLint end = min(count, begin + grain);
+		JobHandle chunk = UCreateJob("parallel for chunk", [&body, begin, end] { body(begin, end); });
+		UAddDependency(all, chunk);
+		USubmitJob(chunk);
+	}
+	USubmitJob(all);
+	UWaitJob(all);
+}
+
+/* Records a startup step of the GL thread that began at start and ends now */
+void UTraceStep(const char* name, chrono::steady_clock::time_point start)
+{
+	if (jobTracing)
+		RecordTrace(name, start, chrono::steady_clock::now(), -1, true, false);
+}
+
+/* Starts the CPU side of startup on the job system, decoding the material
+ * images, building the chair's geometry, placing the scene and lighting it.
+ * The GL thread creates the context meanwhile and waits for each job only
+ * before uploading what it made. Shader sources are string constants, so
+ * compiling them is all the GL thread has to do there.
+ */
+void UStartupJobs(void)
+{
+	jobTracing = true;
+
+	// Material images, only sized when the mips are streamed
+	startupImages.assign(materials.size(), { NULL, 0, 0 });
+	materialsJob = UCreateJob("materials", [] {});
+	for (size_t m = 0; m < materials.size(); m++) {
+		JobHandle decode = UCreateJob(materials[m].file, [m] {
+			StartupImage& image = startupImages[m];
+			if (!mipStreaming)
+				image.pixels = ULoadMaterialImage(materials[m], image.width, image.height);
+			else if (!UReadImageSize(materials[m].file, image.width, image.height))
+				image.width = image.height = fallbackTextureSize;
+		});
+		UAddDependency(materialsJob, decode);
+		USubmitJob(decode);
+	}
+	USubmitJob(materialsJob);
+
+	// Picking hierarchy, LOD chain and the lightmap charts of every LOD
+	JobHandle meshBVH = URunJob("chair BVH", [] { UBuildMeshBVH(chairVertices, chairVertexCount, 8, chairBVH); });
+	JobHandle lodChain = URunJob("LOD chain", [] { UBuildLODChain(chairVertices, chairVertexCount, chairLODVertices); });
+	geometryJob = URunJob("lightmap charts", UBuildLightmapCharts, { lodChain });
+
+	// The scene hierarchy is built from the chair's, a loaded scene may bring its own lights
+	sceneJob = URunJob("scene", UCreateScene, { meshBVH });
+	if (environmentLighting)
+		sceneJob = URunJob("environment", ULoadEnvironment, { sceneJob });
+	if (lightmapEnabled)
+		lightingJob = URunJob("bake lighting", UBakeLighting, { sceneJob, geometryJob });
+}
+
+/* Prints how long startup took, the work it did and its critical path, the
+ * longest chain of work through the jobs and the GL thread's steps, which no
+ * number of threads can shorten. Stops tracing.
+ */
+void UReportStartup(void)
+{
+	double startup = ProgramSeconds(chrono::steady_clock::now());
+
+	lock_guard<mutex> guard(jobTraceLock);
+	jobTracing = false;
+
+	// Waits are left out, the time went into the job that was waited for
+	double work = 0.0;
+	for (const JobTraceEntry& entry : jobTrace)
+		if (!entry.wait)
+			work += entry.end - entry.start;
+
+	vector<GLint> path;
+	for (GLint e = jobTraceLastStep; e >= 0; e = jobTrace[e].after)
+		path.push_back(e);
+	reverse(path.begin(), path.end());
+	double pathWork = path.empty() ? 0.0 : jobTrace[path.back()].pathWork;
+
+	cout<<"Startup took "<<startup * 1000.0<<" ms with "<<jobWorkers.size()<<" job threads, "
+		<<work * 1000.0<<" ms of work"<<endl;
+	cout<<"  critical path "<<pathWork * 1000.0<<" ms:";
+	for (GLint e : path)
+		if (!jobTrace[e].wait)
+			cout<<" > "<<jobTrace[e].name<<" "<<(jobTrace[e].end - jobTrace[e].start) * 1000.0<<" ms";
+	cout<<endl;
+
+	// Startup can't be shorter than the critical path, nor than the work spread over every core
+	for (GLint cores : { 4, 8, 16 })
+		cout<<"  at best "<<max(pathWork, work / cores) * 1000.0<<" ms on "<<cores<<" cores"<<endl;
+
+	if (!jobTracePath.empty() && UWriteJobTrace(jobTracePath.c_str()))
+		cout<<"  trace written to "<<jobTracePath<<endl;
+}
+
+/* Writes the startup trace in Chrome's trace event format, critical steps are marked */
+bool UWriteJobTrace(const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if (!file) {
+		cout<<"Cannot write "<<path<<endl;
+		return false;
+	}
+
+	vector<bool> critical(jobTrace.size(), false);
+	for (GLint e = jobTraceLastStep; e >= 0; e = jobTrace[e].after)
+		critical[e] = true;
+
+	fprintf(file, "{\"traceEvents\": [\n");
+	for (size_t t = 0; t <= jobWorkers.size(); t++)
+		fprintf(file, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %zu, \"args\": {\"name\": \"%s%s\"}},\n",
+				t, t == jobWorkers.size() ? "GL thread" : "job worker ", t == jobWorkers.size() ? "" : to_string(t).c_str());
+
+	for (size_t e = 0; e < jobTrace.size(); e++) {
+		const JobTraceEntry& entry = jobTrace[e];
+		fprintf(file, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.1f, \"dur\": %.1f, "
+				"\"args\": {\"critical\": %s}}%s\n", entry.name.c_str(), entry.thread, entry.start * 1e6,
+				(entry.end - entry.start) * 1e6, critical[e] ? "true" : "false", e + 1 < jobTrace.size() ? "," : "");
+	}
+	fprintf(file, "]}\n");
+
+	return fclose(file) == 0;
+}
+
+/* LATENCY */
+
+/* Builds the perspective camera's view and projection */
+void UComputeCamera(glm::mat4& view, glm::mat4& projection)
+{
+	//Replaces camera forward vector with Radians normalized as a unit vector
+	CameraForwardZ = front;
+
+	// Transforms the camera
+	view = glm::mat4(1.0f);
+	view = glm::translate(view, cameraPosition);
+	view = glm::rotate(view, cameraRotation, glm::vec3(0.0f, 1.0f, 0.0f));
+	view = glm::lookAt(CameraForwardZ, cameraPosition, CameraUpY);
+
+	// Creates a perspective projection
+	projection = glm::perspective(fieldOfView, (GLfloat)windowWidth / (GLfloat)windowHeight, 0.1f, 100.0f);
+}
+
+/* Remembers when an input event arrived */
+void UTimestampInput(void)
+{
+	// Nothing latches input while no frames are drawn, the oldest events are dropped
+	if (pendingInputs.size() >= 256)
+		pendingInputs.erase(pendingInputs.begin());
+	pendingInputs.push_back(chrono::steady_clock::now());
+}
+
+/* The frame being drawn reflects every input event so far */
+void ULatchInput(void)
+{
+	if (!latencyFrameOpen)
+		return;
+
+	LatencyFrame& frame = latencyFrames[latencyFramesSubmitted % latencySlots];
+	frame.inputs.insert(frame.inputs.end(), pendingInputs.begin(), pendingInputs.end());
+	pendingInputs.clear();
+}
+
+/* Offset from the CPU clock to GL_TIMESTAMP, both in nanoseconds */
+static void CalibrateGPUClock(void)
+{
+	GLint64 gpuTime = 0;
+	glGetInteger64v(GL_TIMESTAMP, &gpuTime);
+	GLint64 cpuTime = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	gpuClockOffset = gpuTime - cpuTime;
+}
+
+/* Creates the timestamp queries and the camera uniform buffer */
+void UCreateLatencyObjects(void)
+{
+	for (GLint i = 0; i < latencySlots; i++) {
+		glGenQueries(1, &latencyFrames[i].query);
+		latencyFrames[i].fence = 0;
+	}
+
+	// Every slot starts on the uniform buffer offset alignment
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	cameraSlotBytes = (2 * sizeof(glm::mat4) + alignment - 1) / alignment * alignment;
+	GLsizeiptr bytes = (GLsizeiptr)cameraSlotBytes * latencySlots;
+
+	glGenBuffers(1, &cameraUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, cameraUBO);
+	if (GLEW_ARB_buffer_storage) {
+		// Stays mapped, writes reach the GPU without a call into the driver
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_UNIFORM_BUFFER, bytes, NULL, flags);
+		cameraMapping = (unsigned char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, bytes, flags);
+	} else {
+		glBufferData(GL_UNIFORM_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+	}
+	// The block is always backed, the shaders only read it while lateLatch is set
+	glBindBufferRange(GL_UNIFORM_BUFFER, cameraBlockBinding, cameraUBO, 0, 2 * sizeof(glm::mat4));
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	URegisterResource("camera matrices", ResourceBuffer, nullptr, cameraUBO, bytes);
+
+	CalibrateGPUClock();
+}
+
+/* Turns a finished frame's timestamps into latency samples */
+static void RetireLatencyFrame(LatencyFrame& frame)
+{
+	chrono::steady_clock::time_point fenceSeen = chrono::steady_clock::now();
+
+	// When the GPU got past the swap, on the CPU clock
+	GLuint64 gpuTime = 0;
+	glGetQueryObjectui64v(frame.query, GL_QUERY_RESULT, &gpuTime);
+	chrono::steady_clock::time_point gpuDone(chrono::duration_cast<chrono::steady_clock::duration>(
+		chrono::nanoseconds((GLint64)gpuTime - gpuClockOffset)));
+
+	for (const chrono::steady_clock::time_point& input : frame.inputs) {
+		inputToSubmit.push_back(chrono::duration<double, milli>(frame.swapTime - input).count());
+		inputToGPU.push_back(chrono::duration<double, milli>(gpuDone - input).count());
+		inputToFence.push_back(chrono::duration<double, milli>(fenceSeen - input).count());
+	}
+	frame.inputs.clear();
+
+	glDeleteSync(frame.fence);
+	frame.fence = 0;
+	latencyFramesRetired++;
+}
+
+/* Collects finished frames and holds the CPU back while too many are queued */
+void ULatencyBeginFrame(void)
+{
+	// Frames the GPU has already finished
+	while (latencyFramesRetired < latencyFramesSubmitted) {
+		LatencyFrame& frame = latencyFrames[latencyFramesRetired % latencySlots];
+		if (glClientWaitSync(frame.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+			break;
+		RetireLatencyFrame(frame);
+	}
+
+	// The ring also caps an unlimited queue, a slot is only reused once its frame is done
+	unsigned long limit = maxQueuedFrames > 0 ? min(maxQueuedFrames, latencySlots) : latencySlots;
+	chrono::steady_clock::time_point waitStart = chrono::steady_clock::now();
+	while (latencyFramesSubmitted - latencyFramesRetired >= limit) {
+		LatencyFrame& frame = latencyFrames[latencyFramesRetired % latencySlots];
+		if (glClientWaitSync(frame.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+			continue;
+		RetireLatencyFrame(frame);
+	}
+	queuedFrameWait += chrono::duration<double>(chrono::steady_clock::now() - waitStart).count();
+
+	latencyFrameOpen = true;
+}
+
+/* Timestamps the frame after the swap so its latency can be read back later */
+void ULatencyEndFrame(void)
+{
+	LatencyFrame& frame = latencyFrames[latencyFramesSubmitted % latencySlots];
+	frame.swapTime = chrono::steady_clock::now();
+	glQueryCounter(frame.query, GL_TIMESTAMP);
+	frame.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	latencyFramesSubmitted++;
+
+	latencyFrameOpen = false;
+	lateLatchThisFrame = false;
+}
+
+/* Processes the input that arrived while the frame was prepared and
+ * writes the newest camera into this frame's slot of the camera buffer
+ */
+void ULateLatchCamera(glm::mat4& view, glm::mat4& projection)
+{
+	// Runs the mouse handlers, keys and a redisplay they ask for wait for the next frame
+	lateLatchPumping = true;
+	glutMainLoopEvent();
+	lateLatchPumping = false;
+
+	UComputeCamera(view, projection);
+	lastView = view;
+	lastProjection = projection;
+	ULatchInput();
+
+	GLintptr offset = (GLintptr)cameraSlotBytes * (latencyFramesSubmitted % latencySlots);
+	if (cameraMapping) {
+		memcpy(cameraMapping + offset, glm::value_ptr(view), sizeof(glm::mat4));
+		memcpy(cameraMapping + offset + sizeof(glm::mat4), glm::value_ptr(projection), sizeof(glm::mat4));
+	} else {
+		static bool warned = false;
+		if (!warned)
+			cout<<"ARB_buffer_storage isn't supported, the late-latched camera is uploaded with glBufferSubData"<<endl;
+		warned = true;
+
+		glBindBuffer(GL_UNIFORM_BUFFER, cameraUBO);
+		glBufferSubData(GL_UNIFORM_BUFFER, offset, sizeof(glm::mat4), glm::value_ptr(view));
+		glBufferSubData(GL_UNIFORM_BUFFER, offset + sizeof(glm::mat4), sizeof(glm::mat4), glm::value_ptr(projection));
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+	glBindBufferRange(GL_UNIFORM_BUFFER, cameraBlockBinding, cameraUBO, offset, 2 * sizeof(glm::mat4));
+
+	lateLatchThisFrame = true;
+}
+
+/* Runs the keyboard and resize handlers the late latch deferred, after the frame is swapped */
+void URunDeferredInput(void)
+{
+	if (deferredResize) {
+		deferredResize = false;
+		UResizeWindow(deferredWidth, deferredHeight);
+	}
+
+	// Swapped out first, a key that draws frames of its own may defer more
+	vector<DeferredKey> keys;
+	keys.swap(deferredKeys);
+	for (const DeferredKey& deferred : keys)
+		UKeyboard(deferred.key, deferred.x, deferred.y);
+}
+
+/* Prints the input latency percentiles since the last report */
+void UReportLatency(void)
+{
+	auto print = [](const char* name, vector<double>& samples) {
+		sort(samples.begin(), samples.end());
+		auto percentile = [&](double p) { return samples[min(samples.size() - 1, (size_t)(p * samples.size()))]; };
+		cout<<"  "<<name<<": median "<<percentile(0.5)<<" ms, 95th "<<percentile(0.95)<<" ms, 99th "
+			<<percentile(0.99)<<" ms, max "<<samples.back()<<" ms"<<endl;
+		samples.clear();
+	};
+
+	if (!inputToSubmit.empty()) {
+		cout<<"Input latency over "<<inputToSubmit.size()<<" events with late latching "<<(lateLatchEnabled ? "enabled" : "disabled")
+			<<", at most "<<maxQueuedFrames<<" queued frames:"<<endl;
+		print("to swap", inputToSubmit);
+		print("to GPU timestamp", inputToGPU);
+		print("to fence seen", inputToFence);
+	}
+	cout<<"Waited "<<queuedFrameWait * 1000.0<<" ms on queued frames over "<<statsReportInterval<<" frames"<<endl;
+	queuedFrameWait = 0.0;
+
+	// The two clocks drift apart over time
+	CalibrateGPUClock();
+}
+
+/* POSTER */
+
+/* Bytes in the PPM header, the pixels follow it row by row from the top */
+static unsigned long long PosterHeaderBytes(void)
+{
+	return snprintf(NULL, 0, "P6\n%d %d\n255\n", posterWidth, posterHeight);
+}
+
+/* Writes bytes at an offset in the poster, workers never share a file position */
+static bool WritePoster(FILE* file, unsigned long long offset, const GLubyte* data, size_t bytes)
+{
+#ifdef _WIN32
+	return _fseeki64(file, offset, SEEK_SET) == 0 && fwrite(data, 1, bytes, file) == bytes;
+#else
+	return pwrite(fileno(file), data, bytes, offset) == (ssize_t)bytes;
+#endif
+}
+
+/* Largest resident set in MB, of this process or of its largest finished child */
+static double PeakMemoryMB(bool children)
+{
+#ifdef _WIN32
+	return 0.0;
+#else
+	struct rusage usage;
+	getrusage(children ? RUSAGE_CHILDREN : RUSAGE_SELF, &usage);
+	return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+/* Creates the poster file and forks the worker processes
+ * Returns the exit status in the process that started the workers, or -1
+ * in a worker, which goes on to open its window and render tiles.
+ */
+int UStartPosterWorkers(void)
+{
+	if (posterHeight <= 0)
+		posterHeight = max(1, (GLint)((long long)posterWidth * windowHeight / windowWidth));
+
+	GLint tilesX = (posterWidth + posterTileSize - 1) / posterTileSize;
+	GLint tilesY = (posterHeight + posterTileSize - 1) / posterTileSize;
+	GLint tileCount = tilesX * tilesY;
+
+	// Sized up front so every worker can write its rows in place
+	FILE* file = fopen(posterPath.c_str(), "wb");
+	if (!file) {
+		cerr<<"Cannot write "<<posterPath<<endl;
+		return EXIT_FAILURE;
+	}
+	fprintf(file, "P6\n%d %d\n255\n", posterWidth, posterHeight);
+	fflush(file);
+	GLubyte last = 0;
+	bool sized = WritePoster(file, PosterHeaderBytes() + 3ull * posterWidth * posterHeight - 1, &last, 1);
+	fclose(file);
+	if (!sized) {
+		cerr<<"Cannot size "<<posterPath<<" for a "<<posterWidth<<"x"<<posterHeight<<" image"<<endl;
+		return EXIT_FAILURE;
+	}
+
+	GLint workers = posterWorkers > 0 ? posterWorkers : max(1u, thread::hardware_concurrency());
+	workers = min(workers, tileCount);
+	cout<<"Rendering a "<<posterWidth<<"x"<<posterHeight<<" poster as "<<tileCount<<" tiles of "<<posterTileSize
+		<<" pixels on "<<workers<<" worker processes"<<endl;
+
+#ifdef _WIN32
+	// No fork, this process renders every tile
+	static PosterProgress progress;
+	posterProgress = &progress;
+	return -1;
+#else
+	// The tile counter lives in memory the workers share
+	void* shared = mmap(NULL, sizeof(PosterProgress), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		cerr<<"Cannot share the poster tile counter"<<endl;
+		return EXIT_FAILURE;
+	}
+	posterProgress = new (shared) PosterProgress();
+
+	if (workers == 1)
+		return -1;
+
+	// Buffered output would be printed again by every worker
+	cout.flush();
+	fflush(stdout);
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	vector<pid_t> children;
+	for (GLint i = 0; i < workers; i++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			posterWorkerIndex = i;
+			return -1;
+		}
+		if (pid < 0) {
+			cerr<<"Cannot start poster worker "<<i<<endl;
+			break;
+		}
+		children.push_back(pid);
+	}
+
+	// Renders in this process after all when no worker could be started
+	if (children.empty())
+		return -1;
+
+	int status = EXIT_SUCCESS;
+	for (pid_t pid : children) {
+		int childStatus = 0;
+		if (waitpid(pid, &childStatus, 0) < 0 || !WIFEXITED(childStatus) || WEXITSTATUS(childStatus) != EXIT_SUCCESS)
+			status = EXIT_FAILURE;
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	GLint tilesDone = posterProgress->tilesDone;
+	if (tilesDone < tileCount) {
+		cerr<<"Only "<<tilesDone<<" of "<<tileCount<<" poster tiles were rendered"<<endl;
+		status = EXIT_FAILURE;
+	}
+
+	cout<<"Poster: "<<tilesDone<<" tiles in "<<seconds<<" s including worker startup, "<<tilesDone / seconds
+		<<" tiles per second, peak memory "<<PeakMemoryMB(true)<<" MB per worker against "
+		<<3.0 * posterWidth * posterHeight / (1024.0 * 1024.0)<<" MB for the whole image, written to "<<posterPath<<endl;
+
+	munmap(shared, sizeof(PosterProgress));
+	return status;
+#endif
+}
+
+/* Crops a projection to the pixels x, y, width, height of the poster, y down from the top
+ * The tile's part of clip space is scaled and moved to cover all of it, depth is unchanged.
+ */
+glm::mat4 UPosterTileProjection(const glm::mat4& projection, GLint x, GLint y, GLint width, GLint height)
+{
+	glm::mat4 crop(1.0f);
+	crop[0][0] = (GLfloat)posterWidth / width;
+	crop[1][1] = (GLfloat)posterHeight / height;
+	crop[3][0] = (GLfloat)(posterWidth - 2 * x - width) / width;
+	crop[3][1] = -(GLfloat)(posterHeight - 2 * y - height) / height;
+	return crop * projection;
+}
+
+/* Claims tiles until none are left and writes them into the poster */
+int URenderPosterTiles(void)
+{
+	GLint tilesX = (posterWidth + posterTileSize - 1) / posterTileSize;
+	GLint tilesY = (posterHeight + posterTileSize - 1) / posterTileSize;
+	GLint tileCount = tilesX * tilesY;
+
+	// A tile larger than a renderbuffer or a viewport is drawn in pieces
+	GLint maxRenderbuffer = 0, maxViewport[2] = { 0, 0 };
+	glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &maxRenderbuffer);
+	glGetIntegerv(GL_MAX_VIEWPORT_DIMS, maxViewport);
+	GLint pieceSize = min(posterTileSize, min(maxRenderbuffer, min(maxViewport[0], maxViewport[1])));
+
+	GLuint fbo, renderbuffers[2];
+	glGenFramebuffers(1, &fbo);
+	glGenRenderbuffers(2, renderbuffers);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, pieceSize, pieceSize);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, pieceSize, pieceSize);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		cerr<<"Poster framebuffer of "<<pieceSize<<" pixels is incomplete"<<endl;
+		return EXIT_FAILURE;
+	}
+
+	FILE* file = fopen(posterPath.c_str(), "r+b");
+	if (!file) {
+		cerr<<"Cannot open "<<posterPath<<endl;
+		return EXIT_FAILURE;
+	}
+
+	// No mouse event has set the camera direction, the first interactive frame's is used unless a scene file set one
+	if (front == glm::vec3(0.0f))
+		front = glm::vec3(10.0f * cos(yaw), 10.0f * sin(pitch), sin(yaw) * cos(pitch) * 10.0f);
+
+	// The window camera with the poster's aspect ratio
+	glm::mat4 view, projection;
+	UComputeCamera(view, projection);
+	projection = glm::perspective(fieldOfView, (GLfloat)posterWidth / (GLfloat)posterHeight, 0.1f, 100.0f);
+
+	// Every chair at full detail, nothing culled by the window's occlusion
+	for (SceneObject& object : sceneObjects) {
+		object.lod = 0;
+		object.occluded = false;
+	}
+
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	vector<GLubyte> pixels(3 * pieceSize * pieceSize);
+	unsigned long long headerBytes = PosterHeaderBytes();
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	GLint tilesRendered = 0;
+	bool written = true;
+
+	for (GLint tile = posterProgress->nextTile++; tile < tileCount && written; tile = posterProgress->nextTile++) {
+
+		GLint tileX = (tile % tilesX) * posterTileSize;
+		GLint tileY = (tile / tilesX) * posterTileSize;
+		GLint tileWidth = min(posterTileSize, posterWidth - tileX);
+		GLint tileHeight = min(posterTileSize, posterHeight - tileY);
+
+		for (GLint y = tileY; y < tileY + tileHeight && written; y += pieceSize) {
+			for (GLint x = tileX; x < tileX + tileWidth && written; x += pieceSize) {
+
+				GLint width = min(pieceSize, tileX + tileWidth - x);
+				GLint height = min(pieceSize, tileY + tileHeight - y);
+
+				glViewport(0, 0, width, height);
+				glEnable(GL_DEPTH_TEST);
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				UDrawScene(view, UPosterTileProjection(projection, x, y, width, height));
+
+				// GL rows go up from the bottom, the poster's rows go down from the top
+				glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+				for (GLint row = 0; row < height && written; row++) {
+					unsigned long long offset = headerBytes + 3ull * ((unsigned long long)(y + height - 1 - row) * posterWidth + x);
+					written = WritePoster(file, offset, &pixels[3 * row * width], 3 * width);
+				}
+			}
+		}
+
+		if (written) {
+			tilesRendered++;
+			posterProgress->tilesDone++;
+		}
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	fclose(file);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteRenderbuffers(2, renderbuffers);
+
+	if (!written) {
+		cerr<<"Cannot write "<<posterPath<<endl;
+		return EXIT_FAILURE;
+	}
+
+	cout<<"Poster worker "<<max(0, posterWorkerIndex)<<": "<<tilesRendered<<" tiles in "<<seconds<<" s, "
+		<<tilesRendered / max(seconds, 1e-9)<<" tiles per second, peak memory "<<PeakMemoryMB(false)<<" MB"<<endl;
+
+	// Without workers this process is the whole poster
+	if (posterWorkerIndex < 0)
+		cout<<"Poster: "<<tilesRendered<<" of "<<tileCount<<" tiles, "<<3.0 * posterWidth * posterHeight / (1024.0 * 1024.0)
+			<<" MB image written to "<<posterPath<<endl;
+
+	return EXIT_SUCCESS;
+}